@@ -0,0 +1,6 @@
+TEMPLATE = subdirs
+
+# Benchmarks of libqcli, build the library first
+SUBDIRS += \
+    hostconvert \
+    qclibench
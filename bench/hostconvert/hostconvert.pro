@@ -0,0 +1,19 @@
+TEMPLATE = app
+
+TARGET = hostconvert
+
+CONFIG += qt warn_on release
+QT += core opengl
+
+DESTDIR = bin
+OBJECTS_DIR = obj
+MOC_DIR = obj
+
+LIBS += -L../../libqcli/bin -lqcli
+INCLUDEPATH += ../../libqcli/src
+QMAKE_LFLAGS += -Wl,-R,\'../../../libqcli/bin\'
+
+QMAKE_CXX = g++
+QMAKE_CXXFLAGS = -std=c++11 -march=native -O3 -fomit-frame-pointer -fPIC
+
+SOURCES += main.cpp
@@ -0,0 +1,156 @@
+#include <QtCore>
+#include <QCLI>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+using namespace QCLI;
+
+// Host pixel conversion benchmark: checks that the vectorized conversions give
+// the same bytes as the scalar reference, on images derived from 8-bit data and
+// on edge values (NaN, infinities, out of range, subnormals), and measures their
+// throughput.
+//
+// Usage: hostconvert [width height [iterations]]
+
+static const IFmt formats[]= { IFmt::ARGB, IFmt::ARGB16, IFmt::ARGB16F, IFmt::ARGB32F,
+                               IFmt::LUMA, IFmt::LUMA16, IFmt::LUMA16F, IFmt::LUMA32F };
+static const char* formatNames[]= { "ARGB", "ARGB16", "ARGB16F", "ARGB32F",
+                                    "LUMA", "LUMA16", "LUMA16F", "LUMA32F" };
+static const char* levelNames[]= { "scalar", "sse2", "avx2" };
+
+// Values where the vectorized clamping and rounding most often differ from the
+// scalar code: NaN, infinities, negative and out of range values, the 8 and 16
+// bit rounding boundaries, and the half subnormals
+static const float specialFloats[]= { NAN, -NAN, INFINITY, -INFINITY, -0.0f, -1.0f, -1e-8f, 1.0f, 1.5f, 65504.0f,
+                                      1e30f, 0.5f / 255, 1.5f / 255, 254.5f / 255, 0.5f / 65535, 65534.5f / 65535,
+                                      5.96046448e-8f, 6.09755516e-5f, 6.10351562e-5f, 1e-45f };
+static const quint16 specialHalfs[]= { 0x7E00, 0xFE00, 0x7C01, 0x7C00, 0xFC00, 0x8000, 0xBC00, 0x8001, 0x3C00,
+                                       0x3E00, 0x7BFF, 0x1C04, 0x0001, 0x03FF, 0x0400, 0x83FF, 0x3BFF, 0x3C01 };
+
+// Returns random bits
+static quint32 randomBits()
+{
+    return (quint32)(qrand() & 0xFFFF) << 16 | (quint32)(qrand() & 0xFFFF);
+}
+
+// Returns a source of a format alternating the special values with random bits,
+// which cover the whole range of each channel type (NaN payloads included)
+static QByteArray edgeSource(IFmt format, int width, int height)
+{
+    const int values= width * height * iFmtChanCount(format);
+    const int valueBytes= iFmtBPP(format) / 8 / iFmtChanCount(format);
+    QByteArray src(values * valueBytes, 0);
+    for(int i=0; i<values; i++) {
+        const quint32 bits= randomBits();
+        if(valueBytes == 4) {
+            const int count= sizeof(specialFloats) / sizeof(float);
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            if(i % 2)
+                value= specialFloats[(i / 2) % count];
+            memcpy(src.data() + (size_t)i * 4, &value, sizeof(value));
+        } else if(valueBytes == 2) {
+            const bool half= format == IFmt::ARGB16F or format == IFmt::LUMA16F;
+            const int count= sizeof(specialHalfs) / sizeof(quint16);
+            const quint16 value= half and i % 2 ? specialHalfs[(i / 2) % count] : (quint16)bits;
+            memcpy(src.data() + (size_t)i * 2, &value, sizeof(value));
+        } else {
+            src[i]= (char)bits;
+        }
+    }
+    return src;
+}
+
+// Checks that every level and the threaded conversion give the bytes of the scalar code
+static bool checkEdges(IFmt srcFormat, const char* srcName, int width, int height, int levels)
+{
+    const QByteArray src= edgeSource(srcFormat, width, height);
+    bool exact= true;
+    for(int d=0; d<8; d++) {
+        if(formats[d] == srcFormat)
+            continue;
+        const int dstBytes= width * height * iFmtBPP(formats[d]) / 8;
+        QByteArray reference(dstBytes, 0);
+        convertPixels(src.constData(), srcFormat, 0, reference.data(), formats[d], 0, width, height,
+                      SimdLevel::Scalar, 1);
+        QByteArray dst(dstBytes, 0);
+        for(int level=0; level<=levels; level++) {
+            const bool threaded= level == levels;
+            convertPixels(src.constData(), srcFormat, 0, dst.data(), formats[d], 0, width, height,
+                          (SimdLevel)(threaded ? levels - 1 : level), threaded ? 0 : 1);
+            if(dst != reference) {
+                printf("Edge values %s -> %s: %s MISMATCH\n", srcName, formatNames[d],
+                       threaded ? "threaded" : levelNames[level]);
+                exact= false;
+            }
+        }
+    }
+    return exact;
+}
+
+// Returns megapixels per second of a conversion
+static double throughput(const QByteArray& src, IFmt srcFormat, QByteArray& dst, IFmt dstFormat,
+                         int width, int height, SimdLevel level, int threadCount, int iterations)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for(int i=0; i<iterations; i++)
+        convertPixels(src.constData(), srcFormat, 0, dst.data(), dstFormat, 0, width, height, level, threadCount);
+    const double seconds= timer.nsecsElapsed() * 1e-9;
+    return (double)width * height * iterations / seconds * 1e-6;
+}
+
+int main(int argc, char** argv)
+{
+    const int width= argc > 2 ? atoi(argv[1]) : 1920;
+    const int height= argc > 2 ? atoi(argv[2]) : 1080;
+    const int iterations= argc > 3 ? atoi(argv[3]) : 20;
+    const int levels= (int)hostSimdLevel() + 1;
+    printf("Host conversions %dx%d, %d iterations, best level %s, %d threads (Mpixel/s)\n",
+           width, height, iterations, levelNames[levels-1], QThread::idealThreadCount());
+
+    // Random ARGB source, converted to the other formats by the scalar code
+    QByteArray argb(width * height * 4, 0);
+    qsrand(1);
+    for(int i=0; i<argb.size(); i++)
+        argb[i]= (char)(qrand() & 0xFF);
+
+    bool exact= true;
+    for(int s=0; s<8; s++) {
+        QByteArray src(width * height * iFmtBPP(formats[s]) / 8, 0);
+        convertPixels(argb.constData(), IFmt::ARGB, 0, src.data(), formats[s], 0, width, height,
+                      SimdLevel::Scalar, 1);
+
+        for(int d=0; d<8; d++) {
+            if(s == d)
+                continue;
+            const int dstBytes= width * height * iFmtBPP(formats[d]) / 8;
+            QByteArray reference(dstBytes, 0);
+            convertPixels(src.constData(), formats[s], 0, reference.data(), formats[d], 0, width, height,
+                          SimdLevel::Scalar, 1);
+
+            printf("%-8s -> %-8s", formatNames[s], formatNames[d]);
+            QByteArray dst(dstBytes, 0);
+            for(int level=0; level<levels; level++) {
+                const double mpps= throughput(src, formats[s], dst, formats[d], width, height,
+                                              (SimdLevel)level, 1, iterations);
+                const bool same= dst == reference;
+                exact= exact and same;
+                printf("  %s %8.1f%s", levelNames[level], mpps, same ? "" : " MISMATCH");
+            }
+            const double mpps= throughput(src, formats[s], dst, formats[d], width, height,
+                                          (SimdLevel)(levels-1), 0, iterations);
+            exact= exact and dst == reference;
+            printf("  threaded %8.1f%s\n", mpps, dst == reference ? "" : " MISMATCH");
+        }
+    }
+
+    // Inputs outside of what 8-bit sources produce
+    for(int s=0; s<8; s++)
+        exact= checkEdges(formats[s], formatNames[s], width, height, levels) and exact;
+
+    printf(exact ? "All conversions are bit-exact\n" : "Some conversions are NOT bit-exact\n");
+    return exact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,605 @@
+#include <QtCore>
+#include <QCLI>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+
+using namespace std;
+using namespace QCLI;
+
+// Library benchmark suite: transfer bandwidth, kernel launch overhead and its
+// scaling with the number of threads, context initialization, QImage
+// conversion throughput and Gaussian blur throughput. The results are written as
+// JSON, with the percentiles of the timed runs and a description of the host
+// and the device, to compare library versions and machines.
+//
+// Usage: qclibench [options]
+//   --output file       writes the JSON to file instead of stdout
+//   --filter text       only runs the benchmarks whose name contains text
+//   --warmup n          untimed runs before each benchmark (3)
+//   --iterations n      timed runs of each benchmark (20)
+//   --device-type type  gpu, cpu or all (all)
+//   --device i          index of the device used (0)
+//   --label text        stored in the results, e.g. the library version
+//   --init-once         (internal) prints the initialization times of this process
+
+static const IFmt formats[]= { IFmt::ARGB, IFmt::ARGB16, IFmt::ARGB16F, IFmt::ARGB32F,
+                               IFmt::LUMA, IFmt::LUMA16, IFmt::LUMA16F, IFmt::LUMA32F };
+static const char* formatNames[]= { "ARGB", "ARGB16", "ARGB16F", "ARGB32F",
+                                    "LUMA", "LUMA16", "LUMA16F", "LUMA32F" };
+static const ISize sizes[]= { ISize::VGA, ISize::HD, ISize::FullHD };
+static const char* sizeNames[]= { "VGA", "HD", "FullHD" };
+static const char* policyNames[]= { "Malloc", "Pinned", "ZeroCopy", "Auto" };
+
+// Kernel launches enqueued per run of launch.enqueue
+static const int launchBatch= 100;
+// Kernel launches enqueued by each thread per run of dispatch
+static const int dispatchLaunches= 200;
+
+// Kernel launched by dispatch
+static const char* copySource=
+    "__constant sampler_t sampler= CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;\n"
+    "__kernel void qclibench_copy(__read_only image2d_t input, __write_only image2d_t output)\n"
+    "{\n"
+    "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+    "    if(pos.x < get_image_width(output) && pos.y < get_image_height(output))\n"
+    "        write_imagef(output, pos, read_imagef(input, sampler, pos));\n"
+    "}\n";
+
+// Gaussian blur reading every pixel of the window with read_imagef, the baseline
+// of the convolution benchmarks
+static const char* naiveBlurSource=
+    "__constant sampler_t sampler= CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;\n"
+    "__kernel void qclibench_blur(__read_only image2d_t input, __write_only image2d_t output, int radius, float sigma)\n"
+    "{\n"
+    "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+    "    if(pos.x >= get_image_width(output) || pos.y >= get_image_height(output))\n"
+    "        return;\n"
+    "    float4 sum= 0.0f;\n"
+    "    float total= 0.0f;\n"
+    "    for(int dy= -radius; dy <= radius; dy++) {\n"
+    "        for(int dx= -radius; dx <= radius; dx++) {\n"
+    "            const float weight= exp(-0.5f * (dx * dx + dy * dy) / (sigma * sigma));\n"
+    "            sum+= weight * read_imagef(input, sampler, pos + (int2)(dx, dy));\n"
+    "            total+= weight;\n"
+    "        }\n"
+    "    }\n"
+    "    write_imagef(output, pos, sum / total);\n"
+    "}\n";
+// Sigmas of the convolution benchmarks, only the recursive method runs the largest one
+static const float blurSigmas[]= { 0.5f, 1.0f, 3.0f, 8.0f, 20.0f };
+
+struct Options {
+    QString output;
+    QString filter;
+    int warmup= 3;
+    int iterations= 20;
+    QString deviceType= "all";
+    int device= 0;
+    QString label;
+};
+
+// Timed runs of a benchmark
+struct Result {
+    QString name;
+    QStringList params;      // JSON members
+    QVector<double> wallUs;  // Measured by the host
+    QVector<double> deviceUs;// Measured by the device profiling counters, if any
+    double bytes= 0.0;       // Transferred per run
+    double pixels= 0.0;      // Processed per run
+    double operations= 0.0;  // Operations per run
+    QString error;
+};
+
+// Returns a string as a JSON string literal
+static QString jsonString(const QString& string)
+{
+    QString ret= "\"";
+    foreach(const QChar c, string) {
+        if(c == '"' or c == '\\')
+            ret+= '\\';
+        if(c.unicode() < 0x20)
+            ret+= QString("\\u%1").arg(c.unicode(), 4, 16, QChar('0'));
+        else
+            ret+= c;
+    }
+    return ret + "\"";
+}
+
+static QString jsonMember(const QString& name, const QString& value) { return jsonString(name) + ":" + jsonString(value); }
+static QString jsonMember(const QString& name, double value) { return jsonString(name) + ":" + QString::number(value, 'g', 10); }
+
+// Returns the percentile p (0..100) of sorted samples, by nearest rank
+static double percentile(const QVector<double>& sorted, double p)
+{
+    const int rank= qBound(1, (int)ceil(sorted.count() * p / 100.0), sorted.count());
+    return sorted[rank-1];
+}
+
+// Returns the statistics of samples as a JSON object
+static QString jsonStats(QVector<double> samples)
+{
+    sort(samples.begin(), samples.end());
+    double sum= 0.0;
+    foreach(const double sample, samples)
+        sum+= sample;
+    QStringList members;
+    members << jsonMember("min", samples.first()) << jsonMember("mean", sum / samples.count())
+            << jsonMember("p50", percentile(samples, 50)) << jsonMember("p90", percentile(samples, 90))
+            << jsonMember("p99", percentile(samples, 99)) << jsonMember("max", samples.last());
+    return "{" + members.join(",") + "}";
+}
+
+static QString jsonResult(const Result& result, const Options& options)
+{
+    QStringList members;
+    members << jsonMember("name", result.name) << "\"params\":{" + result.params.join(",") + "}";
+    if(!result.error.isEmpty() or result.wallUs.isEmpty()) {
+        members << jsonMember("error", result.error.isEmpty() ? QString("no samples") : result.error);
+        return "{" + members.join(",") + "}";
+    }
+    members << jsonMember("warmup", options.warmup) << jsonMember("iterations", result.wallUs.count());
+    members << "\"wallUs\":" + jsonStats(result.wallUs);
+    if(result.deviceUs.count() == result.wallUs.count())
+        members << "\"deviceUs\":" + jsonStats(result.deviceUs);
+
+    // Rates of the median run, on the device when it was measured
+    QVector<double> timed= result.deviceUs.count() == result.wallUs.count() ? result.deviceUs : result.wallUs;
+    sort(timed.begin(), timed.end());
+    const double us= percentile(timed, 50);
+    if(result.bytes > 0.0 and us > 0.0)
+        members << jsonMember("bandwidthGBs", result.bytes / us * 1e-3);
+    if(result.pixels > 0.0 and us > 0.0)
+        members << jsonMember("mpixelsPerSecond", result.pixels / us);
+    if(result.operations > 0.0 and us > 0.0)
+        members << jsonMember("operationsPerSecond", result.operations / us * 1e6);
+    return "{" + members.join(",") + "}";
+}
+
+// Returns the duration of the command of an event in us, -1 if it is not available
+static double deviceUs(const Event& event)
+{
+    const cl_ulong start= event.profilingInfo(CL_PROFILING_COMMAND_START);
+    const cl_ulong end= event.profilingInfo(CL_PROFILING_COMMAND_END);
+    return start and end >= start ? (end - start) * 1e-3 : -1.0;
+}
+
+// Runs a benchmark: setup prepares each run untimed, run does the timed work and
+// returns the event of the timed command (or a null Event), batch operations per run
+static void measure(Result& result, const Options& options, function<bool()> setup,
+                    function<bool(Event*)> run, int batch= 1)
+{
+    QElapsedTimer timer;
+    for(int i=0; i<options.warmup + options.iterations; i++) {
+        Event event;
+        if(!setup()) {
+            result.error= "setup failed";
+            return;
+        }
+        timer.start();
+        const bool ok= run(&event);
+        const double us= timer.nsecsElapsed() * 1e-3 / batch;
+        if(!ok) {
+            result.error= "run failed";
+            return;
+        }
+        if(i < options.warmup)
+            continue;
+        result.wallUs << us;
+        const double device= deviceUs(event);
+        if(device >= 0.0)
+            result.deviceUs << device;
+    }
+}
+
+// Returns a device info string
+static QString deviceString(cl_device_id device, cl_device_info param)
+{
+    char value[1024]= { 0 };
+    clGetDeviceInfo(device, param, sizeof(value) - 1, value, nullptr);
+    return QString::fromLatin1(value).trimmed();
+}
+
+// Returns a numeric device info
+template<typename T>
+static double deviceNumber(cl_device_id device, cl_device_info param)
+{
+    T value= 0;
+    clGetDeviceInfo(device, param, sizeof(value), &value, nullptr);
+    return (double)value;
+}
+
+// Returns the description of the host and the device as JSON members
+static QStringList describe(int devId, const Options& options)
+{
+    const cl_device_id device= devMgr().device(devId);
+    char platform[1024]= { 0 };
+    clGetPlatformInfo(devMgr().platform(), CL_PLATFORM_NAME, sizeof(platform) - 1, platform, nullptr);
+    char platformVersion[1024]= { 0 };
+    clGetPlatformInfo(devMgr().platform(), CL_PLATFORM_VERSION, sizeof(platformVersion) - 1, platformVersion, nullptr);
+
+    QStringList host;
+    host << jsonMember("threads", QThread::idealThreadCount())
+         << jsonMember("simdLevel", QString(hostSimdLevel() == SimdLevel::AVX2 ? "avx2" :
+                                            hostSimdLevel() == SimdLevel::SSE2 ? "sse2" : "scalar"))
+         << jsonMember("qt", QString(qVersion()))
+#ifdef __VERSION__
+         << jsonMember("compiler", QString(__VERSION__))
+#endif
+         << jsonMember("built", QString(__DATE__ " " __TIME__));
+
+    QStringList dev;
+    dev << jsonMember("index", devId)
+        << jsonMember("name", deviceString(device, CL_DEVICE_NAME))
+        << jsonMember("vendor", deviceString(device, CL_DEVICE_VENDOR))
+        << jsonMember("version", deviceString(device, CL_DEVICE_VERSION))
+        << jsonMember("driver", deviceString(device, CL_DRIVER_VERSION))
+        << jsonMember("platform", QString::fromLatin1(platform).trimmed())
+        << jsonMember("platformVersion", QString::fromLatin1(platformVersion).trimmed())
+        << jsonMember("computeUnits", deviceNumber<cl_uint>(device, CL_DEVICE_MAX_COMPUTE_UNITS))
+        << jsonMember("clockMHz", deviceNumber<cl_uint>(device, CL_DEVICE_MAX_CLOCK_FREQUENCY))
+        << jsonMember("globalMemBytes", deviceNumber<cl_ulong>(device, CL_DEVICE_GLOBAL_MEM_SIZE))
+        << jsonMember("localMemBytes", deviceNumber<cl_ulong>(device, CL_DEVICE_LOCAL_MEM_SIZE))
+        << jsonMember("hostUnifiedMemory", devMgr().hostUnifiedMemory(devId) ? 1 : 0);
+
+    QStringList ret;
+    ret << jsonMember("label", options.label)
+        << jsonMember("date", QDateTime::currentDateTime().toString(Qt::ISODate))
+        << "\"host\":{" + host.join(",") + "}"
+        << "\"device\":{" + dev.join(",") + "}";
+    return ret;
+}
+
+static cl_device_type deviceType(const QString& name)
+{
+    if(name == "gpu")
+        return CL_DEVICE_TYPE_GPU;
+    if(name == "cpu")
+        return CL_DEVICE_TYPE_CPU;
+    return CL_DEVICE_TYPE_ALL;
+}
+
+//
+// Benchmarks
+//
+
+// Context and device manager initialization, each run in a new process
+static void benchInit(QList<Result>& results, const Options& options)
+{
+    Result deviceManager, context;
+    deviceManager.name= "init.deviceManager";
+    context.name= "init.context";
+    deviceManager.params << jsonMember("deviceType", options.deviceType);
+    context.params= deviceManager.params;
+
+    for(int i=0; i<options.warmup + options.iterations; i++) {
+        QProcess process;
+        process.start(QCoreApplication::applicationFilePath(),
+                      QStringList() << "--init-once" << "--device-type" << options.deviceType);
+        const QStringList times= process.waitForFinished(60000) ?
+                                 QString::fromLatin1(process.readAllStandardOutput()).split(' ') : QStringList();
+        if(process.exitCode() != 0 or times.count() != 2) {
+            deviceManager.error= context.error= "initialization failed";
+            break;
+        }
+        if(i < options.warmup)
+            continue;
+        deviceManager.wallUs << times[0].toDouble() * 1e-3;
+        context.wallUs << times[1].toDouble() * 1e-3;
+    }
+    results << deviceManager << context;
+}
+
+// Upload and download of each format and size
+static void benchTransfers(QList<Result>& results, const Options& options)
+{
+    const PixelKernel copy("y= x;");
+    for(int s=0; s<3; s++) {
+        for(int f=0; f<8; f++) {
+            Image image(sizes[s], formats[f], options.device, false, true, true);
+            Image source(sizes[s], formats[f], options.device, false, true, true);
+            const int bytes= iSizeWidth(sizes[s]) * iSizeHeight(sizes[s]) * iFmtBPP(formats[f]) / 8;
+            QByteArray data(bytes, 0);
+            for(int i=0; i<bytes; i++)
+                data[i]= (char)(qrand() & 0xFF);
+
+            QStringList params;
+            params << jsonMember("format", formatNames[f]) << jsonMember("size", sizeNames[s])
+                   << jsonMember("width", iSizeWidth(sizes[s])) << jsonMember("height", iSizeHeight(sizes[s]))
+                   << jsonMember("allocPolicy", policyNames[(int)image.allocPolicy()]);
+
+            Result upload;
+            upload.name= "upload";
+            upload.params= params;
+            upload.bytes= bytes;
+            measure(upload, options,
+                    [&]() { return image.fromData(data.constData()); },
+                    [&](Event* event) { *event= image.uploadAsync(); return !event->isNull() and event->wait(); });
+            results << upload;
+
+            // The copy kernel leaves the device data as the only valid one
+            Result download;
+            download.name= "download";
+            download.params= params;
+            download.bytes= bytes;
+            source.fromData(data.constData());
+            measure(download, options,
+                    [&]() { return copy.runImages(QVector<Image*>() << &source << &image) and image.devEvent().wait(); },
+                    [&](Event* event) { *event= image.downloadAsync(); return !event->isNull() and event->wait(); });
+            results << download;
+        }
+    }
+}
+
+// Host cost of a kernel launch, and launch to completion latency
+static void benchLaunch(QList<Result>& results, const Options& options)
+{
+    const PixelKernel copy("y= x;");
+    Image input(16, 16, IFmt::ARGB, options.device, true, false, true);
+    Image output(16, 16, IFmt::ARGB, options.device, true, false, true);
+    const QVector<Image*> images= QVector<Image*>() << &input << &output;
+
+    Result enqueue;
+    enqueue.name= "launch.enqueue";
+    enqueue.params << jsonMember("batch", launchBatch);
+    enqueue.operations= 1;
+    measure(enqueue, options,
+            [&]() { return output.devEvent().wait(); },
+            [&](Event*) {
+                for(int i=0; i<launchBatch; i++) {
+                    if(!copy.runImages(images))
+                        return false;
+                }
+                return true;
+            }, launchBatch);
+    output.devEvent().wait();
+    results << enqueue;
+
+    Result roundTrip;
+    roundTrip.name= "launch.roundTrip";
+    measure(roundTrip, options,
+            []() { return true; },
+            [&](Event* event) {
+                if(!copy.runImages(images))
+                    return false;
+                *event= output.devEvent();
+                return event->wait();
+            });
+    results << roundTrip;
+}
+
+// Launches a kernel shared with the other threads
+class Dispatcher : public QRunnable
+{
+public:
+    Dispatcher(Kernel& kernel, Image& input, Image& output, QAtomicInt* failed)
+        : _kernel(kernel), _input(input), _output(output), _failed(failed) { }
+    void run() {
+        for(int i=0; i<dispatchLaunches; i++) {
+            if(!_kernel(_input, _output)) {
+                _failed->ref();
+                return;
+            }
+        }
+    }
+private:
+    Kernel& _kernel;
+    Image& _input;
+    Image& _output;
+    QAtomicInt* const _failed;
+};
+
+// Launch rate of one Kernel shared by a growing number of threads, each with its own images
+static void benchDispatch(QList<Result>& results, const Options& options)
+{
+    const int maxThreads= qMin(2 * QThread::idealThreadCount(), 64);
+    Kernel kernel(QString::fromLatin1(copySource));
+    QList<Image*> inputs, outputs;
+    for(int i=0; i<maxThreads; i++) {
+        inputs << new Image(16, 16, IFmt::ARGB, options.device, true, false, true);
+        outputs << new Image(16, 16, IFmt::ARGB, options.device, true, false, true);
+    }
+    // The threads are kept, so their copies of the kernel are created once
+    QThreadPool pool;
+    pool.setMaxThreadCount(maxThreads);
+    pool.setExpiryTimeout(-1);
+
+    QList<int> threadCounts;
+    for(int threads=1; threads<maxThreads; threads*=2)
+        threadCounts << threads;
+    threadCounts << maxThreads;
+
+    foreach(const int threads, threadCounts) {
+        Result result;
+        result.name= "dispatch";
+        result.params << jsonMember("threads", threads) << jsonMember("launchesPerThread", dispatchLaunches);
+        result.operations= 1;
+        QAtomicInt failed;
+        measure(result, options,
+                [&]() {
+                    for(int i=0; i<threads; i++) {
+                        if(!outputs[i]->devEvent().wait())
+                            return false;
+                    }
+                    return true;
+                },
+                [&](Event*) {
+                    for(int i=0; i<threads; i++)
+                        pool.start(new Dispatcher(kernel, *inputs[i], *outputs[i], &failed));
+                    pool.waitForDone();
+                    return !failed;
+                }, threads * dispatchLaunches);
+        results << result;
+    }
+
+    foreach(Image* output, outputs)
+        output->devEvent().wait();
+    qDeleteAll(inputs);
+    qDeleteAll(outputs);
+}
+
+// QImage to each format, converted on the host or on the device
+static void benchFromQImage(QList<Result>& results, const Options& options)
+{
+    for(int s=0; s<3; s++) {
+        QImage qimage(iSizeWidth(sizes[s]), iSizeHeight(sizes[s]), QImage::Format_ARGB32);
+        uchar* const bits= qimage.bits();
+        for(int i=0; i<qimage.byteCount(); i++)
+            bits[i]= (uchar)(qrand() & 0xFF);
+
+        for(int f=0; f<8; f++) {
+            for(int onDevice=0; onDevice<2; onDevice++) {
+                // ARGB images are copied to the host in both cases
+                if(onDevice and toQtFormat(formats[f]) != QImage::Format_Invalid)
+                    continue;
+                Image image(sizes[s], formats[f], options.device, false, !onDevice, onDevice);
+                Result result;
+                result.name= onDevice ? "fromQImage.device" : "fromQImage.host";
+                result.params << jsonMember("format", formatNames[f]) << jsonMember("size", sizeNames[s])
+                              << jsonMember("width", iSizeWidth(sizes[s]))
+                              << jsonMember("height", iSizeHeight(sizes[s]));
+                result.pixels= (double)iSizeWidth(sizes[s]) * iSizeHeight(sizes[s]);
+                measure(result, options,
+                        []() { return true; },
+                        [&](Event*) { return image.fromQImage(qimage) and image.devEvent().wait(); });
+                results << result;
+            }
+        }
+    }
+}
+
+// Gaussian blur of a FullHD image with each method, and with the naive kernel
+static void benchConvolution(QList<Result>& results, const Options& options)
+{
+    static const char* methodNames[]= { "auto", "direct", "separable", "recursive" };
+    Kernel naive(QString::fromLatin1(naiveBlurSource));
+    Image input(ISize::FullHD, IFmt::ARGB, options.device, true, false, true);
+    Image output(ISize::FullHD, IFmt::ARGB, options.device, true, false, true);
+    const double pixels= (double)iSizeWidth(ISize::FullHD) * iSizeHeight(ISize::FullHD);
+
+    for(const float sigma: blurSigmas) {
+        const int radius= Convolution::gaussianRadius(sigma);
+        // -1 is the naive kernel, the others are the Convolution methods
+        for(int m=-1; m<4; m++) {
+            // Only the recursive method supports the largest radiuses, the naive and
+            // direct passes would read (2 * radius + 1)^2 pixels anyway
+            const Convolution::Method method= m < 0 ? Convolution::Method::Direct : (Convolution::Method)m;
+            if(method != Convolution::Method::Auto and method != Convolution::Method::Recursive
+               and radius > Convolution::maxSeparableRadius)
+                continue;
+
+            Result result;
+            result.name= m < 0 ? "convolution.naive" : QString("convolution.") + methodNames[m];
+            result.params << jsonMember("sigma", sigma) << jsonMember("radius", radius)
+                          << jsonMember("size", "FullHD");
+            result.pixels= pixels;
+            if(method == Convolution::Method::Auto)
+                result.params << jsonMember("method", methodNames[(int)Convolution::gaussianMethod(sigma)]);
+            const Convolution blur= Convolution::gaussian(sigma, method);
+            measure(result, options,
+                    [&]() { return output.devEvent().wait(); },
+                    [&](Event*) {
+                        const bool ok= m < 0 ? naive(input, output, radius, sigma) : blur.run(input, output);
+                        return ok and output.devEvent().wait();
+                    });
+            results << result;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    Options options;
+    bool initOnce= false;
+    const QStringList args= app.arguments();
+    for(int i=1; i<args.count(); i++) {
+        const QString option= args[i];
+        if(option == "--init-once")
+            initOnce= true;
+        else if(option == "--output" and ++i < args.count())
+            options.output= args[i];
+        else if(option == "--filter" and ++i < args.count())
+            options.filter= args[i];
+        else if(option == "--warmup" and ++i < args.count())
+            options.warmup= qMax(args[i].toInt(), 0);
+        else if(option == "--iterations" and ++i < args.count())
+            options.iterations= qMax(args[i].toInt(), 1);
+        else if(option == "--device-type" and ++i < args.count())
+            options.deviceType= args[i];
+        else if(option == "--device" and ++i < args.count())
+            options.device= args[i].toInt();
+        else if(option == "--label" and ++i < args.count())
+            options.label= args[i];
+        else {
+            fprintf(stderr, "Invalid option %s\n", qPrintable(option));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Child process of benchInit()
+    if(initOnce) {
+        QElapsedTimer timer;
+        timer.start();
+        if(devMgr().initError())
+            return EXIT_FAILURE;
+        const qint64 deviceManagerNs= timer.nsecsElapsed();
+        timer.start();
+        if(!qcliCtx().init(deviceType(options.deviceType)))
+            return EXIT_FAILURE;
+        printf("%lld %lld", (long long)deviceManagerNs, (long long)timer.nsecsElapsed());
+        return EXIT_SUCCESS;
+    }
+
+    if(!qcliCtx().init(deviceType(options.deviceType)) or !devMgr().validId(options.device)) {
+        fprintf(stderr, "Could not initialize the device %d\n", options.device);
+        return EXIT_FAILURE;
+    }
+    qsrand(1);
+
+    // Benchmark functions and the prefixes of the names of their results
+    typedef void (*Benchmark)(QList<Result>&, const Options&);
+    const QList<QPair<QString, Benchmark>> benchmarks= QList<QPair<QString, Benchmark>>()
+        << qMakePair(QString("init"), &benchInit)
+        << qMakePair(QString("upload download"), &benchTransfers)
+        << qMakePair(QString("launch"), &benchLaunch)
+        << qMakePair(QString("dispatch"), &benchDispatch)
+        << qMakePair(QString("fromQImage"), &benchFromQImage)
+        << qMakePair(QString("convolution"), &benchConvolution);
+
+    QList<Result> results;
+    for(int i=0; i<benchmarks.count(); i++) {
+        bool selected= options.filter.isEmpty();
+        foreach(const QString& prefix, benchmarks[i].first.split(' '))
+            selected= selected or prefix.contains(options.filter) or options.filter.startsWith(prefix);
+        if(!selected)
+            continue;
+        fprintf(stderr, "Running %s...\n", qPrintable(benchmarks[i].first));
+        benchmarks[i].second(results, options);
+    }
+
+    QStringList resultsJson;
+    foreach(const Result& result, results) {
+        if(options.filter.isEmpty() or result.name.contains(options.filter))
+            resultsJson << "    " + jsonResult(result, options);
+    }
+    const QString json= "{\n  " + describe(options.device, options).join(",\n  ") + ",\n  \"results\":[\n"
+                        + resultsJson.join(",\n") + "\n  ]\n}\n";
+
+    if(options.output.isEmpty()) {
+        printf("%s", json.toUtf8().constData());
+    } else {
+        QFile file(options.output);
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate) or file.write(json.toUtf8()) < 0) {
+            fprintf(stderr, "Could not write %s\n", qPrintable(options.output));
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ok= true;
+    foreach(const Result& result, results)
+        ok= ok and result.error.isEmpty();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
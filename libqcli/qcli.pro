@@ -23,14 +23,54 @@ QMAKE_CXXFLAGS = -std=c++11 -march=native -O3 -fPIC
 HEADERS += \
     src/opencl/context.h \
     src/opencl/devicemanager.h \
+    src/opencl/programmanager.h \
+    src/opencl/imagepool.h \
+    src/opencl/event.h \
+    src/opencl/profiler.h \
+    src/opencl/worksizetuner.h \
+    src/opencl/kernel.h \
+    src/opencl/kernelcache.h \
+    src/opencl/pixelkernel.h \
+    src/opencl/convolution.h \
+    src/opencl/reduction.h \
     src/util/utils.h \
+    src/util/hostconvert.h \
     src/ifmt.h \
     src/image.h \
+    src/imagefile.h \
+    src/imagebatch.h \
+    src/imagepyramid.h \
+    src/batchloader.h \
+    src/graph.h \
+    src/framepipeline.h \
+    src/tilescheduler.h \
+    src/rowstream.h \
+    src/stripestreamer.h \
     src/QCLI
 
 SOURCES += \
     src/opencl/context.cpp \
     src/opencl/devicemanager.cpp \
+    src/opencl/programmanager.cpp \
+    src/opencl/imagepool.cpp \
+    src/opencl/event.cpp \
+    src/opencl/profiler.cpp \
+    src/opencl/worksizetuner.cpp \
+    src/opencl/kernel.cpp \
+    src/opencl/kernelcache.cpp \
+    src/opencl/pixelkernel.cpp \
+    src/opencl/convolution.cpp \
+    src/opencl/reduction.cpp \
     src/util/utils.cpp \
+    src/util/hostconvert.cpp \
     src/ifmt.cpp \
-    src/image.cpp
+    src/image.cpp \
+    src/imagefile.cpp \
+    src/imagebatch.cpp \
+    src/imagepyramid.cpp \
+    src/batchloader.cpp \
+    src/graph.cpp \
+    src/framepipeline.cpp \
+    src/tilescheduler.cpp \
+    src/rowstream.cpp \
+    src/stripestreamer.cpp
@@ -0,0 +1,183 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "batchloader.h"
+
+#include "image.h"
+#include "imagefile.h"
+
+namespace QCLI {
+
+// Suffixes of the files read with ImageFile instead of QImage
+static const char* const mappedSuffixes[]= { "pgm", "ppm", "pnm", "pfm", "qraw" };
+
+/// Loads a file in the thread pool
+class BatchLoader::Decoder : public QRunnable
+{
+public:
+    Decoder(BatchLoader* loader, int index) : _loader(loader), _index(index) { }
+    void run() { _loader->load(_index); }
+private:
+    BatchLoader* const _loader;
+    const int _index;
+};
+
+BatchLoader::BatchLoader(const QStringList& fileNames, int threadCount, qint64 memoryBudget, Order order,
+                         int devId, IFmt format)
+    : _memoryBudget(memoryBudget), _order(order), _devId(devId), _format(format)
+{
+    _pool.setMaxThreadCount(threadCount > 0 ? threadCount : QThread::idealThreadCount());
+    foreach(const QString& fileName, fileNames) {
+        const Item item { fileName, nullptr, 0, false };
+        _items << item;
+    }
+    _stats.loaded= 0;
+    _stats.failed= 0;
+    _stats.decodeMsecs= 0;
+    _stats.waitMsecs= 0;
+    _stats.peakBytes= 0;
+
+    QMutexLocker locker(&_lock);
+    schedule();
+}
+
+BatchLoader::~BatchLoader()
+{
+    {
+        QMutexLocker locker(&_lock);
+        _cancelled= true;
+    }
+    _pool.waitForDone();
+    for(int i=0; i<_items.count(); i++)
+        delete _items[i].image;
+}
+
+Image* BatchLoader::next(QString* fileName)
+{
+    QMutexLocker locker(&_lock);
+    while(_taken < _items.count()) {
+        int index= -1;
+        if(_order == Order::Submission and _items[_taken].done)
+            index= _taken;
+        else if(_order == Order::Completion and !_completed.isEmpty())
+            index= _completed.dequeue();
+        if(index == -1) {
+            QElapsedTimer timer;
+            timer.start();
+            _loaded.wait(&_lock);
+            _stats.waitMsecs+= timer.elapsed();
+            continue;
+        }
+
+        // The memory of the image is the consumer's now
+        _taken++;
+        Item& item= _items[index];
+        Image* image= item.image;
+        item.image= nullptr;
+        _residentBytes-= item.bytes;
+        schedule();
+        if(!image)
+            continue;
+        if(fileName)
+            *fileName= item.fileName;
+        return image;
+    }
+    return nullptr;
+}
+
+void BatchLoader::load(int index)
+{
+    QString fileName;
+    bool cancelled;
+    {
+        QMutexLocker locker(&_lock);
+        fileName= _items[index].fileName;
+        cancelled= _cancelled;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    Image* image= nullptr;
+    const QString suffix= QFileInfo(fileName).suffix().toLower();
+    bool mapped= false;
+    for(const char* mappedSuffix: mappedSuffixes)
+        mapped= mapped or suffix == mappedSuffix;
+    if(cancelled) {
+        // Skip the decode, the images are not taken anymore
+    } else if(mapped) {
+        // Uploaded straight from the file mapping when possible
+        ImageFile file(fileName);
+        image= file.createImage(_devId);
+        if(image and image->format() != _format) {
+            Image* converted= new Image(image->size(), _format, _devId, false);
+            if(!image->convertTo(*converted)) {
+                delete converted;
+                converted= nullptr;
+            }
+            delete image;
+            image= converted;
+        }
+    } else {
+        const QImage decoded(fileName);
+        if(!decoded.isNull()) {
+            image= new Image(decoded.width(), decoded.height(), _format, _devId);
+            if(!image->fromQImage(decoded)) {
+                delete image;
+                image= nullptr;
+            }
+        }
+        // The upload overlaps the next decodes
+        if(image)
+            image->uploadAsync();
+    }
+    if(!image and !cancelled)
+        qDebug() << "BatchLoader: could not load" << fileName;
+    const qint64 bytes= image ? (qint64)image->width() * image->height() * iFmtBPP(_format) / 8 : 0;
+
+    QMutexLocker locker(&_lock);
+    Item& item= _items[index];
+    item.image= image;
+    item.bytes= bytes;
+    item.done= true;
+    _inFlight--;
+    _residentBytes+= bytes;
+    if(image) {
+        _stats.loaded++;
+        // Running average of the last images
+        _averageBytes= _averageBytes ? (_averageBytes * 3 + bytes) / 4 : bytes;
+    } else {
+        _stats.failed++;
+    }
+    _stats.decodeMsecs+= timer.elapsed();
+    _stats.peakBytes= qMax(_stats.peakBytes, _residentBytes);
+    if(_order == Order::Completion)
+        _completed.enqueue(index);
+    _loaded.wakeAll();
+    schedule();
+}
+
+void BatchLoader::schedule()
+{
+    while(!_cancelled and _started < _items.count() and _inFlight < _pool.maxThreadCount()) {
+        // The decodes in flight are expected to be as large as the last images,
+        // one decode always runs so the budget can not stall the consumer
+        const qint64 expected= _residentBytes + (_inFlight + 1) * _averageBytes;
+        if(expected > _memoryBudget and (_residentBytes or _inFlight))
+            break;
+        _inFlight++;
+        _pool.start(new Decoder(this, _started++));
+    }
+}
+
+} // namespace QCLI
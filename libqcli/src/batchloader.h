@@ -0,0 +1,132 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_BATCHLOADER_H
+#define _QCLI_BATCHLOADER_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Loads a batch of image files on a pool of decoding threads
+ *
+ *  The files are decoded in parallel while the consumer processes the images
+ *  already loaded, and the upload of each image to the device starts as soon
+ *  as it is decoded:
+ *
+ *      BatchLoader loader(QDir("scans").entryList(QStringList() << "*.jpg"));
+ *      QString fileName;
+ *      while(Image* image= loader.next(&fileName)) {
+ *          process(*image);
+ *          delete image;
+ *      }
+ *
+ *  The decodes run ahead of the consumer until the images not taken yet, plus
+ *  the ones being decoded, would exceed the memory budget. The files are decoded
+ *  with QImage, except the PGM, PPM, PFM and raw files, which are read with
+ *  ImageFile. The files that can not be loaded are skipped.
+ *
+ *  All functions are thread-safe.
+ */
+
+class BatchLoader
+{
+public:
+    /// Order of the images returned by next()
+    enum class Order
+    {
+        Submission, /// Order of the file list
+        Completion  /// Order of the decodes, so a slow file does not hold back the others
+    };
+
+    /// Statistics of the loads
+    struct Stats {
+        int loaded;
+        int failed;
+        qint64 decodeMsecs;   // Time spent loading, summed over all the threads
+        qint64 waitMsecs;     // Time next() waited for a decode
+        qint64 peakBytes;     // Largest memory used by the images not taken
+    };
+
+    /// Starts loading the files
+    /// @param threadCount decoding threads, 0 for QThread::idealThreadCount()
+    /// @param memoryBudget bytes of the images loaded ahead of the consumer
+    /// @param format format of the images, converted on the device if needed
+    BatchLoader(const QStringList& fileNames, int threadCount= 0, qint64 memoryBudget= 256 << 20,
+                Order order= Order::Submission, int devId= 0, IFmt format= IFmt::ARGB);
+    /// Stops the loads and frees the images not taken
+    ~BatchLoader();
+
+    /// Returns the number of files
+    int count() const { return _items.count(); }
+    /// Returns true if all the images were taken
+    bool atEnd() const { QMutexLocker l(&_lock); return _taken == _items.count(); }
+
+    /// Returns the next image, blocking until it is loaded, owned by the caller
+    /// Its upload to the device may still be running, like after Image::uploadAsync()
+    /// @param fileName returns the file of the image
+    /// @retval nullptr once all the images were taken
+    Image* next(QString* fileName= nullptr);
+
+    /// Returns the statistics of the loads
+    Stats stats() const { QMutexLocker l(&_lock); return _stats; }
+
+    /// Disable copying
+    BatchLoader(const BatchLoader& other) = delete;
+    /// Disable assignments
+    BatchLoader& operator=(const BatchLoader& other) = delete;
+
+private:
+    /// File of the batch
+    struct Item {
+        QString fileName;
+        Image* image;  // Loaded image not taken yet
+        qint64 bytes;  // Memory of image
+        bool done;     // Loaded or failed
+    };
+    class Decoder;
+
+    /// Loads a file and uploads it, in a decoding thread
+    void load(int index);
+    /// Starts the decodes that fit in the memory budget (lock held)
+    void schedule();
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QWaitCondition _loaded;
+    QThreadPool _pool;
+
+    const qint64 _memoryBudget;
+    const Order _order;
+    const int _devId;
+    const IFmt _format;
+
+    QVector<Item> _items;
+    int _started= 0;          // Files whose decode was started, in order
+    int _inFlight= 0;         // Decodes running
+    int _taken= 0;            // Files returned or skipped by next()
+    QQueue<int> _completed;   // Loaded files not taken, with Order::Completion
+    qint64 _residentBytes= 0; // Memory of the images not taken
+    qint64 _averageBytes= 0;  // Expected memory of the next decodes
+    bool _cancelled= false;
+    Stats _stats;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_BATCHLOADER_H
@@ -0,0 +1,239 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "framepipeline.h"
+
+#include <cassert>
+#include "image.h"
+#include "opencl/devicemanager.h"
+#include "util/hostconvert.h"
+
+namespace QCLI {
+
+// Copies the rows of an image between buffers of different strides
+static void copyRows(const void* src, int srcStride, void* dst, int dstStride, int rowBytes, int height)
+{
+    for(int row=0; row<height; row++)
+        memcpy(static_cast<char*>(dst) + (size_t)row * dstStride,
+               static_cast<const char*>(src) + (size_t)row * srcStride, rowBytes);
+}
+
+FramePipeline::FramePipeline(QSize inputSize, IFmt inputFormat, QSize outputSize, IFmt outputFormat,
+                             Process process, int depth, int devId)
+    : _process(process), _devId(devId), _inputSize(inputSize), _inputFormat(inputFormat),
+      _outputSize(outputSize), _outputFormat(outputFormat)
+{
+    assert(depth > 0);
+    assert(process);
+
+    // The images initialize the context
+    for(int i=0; i<depth; i++) {
+        const Slot slot { new Image(inputSize, inputFormat, devId, false, true, true),
+                          new Image(outputSize, outputFormat, devId, false, true, true),
+                          false, Event(), Event(), Event() };
+        _slots << slot;
+    }
+
+    // The transfers use the queues of their role, so with the Dedicated topology
+    // they do not wait for the kernels of the other frames
+    _uploadQueue= devMgr().queue(devId, QueueRole::Upload);
+    _downloadQueue= devMgr().queue(devId, QueueRole::Download);
+
+    resetStats();
+}
+
+FramePipeline::~FramePipeline()
+{
+    // The images wait for their transfers
+    foreach(const Slot& slot, _slots) {
+        delete slot.input;
+        delete slot.output;
+    }
+}
+
+void FramePipeline::resetStats()
+{
+    QMutexLocker locker(&_lock);
+    const StageStats empty { 0.0, 0.0, 0.0 };
+    _stats= Stats { 0, 0.0, empty, empty, empty, empty };
+}
+
+//
+// Push
+//
+
+bool FramePipeline::push(const QImage& frame)
+{
+    if(frame.isNull() or frame.size() != _inputSize) {
+        qDebug() << "FramePipeline::push: invalid frame.";
+        return false;
+    }
+    const QImage argb= frame.format() == QImage::Format_ARGB32 or frame.format() == QImage::Format_RGB32 ?
+                       frame : frame.convertToFormat(QImage::Format_ARGB32);
+
+    QMutexLocker locker(&_pushLock);
+    const int index= beginPush();
+    Image& input= *_slots[index].input;
+    // The previous upload of the slot must be done before writing the host buffer
+    bool ok= !isNull() and input._waitHost();
+    if(ok) {
+        ok= convertPixels(argb.constBits(), IFmt::ARGB, argb.bytesPerLine(), input._hostBuffer, _inputFormat, 0,
+                          _inputSize.width(), _inputSize.height());
+    }
+    endPush(index, ok);
+    return ok;
+}
+
+bool FramePipeline::push(const void* data, int stride)
+{
+    const int rowBytes= _inputSize.width() * iFmtBPP(_inputFormat) / 8;
+    if(!data or (stride and stride < rowBytes)) {
+        qDebug() << "FramePipeline::push: invalid frame.";
+        return false;
+    }
+
+    QMutexLocker locker(&_pushLock);
+    const int index= beginPush();
+    Image& input= *_slots[index].input;
+    const bool ok= !isNull() and input._waitHost();
+    if(ok)
+        copyRows(data, stride ? stride : rowBytes, input._hostBuffer, rowBytes, rowBytes, _inputSize.height());
+    endPush(index, ok);
+    return ok;
+}
+
+int FramePipeline::beginPush()
+{
+    QMutexLocker locker(&_lock);
+    while(_count == _slots.count())
+        _changed.wait(&_lock);
+    const int index= (_head + _count) % _slots.count();
+    _count++;
+    return index;
+}
+
+void FramePipeline::endPush(int index, bool ok)
+{
+    Slot& slot= _slots[index];
+    if(ok) {
+        // Each stage waits for the previous one on the device
+        slot.input->_hostValid= true;
+        slot.input->_devValid= false;
+        slot.upload= slot.input->uploadAsync(_uploadQueue);
+        ok= !slot.upload.isNull() and _process(*slot.input, *slot.output);
+        slot.process= slot.output->devEvent();
+        if(ok) {
+            slot.download= slot.output->downloadAsync(_downloadQueue);
+            ok= !slot.download.isNull();
+        }
+        // Submit the stages now, the events of the other queues do not flush them
+        devMgr().flush(_devId);
+    }
+    if(!ok)
+        qDebug() << "FramePipeline: could not enqueue a frame.";
+    slot.ok= ok;
+
+    QMutexLocker locker(&_lock);
+    _submitted++;
+    _changed.wakeAll();
+}
+
+//
+// Pop
+//
+
+bool FramePipeline::pop(QImage* frame)
+{
+    assert(frame);
+    QMutexLocker locker(&_popLock);
+    const int index= beginPop();
+    Image& output= *_slots[index].output;
+    bool ok= _slots[index].ok;
+    if(ok) {
+        *frame= QImage(_outputSize, QImage::Format_ARGB32);
+        ok= convertPixels(output._hostBuffer, _outputFormat, 0, frame->bits(), IFmt::ARGB, frame->bytesPerLine(),
+                          _outputSize.width(), _outputSize.height());
+    }
+    endPop(index);
+    return ok;
+}
+
+bool FramePipeline::pop(void* data, int stride)
+{
+    const int rowBytes= _outputSize.width() * iFmtBPP(_outputFormat) / 8;
+    assert(data and (!stride or stride >= rowBytes));
+    QMutexLocker locker(&_popLock);
+    const int index= beginPop();
+    const bool ok= _slots[index].ok;
+    if(ok)
+        copyRows(_slots[index].output->_hostBuffer, rowBytes, data, stride ? stride : rowBytes, rowBytes,
+                 _outputSize.height());
+    endPop(index);
+    return ok;
+}
+
+int FramePipeline::beginPop()
+{
+    int index;
+    {
+        QMutexLocker locker(&_lock);
+        while(!_submitted)
+            _changed.wait(&_lock);
+        index= _head;
+    }
+    // The download writes the host buffer
+    Slot& slot= _slots[index];
+    slot.ok= slot.ok and slot.output->_waitHost() and slot.output->_hostValid;
+    return index;
+}
+
+void FramePipeline::endPop(int index)
+{
+    const Slot& slot= _slots[index];
+
+    QMutexLocker locker(&_lock);
+    if(slot.ok) {
+        _stats.frames++;
+        if(_stats.frames == 1)
+            _popTimer.start();
+        else
+            _stats.framesPerSecond= (_stats.frames - 1) * 1000.0 / qMax(_popTimer.elapsed(), (qint64)1);
+
+        const cl_ulong uploadStart= slot.upload.profilingInfo(CL_PROFILING_COMMAND_START);
+        const cl_ulong uploadEnd= slot.upload.profilingInfo(CL_PROFILING_COMMAND_END);
+        const cl_ulong processEnd= slot.process.profilingInfo(CL_PROFILING_COMMAND_END);
+        const cl_ulong downloadStart= slot.download.profilingInfo(CL_PROFILING_COMMAND_START);
+        const cl_ulong downloadEnd= slot.download.profilingInfo(CL_PROFILING_COMMAND_END);
+        addSample(_stats.upload, uploadStart, uploadEnd);
+        addSample(_stats.process, uploadEnd, processEnd);
+        addSample(_stats.download, downloadStart, downloadEnd);
+        addSample(_stats.total, uploadStart, downloadEnd);
+    }
+
+    _head= (_head + 1) % _slots.count();
+    _count--;
+    _submitted--;
+    _changed.wakeAll();
+}
+
+void FramePipeline::addSample(StageStats& stage, cl_ulong start, cl_ulong end)
+{
+    // Missing or reordered timestamps (no profiling, no processing kernel) count as 0
+    const double ms= end > start ? (end - start) * 1e-6 : 0.0;
+    stage.last= ms;
+    stage.average+= (ms - stage.average) / _stats.frames;
+    stage.max= qMax(stage.max, ms);
+}
+
+} // namespace QCLI
@@ -0,0 +1,173 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_FRAMEPIPELINE_H
+#define _QCLI_FRAMEPIPELINE_H
+
+#include <QtCore>
+#include <CL/cl.h>
+#include <functional>
+
+#include "ifmt.h"
+#include "opencl/event.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Streaming pipeline keeping several frames in flight
+ *
+ *  Each frame goes through three stages: upload, process and download. The
+ *  stages run in the Upload, Compute and Download queues of the device. With the
+ *  QueueTopology::Dedicated topology (see Context::setQueueTopology()) these are
+ *  separate queues, so the upload of a frame, the processing of the previous one
+ *  and the download of the one before overlap, and the frame rate is limited by
+ *  the slowest stage instead of their sum:
+ *
+ *      FramePipeline pipeline(QSize(1920, 1080), IFmt::ARGB, QSize(1920, 1080), IFmt::LUMA,
+ *                             [](Image& in, Image& out) { return Kernel::perPixel("y= x;").run(in, out); });
+ *      while(camera.read(&frame)) {
+ *          if(pipeline.full())
+ *              pipeline.pop(&result); // The oldest frame
+ *          pipeline.push(frame);
+ *      }
+ *      while(!pipeline.empty())
+ *          pipeline.pop(&result);
+ *
+ *  The pipeline holds depth() frames at most: push() blocks while it is full
+ *  and pop() blocks while it is empty, so it can also be fed by a producer
+ *  thread and drained by a consumer thread.
+ *
+ *  All functions are thread-safe.
+ */
+
+class FramePipeline
+{
+public:
+    /// Processing of a frame, enqueues the operations reading input and writing output
+    /// @retval false on error
+    typedef std::function<bool(Image& input, Image& output)> Process;
+
+    /// Latency of a stage, in ms measured by the device
+    struct StageStats {
+        double last;
+        double average;
+        double max;
+    };
+    /// Statistics of the frames popped since the creation or resetStats()
+    struct Stats {
+        int frames;
+        double framesPerSecond; // Rate of pop()
+        StageStats upload;      // Upload of the input
+        StageStats process;     // From the end of the upload to the end of the processing
+        StageStats download;    // Download of the output
+        StageStats total;       // From the start of the upload to the end of the download
+    };
+
+    /// Creates a pipeline of depth frames, 3 keeps the three stages busy
+    FramePipeline(QSize inputSize, IFmt inputFormat, QSize outputSize, IFmt outputFormat, Process process,
+                  int depth= 3, int devId= 0);
+    /// Waits for the frames in flight
+    ~FramePipeline();
+
+    /// Returns true if the device has no queues
+    bool isNull() const { return !_uploadQueue or !_downloadQueue; }
+
+    /// Enqueues a frame, converted to the input format, blocking while the pipeline is full
+    /// @retval false on error
+    bool push(const QImage& frame);
+    /// Enqueues a frame of the input format, blocking while the pipeline is full
+    /// @param stride bytes per row, 0 for tightly packed rows
+    /// @retval false on error
+    bool push(const void* data, int stride= 0);
+
+    /// Returns the oldest frame converted to a QImage, blocking until it is ready
+    /// @retval false on error (the frame is dropped)
+    bool pop(QImage* frame);
+    /// Copies the oldest frame in the output format, blocking until it is ready
+    /// @param stride bytes per row, 0 for tightly packed rows
+    /// @retval false on error (the frame is dropped)
+    bool pop(void* data, int stride= 0);
+
+    /// Returns the maximum number of frames in flight
+    int depth() const { return _slots.count(); }
+    /// Returns the number of frames pushed and not popped yet
+    int count() const { QMutexLocker l(&_lock); return _count; }
+    /// Returns true if push() would block
+    bool full() const { return count() == depth(); }
+    /// Returns true if there are no frames to pop
+    bool empty() const { return count() == 0; }
+
+    /// Returns the latency statistics of the popped frames
+    Stats stats() const { QMutexLocker l(&_lock); return _stats; }
+    /// Resets the latency statistics
+    void resetStats();
+
+    /// Disable copying
+    FramePipeline(const FramePipeline& other) = delete;
+    /// Disable assignments
+    FramePipeline& operator=(const FramePipeline& other) = delete;
+
+private:
+    /// Frame in flight
+    struct Slot {
+        Image* input;
+        Image* output;
+        bool ok;
+        Event upload;
+        Event process;
+        Event download;
+    };
+
+    /// Takes the next free slot, blocking while the pipeline is full
+    int beginPush();
+    /// Enqueues the stages of a slot whose input host data was written
+    void endPush(int index, bool ok);
+    /// Takes the oldest slot, blocking until it is submitted, and waits for its download
+    int beginPop();
+    /// Frees the oldest slot and updates the statistics
+    void endPop(int index);
+
+    /// Adds a sample in ns to a stage
+    void addSample(StageStats& stage, cl_ulong start, cl_ulong end);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QWaitCondition _changed;
+    QMutex _pushLock;     // Serializes the pushes
+    QMutex _popLock;      // Serializes the pops
+
+    QVector<Slot> _slots;
+    int _head= 0;         // Oldest frame
+    int _count= 0;        // Frames pushed and not popped
+    int _submitted= 0;    // Frames whose stages are enqueued
+
+    Process _process;
+    int _devId;
+    QSize _inputSize;
+    IFmt _inputFormat;
+    QSize _outputSize;
+    IFmt _outputFormat;
+
+    // Transfer queues of the device, the processing runs in its compute queue
+    cl_command_queue _uploadQueue= nullptr;
+    cl_command_queue _downloadQueue= nullptr;
+
+    Stats _stats;
+    QElapsedTimer _popTimer;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_FRAMEPIPELINE_H
@@ -0,0 +1,301 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include "image.h"
+#include "opencl/devicemanager.h"
+
+namespace QCLI {
+
+// Graph recording in each thread
+namespace {
+    struct CurrentGraph { Graph* graph= nullptr; };
+    QThreadStorage<CurrentGraph*> currentGraph;
+}
+
+Graph::~Graph()
+{
+    end();
+    sync();
+}
+
+Graph* Graph::current()
+{
+    return currentGraph.hasLocalData() ? currentGraph.localData()->graph : nullptr;
+}
+
+void Graph::begin()
+{
+    if(recording())
+        return;
+    if(!currentGraph.hasLocalData())
+        currentGraph.setLocalData(new CurrentGraph);
+    _previous= currentGraph.localData()->graph;
+    currentGraph.localData()->graph= this;
+}
+
+void Graph::end()
+{
+    if(!recording())
+        return;
+    currentGraph.localData()->graph= _previous;
+    _previous= nullptr;
+}
+
+//
+// Recording
+//
+
+bool Graph::record(const PixelKernel& op, const QVector<Image*>& images)
+{
+    // Images with operations pending in another graph must be up to date first
+    foreach(Image* image, images) {
+        if(image->_graph and image->_graph != this)
+            image->_graph->sync();
+    }
+
+    const int node= _nodes.count();
+    Node newNode { op, QVector<int>(), 0 };
+    for(int i=0; i<images.count()-1; i++) {
+        const int slot= readSlot(images[i]);
+        _slots[slot].readers++;
+        newNode.slots << slot;
+    }
+    newNode.slots << writeSlot(images.last(), node);
+    _nodes << newNode;
+    return true;
+}
+
+int Graph::readSlot(Image* image)
+{
+    if(_currentSlot.contains(image))
+        return _currentSlot[image];
+
+    // First use of the image, the slot holds its original data
+    const Slot slot { image, -1, 0, image->width(), image->height(), image->format(), image->devId(), nullptr };
+    _slots << slot;
+    _currentSlot[image]= _slots.count() - 1;
+    image->_graph= this;
+    return _slots.count() - 1;
+}
+
+int Graph::writeSlot(Image* image, int node)
+{
+    // The previous result written to the image can no longer be read by the host
+    if(_currentSlot.contains(image)) {
+        Slot& previous= _slots[_currentSlot[image]];
+        if(previous.producer != -1)
+            previous.image= nullptr;
+    }
+
+    const Slot slot { image, node, 0, image->width(), image->height(), image->format(), image->devId(), nullptr };
+    _slots << slot;
+    _currentSlot[image]= _slots.count() - 1;
+    image->_graph= this;
+    return _slots.count() - 1;
+}
+
+void Graph::imageDestroyed(Image* image)
+{
+    if(_syncing)
+        return;
+
+    // Original data read by pending operations is owned by the image, run them now
+    for(int i=0; i<_slots.count(); i++) {
+        if(_slots[i].image == image and _slots[i].producer == -1 and _slots[i].readers) {
+            sync();
+            return;
+        }
+    }
+    // Otherwise its results become intermediates
+    for(int i=0; i<_slots.count(); i++) {
+        if(_slots[i].image == image)
+            _slots[i].image= nullptr;
+    }
+    _currentSlot.remove(image);
+}
+
+//
+// Execution
+//
+
+bool Graph::sync()
+{
+    if(_syncing)
+        return true;
+    _syncing= true;
+
+    // Detach the images first, so using them in the launches does not sync again
+    foreach(const Slot& slot, _slots) {
+        if(slot.image)
+            slot.image->_graph= nullptr;
+    }
+
+    QVector<Node> nodes= liveNodes();
+    fuseNodes(nodes);
+    sortByLevel(nodes);
+    const bool ok= launchNodes(nodes);
+
+    _nodes.clear();
+    _slots.clear();
+    _currentSlot.clear();
+    _syncing= false;
+    return ok;
+}
+
+QVector<Graph::Node> Graph::liveNodes() const
+{
+    // Walk backwards, a node is needed if its result is bound to an image or
+    // read by a needed node
+    QVector<bool> slotRead(_slots.count(), false);
+    QVector<bool> needed(_nodes.count(), false);
+    for(int i=_nodes.count()-1; i>=0; i--) {
+        const int out= _nodes[i].slots.last();
+        if(!_slots[out].image and !slotRead[out])
+            continue;
+        needed[i]= true;
+        for(int j=0; j<_nodes[i].slots.count()-1; j++)
+            slotRead[_nodes[i].slots[j]]= true;
+    }
+
+    QVector<Node> ret;
+    for(int i=0; i<_nodes.count(); i++) {
+        if(needed[i])
+            ret << _nodes[i];
+    }
+    return ret;
+}
+
+void Graph::fuseNodes(QVector<Node>& nodes) const
+{
+    // Readers of each slot among the remaining nodes
+    QVector<int> readers(_slots.count(), 0);
+    foreach(const Node& node, nodes) {
+        for(int j=0; j<node.slots.count()-1; j++)
+            readers[node.slots[j]]++;
+    }
+
+    QVector<Node> fused;
+    foreach(const Node& node, nodes) {
+        if(!fused.isEmpty() and node.slots.count() > 1) {
+            Node& prev= fused.last();
+            const Slot& mid= _slots[prev.slots.last()];
+            const Slot& out= _slots[node.slots.last()];
+            // An image can not be read and written by the same kernel
+            bool outRead= false;
+            for(int i=0; i<prev.slots.count()-1; i++)
+                outRead= outRead or (out.image and _slots[prev.slots[i]].image == out.image);
+            // The previous result must be a discarded intermediate only read as
+            // the x0 of this node, with the same value type as the fused output
+            if(node.slots.first() == prev.slots.last() and !mid.image and readers[node.slots.first()] == 1
+               and iFmtChanCount(mid.format) == iFmtChanCount(out.format) and !outRead
+               and mid.width == out.width and mid.height == out.height and mid.devId == out.devId) {
+                // Inputs of the first stage of node, x0 becomes the previous value
+                int firstInputs= node.slots.count() - 1;
+                for(int i=1; i<node.op._extraInputs.count(); i++)
+                    firstInputs-= node.op._extraInputs[i];
+                prev.op._expressions << node.op._expressions.first();
+                prev.op._extraInputs << firstInputs - 1;
+                for(int i=1; i<node.op._expressions.count(); i++) {
+                    prev.op._expressions << node.op._expressions[i];
+                    prev.op._extraInputs << node.op._extraInputs[i];
+                }
+                prev.slots.removeLast();
+                prev.slots+= node.slots.mid(1);
+                continue;
+            }
+        }
+        fused << node;
+    }
+    nodes= fused;
+}
+
+void Graph::sortByLevel(QVector<Node>& nodes) const
+{
+    // A node depends on the nodes writing the slots it reads, and on the nodes
+    // that read or write the image it writes
+    for(int j=0; j<nodes.count(); j++) {
+        nodes[j].level= 0;
+        const Slot& out= _slots[nodes[j].slots.last()];
+        for(int i=0; i<j; i++) {
+            bool depends= false;
+            const int iOut= nodes[i].slots.last();
+            for(int k=0; k<nodes[j].slots.count()-1; k++)
+                depends= depends or nodes[j].slots[k] == iOut;
+            if(out.image) {
+                foreach(const int slot, nodes[i].slots)
+                    depends= depends or _slots[slot].image == out.image;
+            }
+            if(_slots[iOut].image) {
+                for(int k=0; k<nodes[j].slots.count()-1; k++)
+                    depends= depends or _slots[nodes[j].slots[k]].image == _slots[iOut].image;
+            }
+            if(depends)
+                nodes[j].level= qMax(nodes[j].level, nodes[i].level + 1);
+        }
+    }
+    std::stable_sort(nodes.begin(), nodes.end(),
+                     [](const Node& a, const Node& b) { return a.level < b.level; });
+}
+
+bool Graph::launchNodes(const QVector<Node>& nodes)
+{
+    // Last node reading each slot, to release its temporary image after it
+    QHash<int, int> lastRead;
+    for(int i=0; i<nodes.count(); i++) {
+        for(int j=0; j<nodes[i].slots.count()-1; j++)
+            lastRead[nodes[i].slots[j]]= i;
+    }
+
+    bool ok= true;
+    for(int i=0; i<nodes.count(); i++) {
+        QVector<Image*> images;
+        foreach(const int index, nodes[i].slots) {
+            Slot& slot= _slots[index];
+            // Temporary images are recycled by the image pool
+            if(!slot.image and !slot.temp)
+                slot.temp= new Image(slot.width, slot.height, slot.format, slot.devId, false, false, true);
+            images << (slot.image ? slot.image : slot.temp);
+        }
+        ok= nodes[i].op.launch(images) and ok;
+
+        // The temporary images read for the last time go back to the pool, the
+        // next nodes using them wait for this one
+        for(int j=0; j<nodes[i].slots.count()-1; j++) {
+            Slot& slot= _slots[nodes[i].slots[j]];
+            if(slot.temp and lastRead[nodes[i].slots[j]] == i) {
+                delete slot.temp;
+                slot.temp= nullptr;
+            }
+        }
+    }
+
+    // Temporary images still in use (should not happen) are released too
+    for(int i=0; i<_slots.count(); i++) {
+        if(_slots[i].temp) {
+            delete _slots[i].temp;
+            _slots[i].temp= nullptr;
+        }
+    }
+
+    // Submit everything at once
+    for(int i=0; i<devMgr().devCount(); i++)
+        devMgr().flush(i);
+    return ok;
+}
+
+} // namespace QCLI
@@ -0,0 +1,133 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_GRAPH_H
+#define _QCLI_GRAPH_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+#include "opencl/pixelkernel.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Deferred execution graph of per-pixel operations
+ *
+ *  While a graph is recording in a thread, the PixelKernel operations run by
+ *  that thread are not launched, they are recorded with their images instead.
+ *  The graph runs when sync() is called, or when the host needs the data of a
+ *  recorded image (Image::toQImage(), Image::sync(), etc.):
+ *
+ *      Graph graph;
+ *      graph.begin();
+ *      Image tmp(input.size(), IFmt::ARGB, 0, false);
+ *      Kernel::perPixel("y= x * 2.0f;").run(input, tmp);
+ *      Kernel::perPixel("y= sqrt(x);").run(tmp, output);
+ *      graph.end();
+ *      output.toQImage(); // Runs the graph
+ *
+ *  Before running, the graph is optimized as a whole:
+ *   - Operations whose results are never read are removed. A result is read if
+ *     a later operation uses it, or if its image is still alive and was not
+ *     written again by a later operation.
+ *   - An operation followed by the only reader of its discarded result is
+ *     fused with it into a single kernel (see PixelKernel::then()). Fused
+ *     intermediates are not rounded to the format of their image.
+ *   - The discarded intermediates are stored in temporary device images that
+ *     are recycled by the ImagePool once read for the last time.
+ *   - Operations are enqueued by dependency level, so independent branches are
+ *     enqueued together, with a single flush and no host syncs in between.
+ *
+ *  This class is *not* thread-safe, like Image.
+ */
+
+class Graph
+{
+    // Image and PixelKernel add themselves to the current graph
+    friend class Image;
+    friend class PixelKernel;
+public:
+    Graph() = default;
+    /// Runs the pending operations
+    ~Graph();
+
+    /// Starts recording the per-pixel operations run by this thread
+    void begin();
+    /// Stops recording, the recorded operations stay pending until sync()
+    void end();
+    /// Returns true if the graph is recording in this thread
+    bool recording() const { return current() == this; }
+
+    /// Runs the pending operations
+    /// @retval false on error
+    bool sync();
+    /// Returns the number of pending operations
+    int pendingCount() const { return _nodes.count(); }
+
+    /// Returns the graph recording in this thread, nullptr if none
+    static Graph* current();
+
+    /// Disable copying
+    Graph(const Graph& other) = delete;
+    /// Disable assignments
+    Graph& operator=(const Graph& other) = delete;
+
+private:
+    /// Version of the contents of an image
+    struct Slot {
+        Image* image;     // Bound image, nullptr when discarded (destroyed or rewritten)
+        int producer;     // Node writing the slot, -1 if it holds the original image data
+        int readers;      // Number of nodes reading the slot
+        int width, height;
+        IFmt format;
+        int devId;
+        Image* temp;      // Temporary image of discarded slots while running
+    };
+    /// Recorded operation
+    struct Node {
+        PixelKernel op;
+        QVector<int> slots; // Slots of the images, the last one is written
+        int level;
+    };
+
+    /// Records an operation (used by PixelKernel)
+    bool record(const PixelKernel& op, const QVector<Image*>& images);
+    /// Discards the slots of an image being destroyed (used by Image)
+    void imageDestroyed(Image* image);
+
+    /// Returns the current slot of an image, adding an original data slot if needed
+    int readSlot(Image* image);
+    /// Adds a new version slot written by node
+    int writeSlot(Image* image, int node);
+
+    // Optimization passes, run by sync()
+    QVector<Node> liveNodes() const;
+    void fuseNodes(QVector<Node>& nodes) const;
+    void sortByLevel(QVector<Node>& nodes) const;
+    bool launchNodes(const QVector<Node>& nodes);
+
+    Graph* _previous= nullptr; // Graph that was recording before begin()
+    bool _syncing= false;
+
+    QVector<Slot> _slots;
+    QVector<Node> _nodes;
+    /// Current slot of each recorded image
+    QHash<Image*, int> _currentSlot;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_GRAPH_H
@@ -10,10 +10,12 @@ cl_image_format toCLFormat(IFmt format)
     cl_channel_type type= CL_UNORM_INT8;
 
     switch(format) {
-        case IFmt::ARGB:    order= CL_ARGB;      type= CL_UNORM_INT8;  break;
-        case IFmt::ARGB16:  order= CL_ARGB;      type= CL_UNORM_INT16; break;
-        case IFmt::ARGB16F: order= CL_ARGB;      type= CL_HALF_FLOAT;  break;
-        case IFmt::ARGB32F: order= CL_ARGB;      type= CL_FLOAT;       break;
+        // QImage stores ARGB32 pixels as 0xAARRGGBB words, BGRA bytes in little endian
+        case IFmt::ARGB:    order= CL_BGRA;      type= CL_UNORM_INT8;  break;
+        // CL_ARGB and CL_BGRA are only valid for 8-bit channels
+        case IFmt::ARGB16:  order= CL_RGBA;      type= CL_UNORM_INT16; break;
+        case IFmt::ARGB16F: order= CL_RGBA;      type= CL_HALF_FLOAT;  break;
+        case IFmt::ARGB32F: order= CL_RGBA;      type= CL_FLOAT;       break;
         case IFmt::LUMA:    order= CL_LUMINANCE; type= CL_UNORM_INT8;  break;
         case IFmt::LUMA16:  order= CL_LUMINANCE; type= CL_UNORM_INT16; break;
         case IFmt::LUMA16F: order= CL_LUMINANCE; type= CL_HALF_FLOAT;  break;
@@ -37,14 +37,16 @@ constexpr inline uint8_t iFmtBPP(ifmt_t format) { return (format >> 8) & 0xFF; }
 constexpr inline uint8_t iFmtChanCount(ifmt_t format) { return format & 0xFF; }
 
 /// Strict enum of image formats supported as template parameter of Image
+/// The host data of ARGB uses the QImage::Format_ARGB32 layout, the other 4
+/// channel formats are stored in RGBA order
 enum class IFmt : ifmt_t
 {
-    ARGB    = iFmtPack(0,  24, 4), /// ARGB:  8-bit unsigned integer [0..255]
-    ARGB16  = iFmtPack(1,  48, 4), /// ARGB: 16-bit unsigned integer [0..32768]
-    ARGB16F = iFmtPack(2,  48, 4), /// ARGB: 16-bit half-float       [0..1]
+    ARGB    = iFmtPack(0,  32, 4), /// ARGB:  8-bit unsigned integer [0..255]
+    ARGB16  = iFmtPack(1,  64, 4), /// ARGB: 16-bit unsigned integer [0..65535]
+    ARGB16F = iFmtPack(2,  64, 4), /// ARGB: 16-bit half-float       [0..1]
     ARGB32F = iFmtPack(3, 128, 4), /// ARGB: 32-bit float            [0..1]
     LUMA    = iFmtPack(4,   8, 1), /// Luma:  8-bit unsigned integer [0..255]
-    LUMA16  = iFmtPack(5,  16, 1), /// Luma: 16-bit unsigned integer [0..32768]
+    LUMA16  = iFmtPack(5,  16, 1), /// Luma: 16-bit unsigned integer [0..65535]
     LUMA16F = iFmtPack(6,  16, 1), /// Luma: 16-bit half-float       [0..1]
     LUMA32F = iFmtPack(7,  32, 1)  /// Luma: 32-bit float            [0..1]
 };
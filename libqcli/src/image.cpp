@@ -15,12 +15,111 @@
 #include "image.h"
 
 #include <cassert>
+#include "graph.h"
 #include "opencl/context.h"
 #include "opencl/devicemanager.h"
+#include "opencl/imagepool.h"
+#include "opencl/kernel.h"
+#include "opencl/profiler.h"
+#include "util/hostconvert.h"
 #include "util/utils.h"
 
 namespace QCLI {
 
+// Alignment of zero-copy host buffers, page aligned as required by most runtimes
+static const size_t zeroCopyAlignment= 4096;
+
+// Default allocation policy of new images
+static QAtomicInt defaultPolicy((int)Image::AllocPolicy::Auto);
+
+// Largest device image set with Image::setMaxTileSize(), 0 for the device limits
+static QAtomicInt maxTileWidth;
+static QAtomicInt maxTileHeight;
+
+// Bytes of the largest pixels (ARGB32F). The grid of the tiles of an image size
+// does not depend on the format, so the tiled images of a kernel launch share it;
+// whether an image is tiled depends on its own format.
+static const qint64 maxPixelBytes= 16;
+
+const int Image::maxTileHalo;
+
+// Zero-copy host memory freed by freeZeroCopy()
+struct ZeroCopyBuffer {
+    char* data;
+    void* mapping;       // File mapping of the data (see ImageFile), or nullptr
+    size_t mappingBytes;
+};
+
+// Frees a zero-copy host buffer, called when the last command using it completes
+static void CL_CALLBACK freeZeroCopy(cl_event /*event*/, cl_int /*status*/, void* data)
+{
+    ZeroCopyBuffer* buffer= static_cast<ZeroCopyBuffer*>(data);
+    if(buffer->mapping)
+        unmapFile(buffer->mapping, buffer->mappingBytes);
+    else
+        alignedFree(buffer->data);
+    delete buffer;
+}
+
+// Resolves Auto and unsupported ZeroCopy policies for a device
+static Image::AllocPolicy resolvePolicy(Image::AllocPolicy policy, int devId, bool tiled)
+{
+    // Pinned and zero-copy host buffers are device allocations too, limited like the images
+    if(tiled)
+        return Image::AllocPolicy::Malloc;
+    if(policy == Image::AllocPolicy::Auto or policy == Image::AllocPolicy::ZeroCopy)
+        return devMgr().hostUnifiedMemory(devId) ? Image::AllocPolicy::ZeroCopy : Image::AllocPolicy::Pinned;
+    return policy;
+}
+
+// Returns the size of the tiles of the images that do not fit in the device
+static QSize tileSize(int devId)
+{
+    // A tile with the halo of a kernel launch must fit too
+    const int margin= 2 * Image::maxTileHalo;
+    const QSize maxSize= devMgr().maxImageSize(devId);
+    int width= maxSize.width() - margin;
+    int height= maxSize.height() - margin;
+    const qint64 maxPixels= devMgr().maxAllocSize(devId) / maxPixelBytes;
+    while((qint64)(width + margin) * (height + margin) > maxPixels and (width > 1 or height > 1)) {
+        if(width >= height)
+            width/= 2;
+        else
+            height/= 2;
+    }
+    const QSize maxTile= Image::maxTileSize();
+    if(!maxTile.isEmpty()) {
+        width= qMin(width, maxTile.width());
+        height= qMin(height, maxTile.height());
+    }
+    return QSize(qMax(width, 1), qMax(height, 1));
+}
+
+// Source of the format conversion kernels
+static QString conversionSource(bool toLuma)
+{
+    // Luma weights of qGray(), so the results match QImage conversions
+    return QString("__kernel void qcli_convert(__read_only image2d_t src, __write_only image2d_t dst)\n"
+                   "{\n"
+                   "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+                   "    if(pos.x >= get_image_width(dst) || pos.y >= get_image_height(dst))\n"
+                   "        return;\n"
+                   "    const sampler_t sampler= CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE |"
+                   " CLK_FILTER_NEAREST;\n"
+                   "    const float4 value= read_imagef(src, sampler, pos);\n")
+           + (toLuma ? "    write_imagef(dst, pos, (float4)(dot(value.xyz, (float3)(0.34375f, 0.5f, 0.15625f))));\n"
+                     : "    write_imagef(dst, pos, value);\n")
+           + "}\n";
+}
+
+// Kernel converting between two formats, built once for all the images
+static Kernel& conversionKernel(bool toLuma)
+{
+    static Kernel copy(conversionSource(false));
+    static Kernel luma(conversionSource(true));
+    return toLuma ? luma : copy;
+}
+
 //
 // Constructors and destructor
 //
@@ -34,7 +133,7 @@ Image::Image(QImage image, int devId, bool allocDev, bool upload)
     if(!fromQImage(image))
         qCritical() << "Image constructor: fromQImage failed.";
     if(upload)
-        _upload();
+        uploadAsync();
 }
 
 Image::Image(int width, int height, IFmt format, int devId, bool setBlack, bool allocHost, bool allocDev)
@@ -48,8 +147,12 @@ Image::Image(int width, int height, IFmt format, int devId, bool setBlack, bool
     // Get the device queue and verify devId at the same time
     _queue= devMgr().queue(devId);
     assert(_queue);
+    _uploadQueue= devMgr().queue(devId, QueueRole::Upload);
+    _downloadQueue= devMgr().queue(devId, QueueRole::Download);
     // Verify the image format is supported
-    assert(qcliCtx().supportedFormat(toCLFormat(format)));
+    assert(qcliCtx().supportedFormat(format, devId));
+    _tiled= !fitsDevice(QSize(width, height), devId, format);
+    _allocPolicy= resolvePolicy(defaultAllocPolicy(), devId, _tiled);
 
     // Use {} ctor when QtCreator parses it ok...
     _region[0]= width;
@@ -65,9 +168,15 @@ Image::Image(int width, int height, IFmt format, int devId, bool setBlack, bool
 
 Image::~Image()
 {
-    if(_devBuffer)
-        clReleaseMemObject(_devBuffer);
-    free(_hostBuffer);
+    if(_graph)
+        _graph->imageDestroyed(this);
+    // Pending transfers may still use the host buffer, the device buffer is
+    // recycled with its last command. Zero-copy host memory is freed once the
+    // device commands using it complete, without blocking.
+    if(_allocPolicy != AllocPolicy::ZeroCopy)
+        _waitHost();
+    _freeDev();
+    _freeHost();
 }
 
 //
@@ -76,92 +185,376 @@ Image::~Image()
 
 bool Image::fromQImage(QImage image)
 {
+    // Deferred operations may still read the current data
+    if(!sync())
+        return false;
     // Make sure the image is not null and is the correct size
     if(image.isNull() or image.size() != QSize(_width, _height)) {
         qDebug() << "Invalid image";
         return false;
     }
-    // Make sure the host buffer is allocated
-    if(!_hostBuffer and !_allocHost())
-        return false;
-
     // Make sure the QImage format is ARGB32 or RGB32
-    if(image.format() != QImage::Format_ARGB32 or image.format() != QImage::Format_RGB32)
+    if(image.format() != QImage::Format_ARGB32 and image.format() != QImage::Format_RGB32)
         image= image.convertToFormat(QImage::Format_ARGB32);
 
     // Check if we can memcpy or a conversion must be performed
     if(toQtFormat(_format) != QImage::Format_Invalid) {
+        // Make sure the host buffer is allocated and not in use by a transfer
+        if(!_hostBuffer and !_allocHost())
+            return false;
+        if(!_waitHost())
+            return false;
         memcpy(_hostBuffer, image.constBits(), _bytes);
         _hostValid= true;
         _devValid= false;
         return true;
     }
 
-    // Map QImage to the GPU to perform a conversion
+    // Images that only live in the host are converted there
+    if(_hostBuffer and !_hasDev()) {
+        if(!_waitHost())
+            return false;
+        if(!convertPixels(image.constBits(), IFmt::ARGB, image.bytesPerLine(), _hostBuffer, _format, 0,
+                          _width, _height))
+            return false;
+        _hostValid= true;
+        _devValid= false;
+        return true;
+    }
 
-    // Make sure the device buffer is allocated
-    if(!_devBuffer and !_allocDev())
+    // Upload the QImage data as ARGB and convert it on the device
+    Image staging(_width, _height, IFmt::ARGB, _devId);
+    if(!staging.fromQImage(image) or !staging.convertTo(*this))
         return false;
+    // The staging image waits for its upload when destroyed, the conversion
+    // runs asynchronously
+    return true;
+}
 
-    // Upload QImage data to conversion format
-    cl_int err;
-    auto qimageFormat= toCLFormat(IFmt::ARGB);
-    cl_mem convBuffer= clCreateImage2D(clCtx(), CL_MEM_READ_ONLY, &qimageFormat, _width,
-                                       _height, _width*4, (void*)image.constBits(), &err);
-    if(checkCLError(err, "clCreateImage2D"))
+QImage Image::toQImage()
+{
+    if(!sync())
+        return QImage();
+    const QImage::Format qtFormat= toQtFormat(_format);
+    if(qtFormat == QImage::Format_Invalid) {
+        // Host data is converted in place, there is no need to upload it
+        if(_hostValid and _waitHost()) {
+            QImage image(_width, _height, QImage::Format_ARGB32);
+            if(!convertPixels(_hostBuffer, _format, 0, image.bits(), IFmt::ARGB, image.bytesPerLine(),
+                              _width, _height))
+                return QImage();
+            return image;
+        }
+        // Convert to ARGB on the device, only the ARGB data is downloaded
+        Image staging(_width, _height, IFmt::ARGB, _devId);
+        if(!convertTo(staging))
+            return QImage();
+        return staging.toQImage();
+    }
+
+    // Bring the data to the host if the device copy is the valid one
+    if(!_hostValid and _devValid)
+        downloadAsync();
+    if(!_hostValid or !_waitHost()) {
+        qDebug() << "Image::toQImage: the image has no valid data.";
+        return QImage();
+    }
+
+    QImage image(_width, _height, qtFormat);
+    memcpy(image.bits(), _hostBuffer, _bytes);
+    return image;
+}
+
+bool Image::fromData(const void* data, int stride)
+{
+    const int rowBytes= _width * iFmtBPP(_format) / 8;
+    if(!data or (stride and stride < rowBytes)) {
+        qDebug() << "Image::fromData: invalid data.";
+        return false;
+    }
+    if(!sync())
+        return false;
+    if(!_hostBuffer and !_allocHost())
+        return false;
+    if(!_waitHost())
+        return false;
+    if(!stride or stride == rowBytes) {
+        memcpy(_hostBuffer, data, _bytes);
+    } else {
+        for(int row=0; row<_height; row++)
+            memcpy(_hostBuffer + (size_t)row * rowBytes, static_cast<const char*>(data) + (size_t)row * stride,
+                   rowBytes);
+    }
+    _hostValid= true;
+    _devValid= false;
+    return true;
+}
+
+bool Image::toData(void* data, int stride)
+{
+    const int rowBytes= _width * iFmtBPP(_format) / 8;
+    if(!data or (stride and stride < rowBytes)) {
+        qDebug() << "Image::toData: invalid data.";
+        return false;
+    }
+    if(!sync())
         return false;
+    if(!_hostValid and _devValid)
+        downloadAsync();
+    if(!_hostValid or !_waitHost()) {
+        qDebug() << "Image::toData: the image has no valid data.";
+        return false;
+    }
+    if(!stride or stride == rowBytes) {
+        memcpy(data, _hostBuffer, _bytes);
+    } else {
+        for(int row=0; row<_height; row++)
+            memcpy(static_cast<char*>(data) + (size_t)row * stride, _hostBuffer + (size_t)row * rowBytes,
+                   rowBytes);
+    }
+    return true;
+}
 
-    // Convert QImage to the desired format
-    // TODO implement, make sure the conversion is blocking (the upload isn't)
+bool Image::sync()
+{
+    return _graph ? _graph->sync() : true;
+}
 
-    // Unmap
-    err= clReleaseMemObject(convBuffer);
-    if(checkCLError(err, "clReleaseMemObject"))
+bool Image::convertTo(Image& dst)
+{
+    if(dst.size() != size() or dst._devId != _devId) {
+        qDebug() << "Image::convertTo: the images must have the same size and device.";
+        return false;
+    }
+    if(!sync() or !dst.sync())
         return false;
+    // Reducing the channels computes the luma, the other conversions are done
+    // by the image reads and writes. The source is only read, its host copy stays valid.
+    const bool toLuma= iFmtChanCount(_format) == 4 and iFmtChanCount(dst._format) == 1;
+    return conversionKernel(toLuma)(static_cast<const Image&>(*this), dst);
+}
 
-    // Now _devBuffer has the valid image, no uploading is necessary
-    _devValid= true;
-    _hostValid= false;
+void Image::setDefaultAllocPolicy(AllocPolicy policy)
+{
+    defaultPolicy= (int)policy;
+}
+
+Image::AllocPolicy Image::defaultAllocPolicy()
+{
+    return (AllocPolicy)(int)defaultPolicy;
+}
 
+bool Image::setAllocPolicy(AllocPolicy policy)
+{
+    if(_hostBuffer or _hasDev())
+        return false;
+    _allocPolicy= resolvePolicy(policy, _devId, _tiled);
     return true;
 }
 
+void Image::setMaxTileSize(QSize size)
+{
+    maxTileWidth= size.isEmpty() ? 0 : size.width();
+    maxTileHeight= size.isEmpty() ? 0 : size.height();
+}
+
+QSize Image::maxTileSize()
+{
+    const int width= maxTileWidth;
+    const int height= maxTileHeight;
+    return width and height ? QSize(width, height) : QSize();
+}
+
+bool Image::fitsDevice(QSize size, int devId, IFmt format)
+{
+    const QSize maxSize= devMgr().maxImageSize(devId);
+    if(size.width() > maxSize.width() or size.height() > maxSize.height())
+        return false;
+    if((qint64)size.width() * size.height() * (iFmtBPP(format) / 8) > devMgr().maxAllocSize(devId))
+        return false;
+    const QSize maxTile= maxTileSize();
+    return maxTile.isEmpty() or (size.width() <= maxTile.width() and size.height() <= maxTile.height());
+}
+
+QVector<QRect> Image::tiles() const
+{
+    QVector<QRect> ret;
+    foreach(const Tile& tile, _tiles)
+        ret << tile.rect;
+    return ret;
+}
+
 bool Image::_allocHost()
 {
+    if(!_waitHost())
+        return false;
     _hostValid= false;
-    _bytes= _width * _height * iFmtBPP(_format);
+    _bytes= (size_t)_width * _height * iFmtBPP(_format) / 8;
+
+    switch(_allocPolicy) {
+        case AllocPolicy::Pinned:
+            // The size of an image never changes, an allocated buffer can be kept
+            if(_hostBuffer or _allocPinned())
+                return true;
+            break;
+        case AllocPolicy::ZeroCopy:
+            if(_hostBuffer or _allocZeroCopy())
+                return true;
+            break;
+        default:
+            // Malloc/realloc host buffer
+            _hostBuffer= static_cast<char*>(realloc(_hostBuffer, _bytes));
+            if(_hostBuffer)
+                return true;
+    }
+
+    qDebug() << "Could not alloc host buffer!";
+    return false;
+}
+
+bool Image::_allocDev()
+{
+    _devValid= false;
+    _bytes= (size_t)_width * _height * iFmtBPP(_format) / 8;
+
+    if(_tiled)
+        return !_tiles.isEmpty() or _allocTiles();
+    // The zero-copy device image is allocated with the host buffer. Images whose
+    // device buffer comes first may never need host data, they are recycled by
+    // the pool and get a pinned host buffer if needed.
+    if(_allocPolicy == AllocPolicy::ZeroCopy) {
+        if(_hostBuffer)
+            return _devBuffer or _allocZeroCopy();
+        _allocPolicy= AllocPolicy::Pinned;
+    }
+
+    // The size of an image never changes, an allocated buffer can be kept
+    if(_devBuffer)
+        return true;
+    // Recycled device image, later commands must wait for its previous owner
+    _devBuffer= imgPool().acquire(_devId, _width, _height, _format, CL_MEM_READ_WRITE, &_devEvent);
+    if(!_devBuffer) {
+        qDebug() << "Could not alloc dev buffer!";
+        return false;
+    }
+    return true;
+}
+
+bool Image::_allocTiles()
+{
+    // The tiles are as large as the device allows, they are not recycled by the pool
+    const QSize size= tileSize(_devId);
+    auto clFormat= toCLFormat(_format);
+    for(int y=0; y<_height; y+=size.height()) {
+        for(int x=0; x<_width; x+=size.width()) {
+            const QRect rect= QRect(x, y, size.width(), size.height()).intersected(QRect(0, 0, _width, _height));
+            cl_int err;
+            const cl_mem buffer= clCreateImage2D(clCtx(), CL_MEM_READ_WRITE, &clFormat, rect.width(), rect.height(),
+                                                 0, nullptr, &err);
+            if(checkCLError(err, "clCreateImage2D")) {
+                qDebug() << "Could not alloc dev tile" << rect;
+                _freeDev();
+                return false;
+            }
+            const Tile tile { rect, buffer };
+            _tiles << tile;
+        }
+    }
+    return true;
+}
 
-    // Malloc/realloc host buffer
-    _hostBuffer= static_cast<char*>(realloc(_hostBuffer, _bytes));
-    if(!_hostBuffer) {
-        qDebug() << "Could not alloc host buffer!";
+void Image::_freeDev()
+{
+    // The runtime frees the tiles once their pending commands complete
+    foreach(const Tile& tile, _tiles)
+        clReleaseMemObject(tile.buffer);
+    _tiles.clear();
+    if(!_devBuffer)
+        return;
+    // Zero-copy images use the host buffer, they can not be recycled
+    if(_allocPolicy == AllocPolicy::ZeroCopy)
+        clReleaseMemObject(_devBuffer);
+    else
+        imgPool().release(_devId, _width, _height, _format, CL_MEM_READ_WRITE, _devBuffer, _devEvent);
+    _devBuffer= nullptr;
+}
+
+bool Image::_allocPinned()
+{
+    // Buffer allocated by the runtime in pinned host memory, kept mapped
+    cl_int err;
+    _pinnedBuffer= clCreateBuffer(clCtx(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, _bytes, nullptr, &err);
+    if(checkCLError(err, "clCreateBuffer")) {
+        _pinnedBuffer= nullptr;
+        return false;
+    }
+    _hostBuffer= static_cast<char*>(clEnqueueMapBuffer(_queue, _pinnedBuffer, CL_TRUE,
+                                                       CL_MAP_READ | CL_MAP_WRITE, 0, _bytes,
+                                                       0, nullptr, nullptr, &err));
+    if(checkCLError(err, "clEnqueueMapBuffer")) {
+        clReleaseMemObject(_pinnedBuffer);
+        _pinnedBuffer= nullptr;
+        _hostBuffer= nullptr;
         return false;
     }
     return true;
 }
 
-bool Image::_allocDev()
+bool Image::_allocZeroCopy()
 {
+    assert(!_hostBuffer and !_devBuffer);
+    _hostValid= false;
     _devValid= false;
-    _bytes= _width * _height * iFmtBPP(_format);
 
-    // Malloc / delete+malloc device buffer (no realloc in opencl)
+    _hostBuffer= static_cast<char*>(alignedAlloc(roundUp(_bytes, zeroCopyAlignment), zeroCopyAlignment));
+    if(!_hostBuffer)
+        return false;
+
+    // Device image using the host buffer as its storage
     cl_int err;
-    if(_devBuffer) {
-        err= clReleaseMemObject(_devBuffer);
-        checkCLError(err, "clReleaseMemObject");
-    }
     auto clFormat= toCLFormat(_format);
-    _devBuffer= clCreateImage2D(clCtx(), CL_MEM_READ_WRITE, &clFormat, _width, _height,
-                                0, nullptr, &err);
-    if(checkCLError(err, "clCreateBuffer")) {
+    _devBuffer= clCreateImage2D(clCtx(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, &clFormat, _width,
+                                _height, _width * iFmtBPP(_format) / 8, _hostBuffer, &err);
+    if(checkCLError(err, "clCreateImage2D")) {
+        // Use separate pinned buffers from now on
+        qDebug() << "Image: zero-copy allocation failed, using pinned memory.";
+        alignedFree(_hostBuffer);
+        _hostBuffer= nullptr;
         _devBuffer= nullptr;
-        qDebug() << "Could not alloc dev buffer!";
-        return false;
+        _allocPolicy= AllocPolicy::Pinned;
+        return _allocPinned() and _allocDev();
     }
     return true;
 }
 
+void Image::_freeHost()
+{
+    if(!_hostBuffer)
+        return;
+    switch(_allocPolicy) {
+        case AllocPolicy::Pinned:
+            clEnqueueUnmapMemObject(_queue, _pinnedBuffer, _hostBuffer, 0, nullptr, nullptr);
+            clReleaseMemObject(_pinnedBuffer);
+            _pinnedBuffer= nullptr;
+            break;
+        case AllocPolicy::ZeroCopy: {
+            // The device commands using it may still be pending
+            ZeroCopyBuffer* buffer= new ZeroCopyBuffer { _hostBuffer, _mapping, _mappingBytes };
+            const Event last= _devEvent.isNull() ? _hostEvent : _devEvent;
+            if(last.isNull() or checkCLError(clSetEventCallback(last.clEvent(), CL_COMPLETE, &freeZeroCopy, buffer),
+                                             "clSetEventCallback")) {
+                last.wait();
+                freeZeroCopy(nullptr, CL_COMPLETE, buffer);
+            }
+            _mapping= nullptr;
+            break;
+        }
+        default:
+            free(_hostBuffer);
+    }
+    _hostBuffer= nullptr;
+}
+
 void Image::_setBlack(bool host, bool dev)
 {
     if(!host and !dev)
@@ -173,12 +566,13 @@ void Image::_setBlack(bool host, bool dev)
     // Clear host memory
     if(host) {
         if(!_hostBuffer and !_allocHost()) return;
+        if(!_waitHost()) return;
         memset(_hostBuffer, 0, _bytes);
         wroteHost= true;
     }
     // Clear dev memory
     if(dev) {
-        if(!_devBuffer and !_allocDev()) return;
+        if(!_hasDev() and !_allocDev()) return;
         /*#ifdef CL_VERSION_1_2
             cl_int err;
             err= clEnqueueFillImage(_queue, _devBuffer, clFillingBlack().data(),
@@ -194,51 +588,299 @@ void Image::_setBlack(bool host, bool dev)
     _devValid= wroteDev;
 }
 
-void Image::_upload()
+bool Image::_prepareDev()
 {
-    // The host (device) buffer should exist
-    assert(_hostBuffer);
-    // Make sure the device (dest) buffer is allocated
-    if(!_devBuffer and !_allocDev())
-        return;
+    if(!sync())
+        return false;
+    if(!_hasDev() and !_allocDev())
+        return false;
+    // Kernels wait for the upload with the device event
+    if(!_devValid and _hostValid and uploadAsync().isNull())
+        return false;
+    return true;
+}
 
-    if(!_hostValid) {
-        qDebug() << "Image::_upload: Host buffer is invalid.";
-        return;
+bool Image::_waitHost()
+{
+    if(!_hostEvent.wait())
+        return false;
+    _hostEvent= Event();
+    // Zero-copy host memory is also used by the device commands
+    if(_allocPolicy == AllocPolicy::ZeroCopy) {
+        if(!_devEvent.wait())
+            return false;
+        _devEvent= Event();
     }
+    return true;
+}
 
-    // Upload
+Event Image::_mapUnmap(cl_map_flags flags, cl_command_queue queue)
+{
+    // After the previous commands using the image
+    const auto waitList= Event::waitList(QVector<Event>() << _devEvent, queue);
     cl_int err;
-    err= clEnqueueWriteImage(_queue, _devBuffer, CL_TRUE, _origin, _region, 0, 0,
-                             _hostBuffer, 0, nullptr, nullptr);
-    if(checkCLError(err, "clEnqueueCopyImage"))
-        return;
+    cl_event mapEvent;
+    size_t rowPitch;
+    void* ptr= clEnqueueMapImage(queue, _devBuffer, CL_FALSE, flags, _origin, _region, &rowPitch, nullptr,
+                                 waitList.count(), waitList.count() ? waitList.data() : nullptr,
+                                 &mapEvent, &err);
+    if(checkCLError(err, "clEnqueueMapImage"))
+        return Event();
+    const Event map(mapEvent);
+
+    cl_event unmapEvent;
+    err= clEnqueueUnmapMemObject(queue, _devBuffer, ptr, 1, &mapEvent, &unmapEvent);
+    if(checkCLError(err, "clEnqueueUnmapMemObject"))
+        return Event();
+    return Event(unmapEvent);
+}
+
+Event Image::uploadAsync(cl_command_queue queue)
+{
+    if(!queue)
+        queue= _uploadQueue;
+    if(!sync())
+        return Event();
+    if(_devValid)
+        return Event();
+    if(!_hostValid) {
+        qDebug() << "Image::uploadAsync: Host buffer is invalid.";
+        return Event();
+    }
+    // Make sure the device (dest) buffer is allocated
+    if(!_hasDev() and !_allocDev())
+        return Event();
+
+    if(_tiled) {
+        const Event event= _transferTiles(true, queue, _hostBuffer, (size_t)_width * iFmtBPP(_format) / 8);
+        if(event.isNull())
+            return Event();
+        _hostEvent= event;
+        _devValid= true;
+        return event;
+    }
+
+    // The device image already uses the host data
+    if(_allocPolicy == AllocPolicy::ZeroCopy) {
+        const Event event= _mapUnmap(CL_MAP_WRITE, queue);
+        if(event.isNull())
+            return Event();
+        _hostEvent= _devEvent= event;
+        _devValid= true;
+        profiler().record(Profiler::Category::Upload, _devId, event, _bytes);
+        return event;
+    }
+
+    // Upload after the previous commands using the device buffer
+    const auto waitList= Event::waitList(QVector<Event>() << _devEvent, queue);
+    cl_event event;
+    cl_int err= clEnqueueWriteImage(queue, _devBuffer, CL_FALSE, _origin, _region, 0, 0, _hostBuffer,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+    if(checkCLError(err, "clEnqueueWriteImage"))
+        return Event();
 
+    // The transfer reads the host buffer and writes the device buffer
+    _hostEvent= _devEvent= Event(event);
     _devValid= true;
+    profiler().record(Profiler::Category::Upload, _devId, _devEvent, _bytes);
+    return _devEvent;
 }
 
-void Image::_download()
+Event Image::downloadAsync(cl_command_queue queue)
 {
-    // The device (source) buffer should exist
-    assert(_devBuffer);
+    if(!queue)
+        queue= _downloadQueue;
+    if(!sync())
+        return Event();
+    if(_hostValid)
+        return Event();
+    if(!_devValid) {
+        qDebug() << "Image::downloadAsync: Device buffer is invalid.";
+        return Event();
+    }
     // Make sure the host (dest) buffer is allocated
     if(!_hostBuffer and !_allocHost())
-        return;
+        return Event();
 
+    if(_tiled) {
+        const Event event= _transferTiles(false, queue, _hostBuffer, (size_t)_width * iFmtBPP(_format) / 8);
+        if(event.isNull())
+            return Event();
+        _hostEvent= event;
+        _hostValid= true;
+        return event;
+    }
+
+    // The host buffer already holds the device data
+    if(_allocPolicy == AllocPolicy::ZeroCopy) {
+        const Event event= _mapUnmap(CL_MAP_READ, queue);
+        if(event.isNull())
+            return Event();
+        _hostEvent= _devEvent= event;
+        _hostValid= true;
+        profiler().record(Profiler::Category::Download, _devId, event, _bytes);
+        return event;
+    }
+
+    // Download after the previous commands writing the device buffer
+    const auto waitList= Event::waitList(QVector<Event>() << _devEvent, queue);
+    cl_event event;
+    cl_int err= clEnqueueReadImage(queue, _devBuffer, CL_FALSE, _origin, _region, 0, 0, _hostBuffer,
+                                   waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+    if(checkCLError(err, "clEnqueueReadImage"))
+        return Event();
+
+    // The transfer reads the device buffer and writes the host buffer
+    _hostEvent= _devEvent= Event(event);
+    _hostValid= true;
+    profiler().record(Profiler::Category::Download, _devId, _hostEvent, _bytes);
+    return _hostEvent;
+}
+
+Event Image::_transferTiles(bool upload, cl_command_queue queue, char* data, size_t rowPitch)
+{
+    // The tiles are transferred in place from the host rows, each transfer
+    // waits for the previous one so the last event completes them all
+    const size_t pixelBytes= iFmtBPP(_format) / 8;
+    foreach(const Tile& tile, _tiles) {
+        const size_t region[3] { (size_t)tile.rect.width(), (size_t)tile.rect.height(), 1 };
+        char* tileData= data + (size_t)tile.rect.y() * rowPitch + tile.rect.x() * pixelBytes;
+        const auto waitList= Event::waitList(QVector<Event>() << _devEvent, queue);
+        cl_event event;
+        cl_int err;
+        if(upload) {
+            err= clEnqueueWriteImage(queue, tile.buffer, CL_FALSE, _origin, region, rowPitch, 0, tileData,
+                                     waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+        } else {
+            err= clEnqueueReadImage(queue, tile.buffer, CL_FALSE, _origin, region, rowPitch, 0, tileData,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+        }
+        if(checkCLError(err, upload ? "clEnqueueWriteImage" : "clEnqueueReadImage"))
+            return Event();
+        _devEvent= Event(event);
+        profiler().record(upload ? Profiler::Category::Upload : Profiler::Category::Download, _devId, _devEvent,
+                          region[0] * region[1] * pixelBytes);
+    }
+    return _devEvent;
+}
+
+Event Image::_uploadFrom(const char* data, size_t rowPitch)
+{
+    if(!sync())
+        return Event();
+    // Zero-copy device images use the host buffer as their storage
+    if(!_waitHost())
+        return Event();
+    if(!_hasDev() and !_allocDev())
+        return Event();
+
+    Event event;
+    if(_tiled) {
+        event= _transferTiles(true, _uploadQueue, const_cast<char*>(data), rowPitch);
+    } else {
+        const auto waitList= Event::waitList(QVector<Event>() << _devEvent, _uploadQueue);
+        cl_event write;
+        cl_int err= clEnqueueWriteImage(_uploadQueue, _devBuffer, CL_FALSE, _origin, _region, rowPitch, 0, data,
+                                        waitList.count(), waitList.count() ? waitList.data() : nullptr, &write);
+        if(checkCLError(err, "clEnqueueWriteImage"))
+            return Event();
+        event= _devEvent= Event(write);
+        profiler().record(Profiler::Category::Upload, _devId, event, _bytes);
+    }
+    if(event.isNull())
+        return Event();
+    _devValid= true;
+    _hostValid= false;
+    return event;
+}
+
+bool Image::_downloadTo(char* data, size_t rowPitch)
+{
+    if(!sync())
+        return false;
+    const size_t rowBytes= (size_t)_width * iFmtBPP(_format) / 8;
+    if(_hostValid) {
+        if(!_waitHost())
+            return false;
+        for(int row=0; row<_height; row++)
+            memcpy(data + row * rowPitch, _hostBuffer + row * rowBytes, rowBytes);
+        return true;
+    }
     if(!_devValid) {
-        qDebug() << "Image::_download: Device buffer is invalid.";
-        return;
+        qDebug() << "Image::_downloadTo: the image has no valid data.";
+        return false;
     }
 
-    // Download
-    cl_int err;
-    err= clEnqueueReadImage(_queue, _devBuffer, CL_TRUE, _origin, _region, 0, 0,
-                            _hostBuffer, 0, nullptr, nullptr);
-    if(checkCLError(err, "clEnqueueCopyImage"))
-        return;
+    Event event;
+    if(_tiled) {
+        event= _transferTiles(false, _downloadQueue, data, rowPitch);
+    } else {
+        const auto waitList= Event::waitList(QVector<Event>() << _devEvent, _downloadQueue);
+        cl_event read;
+        cl_int err= clEnqueueReadImage(_downloadQueue, _devBuffer, CL_FALSE, _origin, _region, rowPitch, 0, data,
+                                       waitList.count(), waitList.count() ? waitList.data() : nullptr, &read);
+        if(checkCLError(err, "clEnqueueReadImage"))
+            return false;
+        event= _devEvent= Event(read);
+        profiler().record(Profiler::Category::Download, _devId, event, _bytes);
+    }
+    return !event.isNull() and event.wait();
+}
 
+bool Image::_adoptMapping(void* mapping, size_t mappingBytes, char* data)
+{
+    if(_allocPolicy != AllocPolicy::ZeroCopy or _tiled or _hostBuffer or _devBuffer
+       or reinterpret_cast<quintptr>(data) % zeroCopyAlignment)
+        return false;
+
+    // Device image using the mapped pages as its storage, written pages are copied on write
+    cl_int err;
+    auto clFormat= toCLFormat(_format);
+    const cl_mem buffer= clCreateImage2D(clCtx(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, &clFormat, _width,
+                                         _height, _width * iFmtBPP(_format) / 8, data, &err);
+    if(checkCLError(err, "clCreateImage2D"))
+        return false;
+    _bytes= (size_t)_width * _height * iFmtBPP(_format) / 8;
+    _devBuffer= buffer;
+    _hostBuffer= data;
+    _mapping= mapping;
+    _mappingBytes= mappingBytes;
+    // The next upload only maps and unmaps the device image
     _hostValid= true;
+    _devValid= false;
+    return true;
 }
 
+bool Image::_copyTiles(cl_mem other, const QRect& rect, const QPoint& pos, bool toTiles, const Event& after)
+{
+    QVector<Event> pending;
+    pending << _devEvent << after;
+    // The device buffer of an untiled image is its only tile
+    const Tile whole { QRect(QPoint(0, 0), size()), _devBuffer };
+    foreach(const Tile& tile, _tiled ? _tiles : QVector<Tile>() << whole) {
+        const QRect part= tile.rect.intersected(rect);
+        if(part.isEmpty())
+            continue;
+        const size_t tileOrigin[3] { (size_t)(part.x() - tile.rect.x()), (size_t)(part.y() - tile.rect.y()), 0 };
+        const size_t otherOrigin[3] { (size_t)(part.x() - rect.x() + pos.x()),
+                                      (size_t)(part.y() - rect.y() + pos.y()), 0 };
+        const size_t region[3] { (size_t)part.width(), (size_t)part.height(), 1 };
+        const auto waitList= Event::waitList(pending, _queue);
+        cl_event event;
+        cl_int err;
+        if(toTiles) {
+            err= clEnqueueCopyImage(_queue, other, tile.buffer, otherOrigin, tileOrigin, region,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+        } else {
+            err= clEnqueueCopyImage(_queue, tile.buffer, other, tileOrigin, otherOrigin, region,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+        }
+        if(checkCLError(err, "clEnqueueCopyImage"))
+            return false;
+        _devEvent= Event(event);
+        pending= QVector<Event>() << _devEvent;
+    }
+    return true;
+}
 
 } // namespace QCLI
@@ -22,17 +22,51 @@
 #include <CL/cl.h>
 
 #include "ifmt.h"
+#include "opencl/event.h"
 
 namespace QCLI {
 
+class Graph;
+
 /** \brief Represents a QCLI image that has both a host and device version.
+ *
+ *  Images larger than the device limits (CL_DEVICE_IMAGE2D_MAX_WIDTH/HEIGHT or
+ *  CL_DEVICE_MAX_MEM_ALLOC_SIZE) are tiled: their device data is a grid of
+ *  device images, transferred tile by tile, and the kernels run once per tile
+ *  (see Kernel::setHalo()). Their host buffer always uses the Malloc policy.
  *
  *  This class is *not* thread-safe. TODO make thread safe?
  */
 
 class Image
 {
+    // Kernel binds the device buffer as a kernel argument
+    friend class Kernel;
+    // Graph records the deferred operations of the image
+    friend class Graph;
+    // FramePipeline writes and reads the host buffers of its frames
+    friend class FramePipeline;
+    // TileScheduler transfers tiles between the host buffers and its tile images
+    friend class TileScheduler;
+    // StripeStreamer reads and writes the rows of its stripes in the host buffers
+    friend class StripeStreamer;
+    // ImageFile transfers the pixels between the file mappings and the buffers
+    friend class ImageFile;
+    // ImageBatch reads and writes its slices in the host buffer of its stack
+    friend class ImageBatch;
 public:
+    /// Allocation policy of the host buffer
+    enum class AllocPolicy
+    {
+        Malloc,   /// Pageable memory, the runtime stages the transfers through pinned memory
+        Pinned,   /// Pinned memory, a CL_MEM_ALLOC_HOST_PTR buffer mapped in the host
+        ZeroCopy, /// Host memory used as the device image storage (CL_MEM_USE_HOST_PTR),
+                  /// transfers are only a map/unmap. Falls back to Pinned on devices
+                  /// without unified memory, and for the images whose device buffer
+                  /// is allocated first (they may never need host data).
+        Auto      /// ZeroCopy on devices with unified memory, Pinned otherwise
+    };
+
     /// Creates an empty image of a certain size
     Image(int width, int height, IFmt format=IFmt::ARGB, int devId= 0, bool setBlack=false, bool allocHost=false,
           bool allocDev=false);
@@ -56,35 +90,158 @@ public:
     ~Image();
 
     /// Load data from a QImage (must be of the same size)
+    /// Formats other than ARGB are converted on the device, or on the host if
+    /// the image has no device buffer.
     /// @retval false on error
     bool fromQImage(QImage image);       
+    /// Returns a copy of the image as a QImage, downloading it if needed
+    /// Formats other than ARGB are converted to ARGB first, on the host if its
+    /// data is valid and on the device otherwise.
+    /// @retval null QImage on error
+    QImage toQImage();
+    /// Load raw pixels of the image format (must be of the same size)
+    /// @param stride bytes per row, 0 for tightly packed rows
+    /// @retval false on error
+    bool fromData(const void* data, int stride= 0);
+    /// Copies the raw pixels of the image format, downloading them if needed
+    /// @param stride bytes per row, 0 for tightly packed rows
+    /// @retval false on error
+    bool toData(void* data, int stride= 0);
+
+    /// Runs the deferred operations (see Graph) that use the image
+    /// @retval false on error
+    bool sync();
+    /// Copies the image to dst converting it to the format of dst, on the device
+    /// Formats with 4 channels are converted to luma with the qGray() weights,
+    /// luma is replicated in the RGB channels with an opaque alpha.
+    /// @param dst image of the same size and device
+    /// @retval false on error
+    bool convertTo(Image& dst);
+
+    /// Enqueues the upload of the host data to the device, without blocking
+    /// The host data must not be modified until the returned event completes,
+    /// later kernels and transfers of the image wait for it on the device
+    /// @param queue queue of the device of the image, nullptr for its QueueRole::Upload queue
+    /// @retval null Event on error or if the device data was already valid
+    Event uploadAsync(cl_command_queue queue= nullptr);
+    /// Enqueues the download of the device data to the host, without blocking
+    /// The host data is only valid once the returned event completes (toQImage()
+    /// and the other host accessors wait for it)
+    /// @param queue queue of the device of the image, nullptr for its QueueRole::Download queue
+    /// @retval null Event on error or if the host data was already valid
+    Event downloadAsync(cl_command_queue queue= nullptr);
+    /// Returns the last pending command using the device buffer
+    Event devEvent() const { return _devEvent; }
+    /// Returns the last pending command using the host buffer
+    Event hostEvent() const { return _hostEvent; }
+
+    /// Sets the allocation policy used by the images created afterwards (Auto by default)
+    static void setDefaultAllocPolicy(AllocPolicy policy);
+    /// Returns the allocation policy used by new images
+    static AllocPolicy defaultAllocPolicy();
+    /// Returns the allocation policy of the image (never Auto)
+    AllocPolicy allocPolicy() const { return _allocPolicy; }
+    /// Changes the allocation policy, only possible before the buffers are allocated
+    /// @retval false if the buffers are already allocated
+    bool setAllocPolicy(AllocPolicy policy);
+
+    /// Largest halo of the kernels launched over tiled images
+    static const int maxTileHalo= 128;
+    /// Sets the largest device image of the images created afterwards, the larger
+    /// images are tiled as if they exceeded the device limits (QSize() for the limits)
+    static void setMaxTileSize(QSize size);
+    /// Returns the largest device image set with setMaxTileSize()
+    static QSize maxTileSize();
+    /// Returns true if the images of a size and format fit in a single device image, so they are not tiled
+    static bool fitsDevice(QSize size, int devId= 0, IFmt format= IFmt::ARGB32F);
+    /// Returns true if the device data is split in tiles
+    bool tiled() const { return _tiled; }
+    /// Returns the pixels of each device tile, empty if not tiled or not allocated
+    QVector<QRect> tiles() const;
 
     int width() { return _width; }
     int height() { return _height; }
+    QSize size() const { return QSize(_width, _height); }
+    IFmt format() const { return _format; }
+    int devId() const { return _devId; }
 
 private:
+    /// Device image holding a part of a tiled image
+    struct Tile {
+        QRect rect;
+        cl_mem buffer;
+    };
+
     bool _allocHost();
     bool _allocDev();
+    bool _allocTiles();
+    bool _allocPinned();
+    bool _allocZeroCopy();
+    void _freeHost();
+    /// Gives the device buffer back to the image pool
+    void _freeDev();
+    /// Returns true if the device buffer or the tiles are allocated
+    bool _hasDev() const { return _devBuffer or !_tiles.isEmpty(); }
+    /// Enqueues a map and unmap of a zero-copy device image, to make the host
+    /// and device writes visible to each other
+    Event _mapUnmap(cl_map_flags flags, cl_command_queue queue);
+    /// Enqueues the transfers of all the tiles, one after the other
+    /// @param data host rows of the whole image
+    Event _transferTiles(bool upload, cl_command_queue queue, char* data, size_t rowPitch);
+    /// Enqueues the upload of host rows other than the host buffer, which is invalidated
+    /// The rows must not be modified until the returned event completes
+    Event _uploadFrom(const char* data, size_t rowPitch);
+    /// Copies the valid data to host rows other than the host buffer, blocking
+    bool _downloadTo(char* data, size_t rowPitch);
+    /// Uses a file mapping as the host buffer and the zero-copy device image storage
+    /// @param data first pixel, aligned as the zero-copy host buffers
+    /// @retval false if the image can not use it, nothing changes then
+    bool _adoptMapping(void* mapping, size_t mappingBytes, char* data);
+    /// Enqueues the copies of a rectangle between the tiles (or the device buffer of an
+    /// untiled image) and another device image
+    /// @param other device image of the same format
+    /// @param pos position of rect in other
+    /// @param after command to wait for besides the previous ones using the tiles
+    /// @retval false on error
+    bool _copyTiles(cl_mem other, const QRect& rect, const QPoint& pos, bool toTiles, const Event& after);
+    /// Makes sure the device buffer is allocated and up to date (used before a kernel launch)
+    bool _prepareDev();
+    /// Marks the device buffer as the only valid copy (used after a kernel launch)
+    void _devWritten(const Event& event) { _devValid= true; _hostValid= false; _devEvent= event; }
+    /// Waits for the pending commands using the host buffer
+    bool _waitHost();
     void _setBlack(bool host, bool dev);
-    void _upload();
-    void _download();
 
     // Host buffer
+    AllocPolicy _allocPolicy;
     char* _hostBuffer= nullptr;
+    cl_mem _pinnedBuffer= nullptr; // Buffer mapped in _hostBuffer with the Pinned policy
+    void* _mapping= nullptr;       // File mapped in _hostBuffer with the ZeroCopy policy (see ImageFile)
+    size_t _mappingBytes= 0;
     bool _hostValid= false;
+    Event _hostEvent; // Last pending transfer reading or writing the host buffer
     // Device buffer
     cl_mem _devBuffer= nullptr;
     bool _devValid= false;
+    Event _devEvent; // Last pending command reading or writing the device buffer
+    // Device tiles, used instead of _devBuffer when the image exceeds the device limits
+    bool _tiled= false;
+    QVector<Tile> _tiles;
 
     // Image properties. All properties but _bytes are initialized in the ctors.
     int _width;
     int _height;
     IFmt _format;
     int _devId;
-    int _bytes= 0;
+    size_t _bytes= 0;
+
+    // Graph with deferred operations using the image, nullptr if none
+    Graph* _graph= nullptr;
 
-    // Copy of the device queue (OpenCL calls using queue are thread-safe)
-    cl_command_queue _queue= nullptr;
+    // Copy of the device queues (OpenCL calls using queue are thread-safe)
+    cl_command_queue _queue= nullptr;         // Compute
+    cl_command_queue _uploadQueue= nullptr;   // Same as _queue with QueueTopology::Single
+    cl_command_queue _downloadQueue= nullptr;
     // "origin and region" for the full image, used for OpenCL image operations
     size_t _origin[3] {0, 0, 0};
     size_t _region[3]; // Initialized in the ctors
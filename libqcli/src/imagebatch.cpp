@@ -0,0 +1,141 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "imagebatch.h"
+
+#include <cassert>
+#include <limits>
+#include "image.h"
+#include "util/hostconvert.h"
+
+namespace QCLI {
+
+ImageBatch::ImageBatch(int width, int height, int count, IFmt format, int devId)
+    : _size(width, height), _count(count), _format(format), _devId(devId)
+{
+    assert(width > 0);
+    assert(height > 0);
+    assert(count > 0);
+    _sliceBytes= (size_t)width * height * iFmtBPP(format) / 8;
+    if(count > maxCount(_size, devId, format)) {
+        qDebug() << "ImageBatch:" << count << "images of" << _size << "do not fit in a device image.";
+        return;
+    }
+    _stack= new Image(width, height * count, format, devId);
+}
+
+ImageBatch::~ImageBatch()
+{
+    delete _stack;
+}
+
+int ImageBatch::maxCount(QSize size, int devId, IFmt format)
+{
+    // The largest stack that is not tiled
+    int low= 0;
+    int high= std::numeric_limits<int>::max() / size.height();
+    while(low < high) {
+        const int count= high - (high - low) / 2;
+        if(Image::fitsDevice(QSize(size.width(), size.height() * count), devId, format))
+            low= count;
+        else
+            high= count - 1;
+    }
+    return low;
+}
+
+bool ImageBatch::fromQImage(int index, QImage image)
+{
+    if(image.isNull() or image.size() != _size) {
+        qDebug() << "ImageBatch::fromQImage: invalid image.";
+        return false;
+    }
+    if(image.format() != QImage::Format_ARGB32 and image.format() != QImage::Format_RGB32)
+        image= image.convertToFormat(QImage::Format_ARGB32);
+    char* slice= hostSlice(index, true);
+    return slice and convertPixels(image.constBits(), IFmt::ARGB, image.bytesPerLine(), slice, _format, 0,
+                                   _size.width(), _size.height());
+}
+
+QImage ImageBatch::toQImage(int index)
+{
+    const char* slice= hostSlice(index, false);
+    if(!slice)
+        return QImage();
+    QImage image(_size, QImage::Format_ARGB32);
+    if(!convertPixels(slice, _format, 0, image.bits(), IFmt::ARGB, image.bytesPerLine(),
+                      _size.width(), _size.height()))
+        return QImage();
+    return image;
+}
+
+bool ImageBatch::fromData(int index, const void* data, int stride)
+{
+    const int rowBytes= _size.width() * iFmtBPP(_format) / 8;
+    if(!data or (stride and stride < rowBytes)) {
+        qDebug() << "ImageBatch::fromData: invalid data.";
+        return false;
+    }
+    char* slice= hostSlice(index, true);
+    return slice and convertPixels(data, _format, stride, slice, _format, 0, _size.width(), _size.height());
+}
+
+bool ImageBatch::toData(int index, void* data, int stride)
+{
+    const int rowBytes= _size.width() * iFmtBPP(_format) / 8;
+    if(!data or (stride and stride < rowBytes)) {
+        qDebug() << "ImageBatch::toData: invalid data.";
+        return false;
+    }
+    const char* slice= hostSlice(index, false);
+    return slice and convertPixels(slice, _format, 0, data, _format, stride, _size.width(), _size.height());
+}
+
+Event ImageBatch::uploadAsync()
+{
+    return _stack ? _stack->uploadAsync() : Event();
+}
+
+Event ImageBatch::downloadAsync()
+{
+    return _stack ? _stack->downloadAsync() : Event();
+}
+
+char* ImageBatch::hostSlice(int index, bool write)
+{
+    if(!_stack or index < 0 or index >= _count) {
+        qDebug() << "ImageBatch: invalid image" << index;
+        return nullptr;
+    }
+    Image& stack= *_stack;
+    if(!stack.sync())
+        return nullptr;
+    // The other images stay valid, the whole batch comes back in one transfer
+    if(!stack._hostValid and stack._devValid and stack.downloadAsync().isNull())
+        return nullptr;
+    if(!stack._hostBuffer and !stack._allocHost())
+        return nullptr;
+    if(!stack._waitHost())
+        return nullptr;
+    if(write) {
+        stack._hostValid= true;
+        stack._devValid= false;
+    } else if(!stack._hostValid) {
+        qDebug() << "ImageBatch: the batch has no valid data.";
+        return nullptr;
+    }
+    return stack._hostBuffer + index * _sliceBytes;
+}
+
+} // namespace QCLI
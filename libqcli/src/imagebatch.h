@@ -0,0 +1,124 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_IMAGEBATCH_H
+#define _QCLI_IMAGEBATCH_H
+
+#include <QtCore>
+#include <QImage>
+
+#include "ifmt.h"
+#include "opencl/event.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Batch of images of the same size and format in a single device image
+ *
+ *  The images (slices) are stacked vertically in one image, so the whole batch
+ *  is allocated, uploaded and downloaded with a single command, and a kernel
+ *  processes all the slices in a single 3D launch: the third dimension of the
+ *  range is the slice, and slice z is at rows [z * height, (z + 1) * height).
+ *
+ *      __kernel void invert(__read_only image2d_t src, __write_only image2d_t dst)
+ *      {
+ *          const int height= get_image_height(dst) / get_global_size(2);
+ *          if(get_global_id(0) >= get_image_width(dst) || get_global_id(1) >= height)
+ *              return;
+ *          const int2 pos= (int2)(get_global_id(0), get_global_id(1) + get_global_id(2) * height);
+ *          ...
+ *      }
+ *
+ *      ImageBatch src(128, 128, 500), dst(128, 128, 500);
+ *      for(int i=0; i<500; i++)
+ *          src.fromQImage(i, thumbnails[i]);
+ *      invert(src, dst); // One upload and one launch
+ *
+ *  OpenCL 1.1 has no image arrays, and 3D images can only be written with the
+ *  cl_khr_3d_image_writes extension, the stacked 2D image works on all devices.
+ *
+ *  The slices are read and written in the host buffer of the stack, the first
+ *  access after a kernel downloads the whole batch. The slices never written
+ *  are undefined. The batches are never tiled (see maxCount()).
+ *
+ *  This class is *not* thread-safe, like Image.
+ */
+
+class ImageBatch
+{
+public:
+    /// Creates a batch of count images of a size
+    /// The batch is null if the stacked images do not fit in a single device image
+    ImageBatch(int width, int height, int count, IFmt format= IFmt::ARGB, int devId= 0);
+    /// Creates a batch of count images of a size
+    ImageBatch(QSize size, int count, IFmt format= IFmt::ARGB, int devId= 0)
+        : ImageBatch(size.width(), size.height(), count, format, devId) { }
+    ~ImageBatch();
+
+    /// Returns the largest batch of images of a size and format that fits in a single device image
+    static int maxCount(QSize size, int devId= 0, IFmt format= IFmt::ARGB);
+
+    /// Returns true if the batch exceeds maxCount()
+    bool isNull() const { return !_stack; }
+    /// Returns the number of images
+    int count() const { return _count; }
+    /// Returns the size of each image
+    QSize size() const { return _size; }
+    IFmt format() const { return _format; }
+    int devId() const { return _devId; }
+
+    /// Load an image from a QImage (must be of the same size)
+    /// Formats other than ARGB are converted on the host
+    /// @retval false on error
+    bool fromQImage(int index, QImage image);
+    /// Returns a copy of an image as a QImage, downloading the batch if needed
+    /// @retval null QImage on error
+    QImage toQImage(int index);
+    /// Load the raw pixels of an image (see Image::fromData())
+    /// @retval false on error
+    bool fromData(int index, const void* data, int stride= 0);
+    /// Copies the raw pixels of an image, downloading the batch if needed (see Image::toData())
+    /// @retval false on error
+    bool toData(int index, void* data, int stride= 0);
+
+    /// Enqueues the upload of all the images in a single transfer (see Image::uploadAsync())
+    Event uploadAsync();
+    /// Enqueues the download of all the images in a single transfer (see Image::downloadAsync())
+    Event downloadAsync();
+
+    /// Returns the image holding the stacked images, of size (width, height * count)
+    Image& stack() { return *_stack; }
+
+    /// Disable copying
+    ImageBatch(const ImageBatch& other) = delete;
+    /// Disable assignments
+    ImageBatch& operator=(const ImageBatch& other) = delete;
+
+private:
+    /// Returns the host rows of an image, nullptr on error
+    /// @param write the image is about to be written, the host buffer becomes the valid copy
+    char* hostSlice(int index, bool write);
+
+    Image* _stack= nullptr;
+    QSize _size;
+    int _count;
+    IFmt _format;
+    int _devId;
+    size_t _sliceBytes;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_IMAGEBATCH_H
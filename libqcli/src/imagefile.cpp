@@ -0,0 +1,372 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "imagefile.h"
+
+#include <cctype>
+#include <cstring>
+#include "image.h"
+#include "util/utils.h"
+
+namespace QCLI {
+
+// Magic of the raw files
+static const char rawMagic[]= "QCLIRAW";
+
+// Names of the formats in the raw files
+static const struct {
+    IFmt format;
+    const char* name;
+} formatNames[]= {
+    { IFmt::ARGB,    "ARGB"    },
+    { IFmt::ARGB16,  "ARGB16"  },
+    { IFmt::ARGB16F, "ARGB16F" },
+    { IFmt::ARGB32F, "ARGB32F" },
+    { IFmt::LUMA,    "LUMA"    },
+    { IFmt::LUMA16,  "LUMA16"  },
+    { IFmt::LUMA16F, "LUMA16F" },
+    { IFmt::LUMA32F, "LUMA32F" }
+};
+
+// Returns true if the host stores the samples little-endian, like negative PFM scales
+static bool littleEndianHost()
+{
+    return Q_BYTE_ORDER == Q_LITTLE_ENDIAN;
+}
+
+// Returns the next whitespace separated token of a header, skipping the comments
+static QByteArray nextToken(const char* data, size_t size, size_t* pos)
+{
+    while(*pos < size) {
+        if(data[*pos] == '#') {
+            while(*pos < size and data[*pos] != '\n')
+                (*pos)++;
+        } else if(isspace((unsigned char)data[*pos])) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+    const size_t start= *pos;
+    while(*pos < size and !isspace((unsigned char)data[*pos]))
+        (*pos)++;
+    return QByteArray(data + start, *pos - start);
+}
+
+// Copies a sample, reversing its bytes if swap
+static inline void copySample(char* dst, const char* src, int bytes, bool swap)
+{
+    if(!swap) {
+        memcpy(dst, src, bytes);
+        return;
+    }
+    for(int i=0; i<bytes; i++)
+        dst[i]= src[bytes - 1 - i];
+}
+
+ImageFile::ImageFile(QString fileName)
+    : _fileName(fileName)
+{
+    _mapping= mapFile(fileName, &_mappingBytes);
+    if(!_mapping) {
+        qDebug() << "ImageFile: could not map" << fileName;
+        return;
+    }
+    if(!parseHeader()) {
+        qDebug() << "ImageFile:" << fileName << "is not a valid image file.";
+        unmapFile(_mapping, _mappingBytes);
+        _mapping= nullptr;
+    }
+}
+
+ImageFile::~ImageFile()
+{
+    QMutexLocker locker(&_lock);
+    Event::waitAll(_pending);
+    if(_mapping)
+        unmapFile(_mapping, _mappingBytes);
+}
+
+bool ImageFile::parseHeader()
+{
+    const char* data= static_cast<const char*>(_mapping);
+    size_t pos= 0;
+    const QByteArray magic= nextToken(data, _mappingBytes, &pos);
+    const int width= nextToken(data, _mappingBytes, &pos).toInt();
+    const int height= nextToken(data, _mappingBytes, &pos).toInt();
+    const QByteArray last= nextToken(data, _mappingBytes, &pos);
+    if(width <= 0 or height <= 0)
+        return false;
+    _size= QSize(width, height);
+
+    // The pixels follow a single whitespace after the last field of PNM headers
+    size_t pixelsPos= pos + 1;
+    int sampleBytes= 1;
+    if(magic == rawMagic) {
+        _type= Type::Raw;
+        bool found= false;
+        for(const auto& format: formatNames) {
+            if(last == format.name) {
+                _format= format.format;
+                found= true;
+            }
+        }
+        if(!found)
+            return false;
+        pixelsPos= rawHeaderBytes;
+        _fileChannels= iFmtChanCount(_format);
+        sampleBytes= iFmtBPP(_format) / 8 / _fileChannels;
+        _direct= true;
+    } else if(magic == "P5" or magic == "P6") {
+        _type= magic == "P5" ? Type::PGM : Type::PPM;
+        const int maxValue= last.toInt();
+        if(maxValue <= 0 or maxValue > 65535)
+            return false;
+        // 16-bit samples are big-endian
+        sampleBytes= maxValue > 255 ? 2 : 1;
+        _swap= sampleBytes == 2 and littleEndianHost();
+        _fileChannels= _type == Type::PGM ? 1 : 3;
+        if(_type == Type::PGM)
+            _format= sampleBytes == 1 ? IFmt::LUMA : IFmt::LUMA16;
+        else
+            _format= sampleBytes == 1 ? IFmt::ARGB : IFmt::ARGB16;
+        _direct= _type == Type::PGM and !_swap;
+    } else if(magic == "Pf" or magic == "PF") {
+        _type= Type::PFM;
+        bool ok;
+        const double scale= last.toDouble(&ok);
+        if(!ok or !scale)
+            return false;
+        // A negative scale marks little-endian samples, the rows go from the bottom
+        sampleBytes= 4;
+        _swap= (scale < 0) != littleEndianHost();
+        _bottomUp= true;
+        _fileChannels= magic == "Pf" ? 1 : 3;
+        _format= _fileChannels == 1 ? IFmt::LUMA32F : IFmt::ARGB32F;
+        _direct= false;
+    } else {
+        return false;
+    }
+
+    _rowBytes= (qint64)width * _fileChannels * sampleBytes;
+    if(pixelsPos + (size_t)_rowBytes * height > _mappingBytes)
+        return false;
+    _pixels= data + pixelsPos;
+    return true;
+}
+
+void ImageFile::convertRows(int y, int count, char* data) const
+{
+    const int channels= iFmtChanCount(_format);
+    const int sampleBytes= iFmtBPP(_format) / 8 / channels;
+    const size_t rowBytes= (size_t)_size.width() * iFmtBPP(_format) / 8;
+    // Alpha of the formats with an opaque alpha added
+    const quint16 opaque16= 0xFFFF;
+    const float opaque32F= 1.0f;
+
+    for(int row=y; row<y+count; row++) {
+        const int fileRow= _bottomUp ? _size.height() - 1 - row : row;
+        const char* src= _pixels + fileRow * _rowBytes;
+        char* dst= data + (row - y) * rowBytes;
+        if(_fileChannels == channels and !_swap) {
+            memcpy(dst, src, rowBytes);
+        } else if(_fileChannels == channels) {
+            for(size_t i=0; i<rowBytes; i+=sampleBytes)
+                copySample(dst + i, src + i, sampleBytes, true);
+        } else if(_format == IFmt::ARGB) {
+            // QImage::Format_ARGB32 layout
+            quint32* pixel= reinterpret_cast<quint32*>(dst);
+            for(int x=0; x<_size.width(); x++, src+=3)
+                pixel[x]= qRgb((uchar)src[0], (uchar)src[1], (uchar)src[2]);
+        } else {
+            // RGBA order
+            const char* alpha= _format == IFmt::ARGB16 ? reinterpret_cast<const char*>(&opaque16)
+                                                       : reinterpret_cast<const char*>(&opaque32F);
+            for(int x=0; x<_size.width(); x++, src+=3*sampleBytes, dst+=4*sampleBytes) {
+                for(int c=0; c<3; c++)
+                    copySample(dst + c * sampleBytes, src + c * sampleBytes, sampleBytes, _swap);
+                memcpy(dst + 3 * sampleBytes, alpha, sampleBytes);
+            }
+        }
+    }
+}
+
+bool ImageFile::readRows(int y, int count, void* data)
+{
+    if(isNull() or y < 0 or count < 0 or y + count > _size.height())
+        return false;
+    convertRows(y, count, static_cast<char*>(data));
+    return true;
+}
+
+bool ImageFile::read(Image& image)
+{
+    if(isNull())
+        return false;
+    if(image.size() != _size or image.format() != _format) {
+        qDebug() << "ImageFile::read: the image must have the size and format of" << _fileName;
+        return false;
+    }
+    if(!image.sync())
+        return false;
+
+    // Straight from the mapping to the device
+    if(_direct and !(image._hostBuffer and !image._hasDev())) {
+        const Event event= image._uploadFrom(_pixels, _rowBytes);
+        if(event.isNull())
+            return false;
+        QMutexLocker locker(&_lock);
+        _pending << event;
+        return true;
+    }
+
+    // Converted in one pass to the host buffer
+    if(!image._hostBuffer and !image._allocHost())
+        return false;
+    if(!image._waitHost())
+        return false;
+    convertRows(0, _size.height(), image._hostBuffer);
+    image._hostValid= true;
+    image._devValid= false;
+    return true;
+}
+
+Image* ImageFile::createImage(int devId)
+{
+    if(isNull())
+        return nullptr;
+    Image* image= new Image(_size.width(), _size.height(), _format, devId);
+
+    // Zero-copy images use their own mapping of the file as their storage
+    if(_direct and image->allocPolicy() == Image::AllocPolicy::ZeroCopy and !image->tiled()) {
+        size_t bytes;
+        void* mapping= mapFile(_fileName, &bytes);
+        if(mapping) {
+            char* pixels= static_cast<char*>(mapping) + (_pixels - static_cast<const char*>(_mapping));
+            if(bytes == _mappingBytes and image->_adoptMapping(mapping, bytes, pixels))
+                return image;
+            unmapFile(mapping, bytes);
+        }
+    }
+
+    if(!read(*image)) {
+        delete image;
+        return nullptr;
+    }
+    return image;
+}
+
+bool ImageFile::write(Image& image, QString fileName, Type type)
+{
+    const IFmt format= image.format();
+    const QSize size= image.size();
+    const int channels= iFmtChanCount(format);
+    const int sampleBytes= iFmtBPP(format) / 8 / channels;
+
+    // Header and layout of the file
+    QByteArray header;
+    int fileChannels= channels;
+    bool swap= false;
+    bool bottomUp= false;
+    switch(type) {
+        case Type::Raw:
+            for(const auto& name: formatNames) {
+                if(name.format == format)
+                    header= QString("%1\n%2 %3 %4\n").arg(rawMagic).arg(size.width()).arg(size.height())
+                            .arg(name.name).toLatin1();
+            }
+            header.append(QByteArray(rawHeaderBytes - header.size(), '\n'));
+            break;
+        case Type::PGM:
+        case Type::PPM:
+            if((type == Type::PGM and format != IFmt::LUMA and format != IFmt::LUMA16)
+               or (type == Type::PPM and format != IFmt::ARGB and format != IFmt::ARGB16))
+                break;
+            header= QString("%1\n%2 %3\n%4\n").arg(type == Type::PGM ? "P5" : "P6").arg(size.width())
+                    .arg(size.height()).arg(sampleBytes == 1 ? 255 : 65535).toLatin1();
+            fileChannels= type == Type::PGM ? 1 : 3;
+            swap= sampleBytes == 2 and littleEndianHost();
+            break;
+        case Type::PFM:
+            if(format != IFmt::LUMA32F and format != IFmt::ARGB32F)
+                break;
+            header= QString("%1\n%2 %3\n%4\n").arg(channels == 1 ? "Pf" : "PF").arg(size.width())
+                    .arg(size.height()).arg(littleEndianHost() ? "-1.0" : "1.0").toLatin1();
+            fileChannels= channels == 1 ? 1 : 3;
+            bottomUp= true;
+            break;
+    }
+    if(header.isEmpty()) {
+        qDebug() << "ImageFile::write: the file type does not support the image format.";
+        return false;
+    }
+
+    // Map the new file
+    const qint64 fileRowBytes= (qint64)size.width() * fileChannels * sampleBytes;
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadWrite | QIODevice::Truncate)
+       or !file.resize(header.size() + fileRowBytes * size.height())) {
+        qDebug() << "ImageFile::write: could not create" << fileName;
+        return false;
+    }
+    uchar* mapping= file.map(0, file.size());
+    if(!mapping) {
+        qDebug() << "ImageFile::write: could not map" << fileName;
+        return false;
+    }
+    memcpy(mapping, header.constData(), header.size());
+    char* pixels= reinterpret_cast<char*>(mapping) + header.size();
+
+    bool ok;
+    if(fileChannels == channels and !swap and !bottomUp) {
+        // Straight from the device to the mapping
+        ok= image._downloadTo(pixels, fileRowBytes);
+    } else {
+        // Converted in one pass from the host buffer
+        ok= image.sync();
+        if(ok and !image._hostValid and image._devValid)
+            image.downloadAsync();
+        ok= ok and image._hostValid and image._waitHost();
+        const size_t rowBytes= (size_t)size.width() * iFmtBPP(format) / 8;
+        for(int row=0; ok and row<size.height(); row++) {
+            const char* src= image._hostBuffer + row * rowBytes;
+            char* dst= pixels + (bottomUp ? size.height() - 1 - row : row) * fileRowBytes;
+            if(fileChannels == channels and !swap) {
+                memcpy(dst, src, rowBytes);
+            } else if(fileChannels == channels) {
+                for(size_t i=0; i<rowBytes; i+=sampleBytes)
+                    copySample(dst + i, src + i, sampleBytes, true);
+            } else if(format == IFmt::ARGB) {
+                const quint32* pixel= reinterpret_cast<const quint32*>(src);
+                for(int x=0; x<size.width(); x++, dst+=3) {
+                    dst[0]= qRed(pixel[x]);
+                    dst[1]= qGreen(pixel[x]);
+                    dst[2]= qBlue(pixel[x]);
+                }
+            } else {
+                // The alpha is dropped
+                for(int x=0; x<size.width(); x++, src+=4*sampleBytes, dst+=3*sampleBytes) {
+                    for(int c=0; c<3; c++)
+                        copySample(dst + c * sampleBytes, src + c * sampleBytes, sampleBytes, swap);
+                }
+            }
+        }
+        if(!ok)
+            qDebug() << "ImageFile::write: the image has no valid data.";
+    }
+    file.unmap(mapping);
+    return ok;
+}
+
+} // namespace QCLI
@@ -0,0 +1,139 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_IMAGEFILE_H
+#define _QCLI_IMAGEFILE_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+#include "rowstream.h"
+#include "opencl/event.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Memory mapped image file, without decoding through QImage
+ *
+ *  The file is mapped copy-on-write, and its pixels go straight from the
+ *  mapping to the device when their layout is the one of the image format:
+ *
+ *      ImageFile file("dump.qraw");
+ *      Image* image= file.createImage(); // Uploaded from the mapping
+ *      ...
+ *      ImageFile::write(*image, "result.pgm", ImageFile::Type::PGM);
+ *
+ *  Supported files and the formats they load as:
+ *    - Raw: QCLI raw file, any IFmt in the host layout after a 4096 byte header.
+ *      With the ZeroCopy policy the mapping is the storage of the device image.
+ *    - PGM (P5): LUMA, or LUMA16 for a maxval above 255 (the values are not scaled)
+ *    - PPM (P6): ARGB, or ARGB16 for a maxval above 255, with an opaque alpha
+ *    - PFM (Pf, PF): LUMA32F or ARGB32F with an opaque alpha
+ *  16-bit PNM, PFM written on a host of another endianness, and PPM files need a
+ *  conversion: it is done in one pass from the mapping to the image host buffer.
+ *
+ *  Images that only live in the host are copied to their host buffer instead.
+ *
+ *  All functions are thread-safe, reading an image that is used by another
+ *  thread is not (Image is not thread-safe).
+ */
+
+class ImageFile : public RowSource
+{
+public:
+    /// File type
+    enum class Type
+    {
+        Raw,
+        PGM,
+        PPM,
+        PFM
+    };
+
+    /// Maps a file and parses its header
+    ImageFile(QString fileName);
+    /// Waits for the pending uploads from the mapping, and unmaps it
+    ~ImageFile();
+
+    /// Returns true if the file could not be mapped or has an invalid header
+    bool isNull() const { return !_mapping; }
+    /// Returns the type of the file
+    Type type() const { return _type; }
+    /// Returns the size of the image
+    QSize size() const { return _size; }
+    /// Returns the format of the images the file loads as
+    IFmt format() const { return _format; }
+    /// Returns true if the pixels are stored in the layout of format()
+    bool direct() const { return _direct; }
+
+    /// Loads the pixels into an image of the same size and format()
+    /// The image is uploaded from the mapping without blocking, unless it only lives
+    /// in the host, the destructor waits for the upload
+    /// @retval false on error
+    bool read(Image& image);
+    /// Returns a new image with the pixels of the file, owned by the caller
+    /// @retval nullptr on error
+    Image* createImage(int devId= 0);
+
+    /// Reads count rows starting at row y in the format() layout (see RowSource)
+    bool readRows(int y, int count, void* data);
+
+    /// Writes an image in a new file
+    /// The data is downloaded straight to the mapping of the new file when the file
+    /// layout is the one of the image format
+    /// @param type PGM for LUMA and LUMA16, PPM for ARGB and ARGB16, PFM for LUMA32F and
+    /// ARGB32F, Raw for any format
+    /// @retval false on error or if the type does not support the image format
+    static bool write(Image& image, QString fileName, Type type= Type::Raw);
+
+    /// Bytes of the header of the raw files, the pixels stay page aligned
+    static const int rawHeaderBytes= 4096;
+
+    /// Disable copying
+    ImageFile(const ImageFile& other) = delete;
+    /// Disable assignments
+    ImageFile& operator=(const ImageFile& other) = delete;
+
+private:
+    /// Parses the header, sets the size, the format and the position of the pixels
+    /// @retval false if it is invalid
+    bool parseHeader();
+    /// Converts rows from the file layout to the format() layout
+    void convertRows(int y, int count, char* data) const;
+
+    // State
+    mutable QMutex _lock; // Protects the pending uploads
+    QString _fileName;
+    void* _mapping= nullptr;
+    size_t _mappingBytes= 0;
+
+    // Image description
+    Type _type= Type::Raw;
+    QSize _size;
+    IFmt _format= IFmt::ARGB;
+    bool _direct= false;       // Pixels stored in the layout of _format
+    const char* _pixels= nullptr;
+    qint64 _rowBytes= 0;       // Bytes of the rows in the file
+    bool _swap= false;         // Samples of the other endianness
+    bool _bottomUp= false;     // Rows stored from the bottom (PFM)
+    int _fileChannels= 1;      // Channels stored in the file
+
+    /// Uploads reading the mapping
+    QVector<Event> _pending;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_IMAGEFILE_H
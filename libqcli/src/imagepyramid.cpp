@@ -0,0 +1,257 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "imagepyramid.h"
+
+#include <cassert>
+#include "image.h"
+#include "opencl/kernel.h"
+#include "opencl/kernelcache.h"
+
+namespace QCLI {
+
+// Work groups of the Gaussian kernel, each one builds a deepestTile x deepestTile
+// tile of the last level of the launch and the tiles above it
+static const int groupWidth= 16;
+static const int deepestTile= 8;
+// Local memory of the intermediate levels of a work group, half of the minimum
+// guaranteed by OpenCL so two work groups fit on a compute unit
+static const int localBudget= 16 * 1024;
+
+// Size of the tile of a level computed by a work group of a launch building
+// levels 1 to levels, with the apron read by the next level
+static int storedTile(int level, int levels)
+{
+    return level == levels ? deepestTile : 2 * storedTile(level + 1, levels) + 2;
+}
+
+// Size of the tile of a level written by a work group
+static int innerTile(int level, int levels)
+{
+    return deepestTile << (levels - level);
+}
+
+// Local memory used by a work group of a launch building levels
+static int localBytes(int levels, IFmt format)
+{
+    const int pixelBytes= iFmtChanCount(format) == 1 ? sizeof(float) : 4 * sizeof(float);
+    int bytes= 0;
+    for(int level= 1; level < levels; level++)
+        bytes+= storedTile(level, levels) * storedTile(level, levels) * pixelBytes;
+    return bytes;
+}
+
+// Kernel building levels 1 to levels from src
+// Pixel j of a level is the [1 3 3 1] / 8 filter of the pixels 2j - 1 to 2j + 2 of
+// the level above. The tile of a level starts 2 * apron + 1 pixels before the tile
+// it is computed from, so pixel u of the tile reads the pixels 2u to 2u + 3 of the
+// tile above in local memory.
+static QString gaussianSource(IFmt format, int levels)
+{
+    QString source= KernelCache::pixelHeader(iFmtChanCount(format))
+                    + QString("#define GROUP_WIDTH %1\n").arg(groupWidth)
+                    + "__constant float weights[4]= { 0.125f, 0.375f, 0.375f, 0.125f };\n"
+                      "__kernel __attribute__((reqd_work_group_size(GROUP_WIDTH, GROUP_WIDTH, 1)))\n"
+                    + QString("void qcli_pyramid_%1(__read_only image2d_t src").arg(levels);
+    for(int level= 1; level <= levels; level++)
+        source+= QString(", __write_only image2d_t dst%1").arg(level);
+    source+= ")\n"
+              "{\n"
+              "    const int id= get_local_id(1) * GROUP_WIDTH + get_local_id(0);\n"
+              "    const int2 group= (int2)(get_group_id(0), get_group_id(1));\n";
+    for(int level= 1; level < levels; level++) {
+        const int tile= storedTile(level, levels);
+        source+= QString("    __local PIXEL level%1[%2];\n").arg(level).arg(tile * tile);
+    }
+
+    for(int level= 1; level <= levels; level++) {
+        const int tile= storedTile(level, levels);
+        const int inner= innerTile(level, levels);
+        const int apron= (tile - inner) / 2;
+        const QString read= level == 1
+                            ? QString("LOAD(src, 2 * (origin + c) - 1 + (int2)(dx, dy))")
+                            : QString("level%1[(2 * c.y + dy) * %2 + 2 * c.x + dx]")
+                              .arg(level - 1).arg(storedTile(level - 1, levels));
+        source+= QString("    // Level %1, the work group owns %2x%2 pixels of a %3x%3 tile\n"
+                         "    {\n"
+                         "        const int2 origin= group * %2 - %4;\n"
+                         "        const int2 size= (int2)(get_image_width(dst%1), get_image_height(dst%1));\n"
+                         "        for(int p= id; p < %3 * %3; p+= GROUP_WIDTH * GROUP_WIDTH) {\n"
+                         "            const int2 at= (int2)(p % %3, p / %3);\n"
+                         "            const int2 pos= origin + at;\n"
+                         "            // The pixels outside the level repeat its edge, like the sampler\n"
+                         "            const int2 c= clamp(pos, (int2)(0), size - 1) - origin;\n"
+                         "            PIXEL sum= 0.0f;\n"
+                         "            for(int dy= 0; dy < 4; dy++)\n"
+                         "                for(int dx= 0; dx < 4; dx++)\n"
+                         "                    sum+= weights[dx] * weights[dy] * %5;\n")
+                  .arg(level).arg(inner).arg(tile).arg(apron).arg(read);
+        if(level < levels)
+            source+= QString("            level%1[p]= sum;\n").arg(level);
+        source+= QString("            if(all(at >= %1) && all(at < %2) && all(pos < size))\n"
+                         "                STORE(dst%3, pos, sum);\n"
+                         "        }\n").arg(apron).arg(apron + inner).arg(level);
+        if(level < levels)
+            source+= "        barrier(CLK_LOCAL_MEM_FENCE);\n";
+        source+= "    }\n";
+    }
+    return source + "}\n";
+}
+
+// Kernel computing a Laplacian level from a Gaussian level and the next one
+// The pixels of the coarse level are centered between two fine pixels, so the
+// bilinear expansion weighs the nearest one 3/4 and the other one 1/4
+static QString laplacianSource(IFmt format)
+{
+    return KernelCache::pixelHeader(iFmtChanCount(format))
+           + "__kernel void qcli_laplacian(__read_only image2d_t fine, __read_only image2d_t coarse,"
+             " __write_only image2d_t dst)\n"
+             "{\n"
+             "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+             "    if(pos.x >= get_image_width(dst) || pos.y >= get_image_height(dst))\n"
+             "        return;\n"
+             "    const int2 m= pos / 2;\n"
+             "    const int2 n= m + select((int2)(-1), (int2)(1), (pos & 1) == 1);\n"
+             "    const PIXEL expanded= 0.5625f * LOAD(coarse, m)\n"
+             "                          + 0.1875f * (LOAD(coarse, (int2)(n.x, m.y)) + LOAD(coarse, (int2)(m.x, n.y)))\n"
+             "                          + 0.0625f * LOAD(coarse, n);\n"
+             "    STORE(dst, pos, LOAD(fine, pos) - expanded);\n"
+             "}\n";
+}
+
+// Returns the kernel of a source from the cache
+// @param blockDim fixed work group size, {0, 0} for the tuned one
+// @retval nullptr if the kernel could not be compiled
+static Kernel* cachedKernel(const QString& source, BlockDim blockDim)
+{
+    return kernelCache().kernel("ImagePyramid", source, blockDim);
+}
+
+//
+// Construction
+//
+
+ImagePyramid::ImagePyramid(QSize size, int levelCount, IFmt format, Type type, int devId)
+    : _size(size), _levelCount(levelCount), _format(format), _type(type), _devId(devId)
+{
+    assert(levelCount >= 1 and levelCount <= maxLevels(size));
+    // The device images are taken from the pool by the first build
+    for(int level= 1; level < _levelCount; level++)
+        _gaussian.append(new Image(levelSize(level), _format, _devId, false));
+    if(_type == Type::Laplacian) {
+        // The Laplacian values may be negative
+        const IFmt laplacian= KernelCache::floatFormat(_format, _devId);
+        for(int level= 0; level < _levelCount - 1; level++)
+            _laplacian.append(new Image(levelSize(level), laplacian, _devId, false));
+    }
+}
+
+ImagePyramid::~ImagePyramid()
+{
+    qDeleteAll(_gaussian);
+    qDeleteAll(_laplacian);
+}
+
+int ImagePyramid::maxLevels(QSize size)
+{
+    int levels= 1;
+    while(size.width() > 1 or size.height() > 1) {
+        size= QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+        levels++;
+    }
+    return levels;
+}
+
+int ImagePyramid::levelsPerLaunch(IFmt format)
+{
+    int levels= 1;
+    while(localBytes(levels + 1, format) <= localBudget)
+        levels++;
+    return levels;
+}
+
+//
+// Levels
+//
+
+Image& ImagePyramid::level(int level)
+{
+    assert(level >= 0 and level < _levelCount);
+    if(_type == Type::Laplacian and level < _levelCount - 1)
+        return *_laplacian[level];
+    assert(level > 0 or _base);
+    return level == 0 ? *_base : *_gaussian[level - 1];
+}
+
+QSize ImagePyramid::levelSize(int level) const
+{
+    QSize size= _size;
+    for(int i= 0; i < level; i++)
+        size= QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+    return size;
+}
+
+bool ImagePyramid::build(Image& base)
+{
+    if(base.size() != _size or base.format() != _format or base.devId() != _devId) {
+        qDebug() << "ImagePyramid::build: the image must have the size, format and device of the pyramid.";
+        return false;
+    }
+    if(base.tiled()) {
+        qDebug() << "ImagePyramid: tiled images are not supported.";
+        return false;
+    }
+    _base= &base;
+    return buildGaussian(base) and (_type == Type::Gaussian or buildLaplacian(base));
+}
+
+bool ImagePyramid::buildGaussian(Image& base)
+{
+    const int perLaunch= levelsPerLaunch(_format);
+    const Image* src= &base;
+    for(int first= 1; first < _levelCount; first+= perLaunch) {
+        const int levels= qMin(perLaunch, _levelCount - first);
+        Kernel* kernel= cachedKernel(gaussianSource(_format, levels), BlockDim {{ groupWidth, groupWidth }});
+        if(!kernel)
+            return false;
+
+        // One work group per tile of the last level of the launch
+        const QSize last= levelSize(first + levels - 1);
+        const QSize range((last.width() + deepestTile - 1) / deepestTile * groupWidth,
+                          (last.height() + deepestTile - 1) / deepestTile * groupWidth);
+        bool ok= kernel->setArg(0, *src);
+        for(int i= 0; i < levels; i++)
+            ok= ok and kernel->setArg(1 + i, *_gaussian[first + i - 1]);
+        if(!ok or !kernel->setRange(range) or !(*kernel)())
+            return false;
+        src= _gaussian[first + levels - 2];
+    }
+    return true;
+}
+
+bool ImagePyramid::buildLaplacian(Image& base)
+{
+    Kernel* kernel= cachedKernel(laplacianSource(_format), BlockDim {{ 0, 0 }});
+    if(!kernel)
+        return false;
+    for(int level= 0; level < _levelCount - 1; level++) {
+        const Image& fine= level == 0 ? base : *_gaussian[level - 1];
+        const Image& coarse= *_gaussian[level];
+        if(!(*kernel)(fine, coarse, *_laplacian[level]))
+            return false;
+    }
+    return true;
+}
+
+} // namespace QCLI
@@ -0,0 +1,109 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_IMAGEPYRAMID_H
+#define _QCLI_IMAGEPYRAMID_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Gaussian or Laplacian pyramid of an image, built on the device
+ *
+ *  Each level is half the size of the previous one (rounded up), filtered with
+ *  the binomial [1 3 3 1] / 8 in both directions. The levels are built for every
+ *  frame into the same images, which stay on the device until read:
+ *
+ *      ImagePyramid pyramid(frameSize, 5);
+ *      pyramid.build(frame);
+ *      detect(pyramid.level(2).toQImage()); // Only level 2 is downloaded
+ *
+ *  A single launch builds several levels (levelsPerLaunch()): each work group
+ *  stages the tiles of the intermediate levels in local memory, with the apron
+ *  the next level reads, and writes the pixels it owns in every level.
+ *
+ *  Level 0 of a Gaussian pyramid is the image passed to build(), which must stay
+ *  alive while the level is used. The Laplacian levels are the difference between
+ *  a Gaussian level and the bilinear expansion of the next one, the last level
+ *  is the last Gaussian level. They are stored in float images when the device
+ *  supports them, each one takes another launch.
+ *
+ *  The levels are images of the pool (see ImagePool). Tiled images are not supported.
+ *
+ *  This class is *not* thread-safe, like Image.
+ */
+
+class ImagePyramid
+{
+public:
+    /// Type of pyramid
+    enum class Type
+    {
+        Gaussian,
+        Laplacian
+    };
+
+    /// Creates the levels of the pyramids of images of a size and format
+    /// @param levelCount number of levels including the base, at most maxLevels(size)
+    ImagePyramid(QSize size, int levelCount, IFmt format= IFmt::ARGB, Type type= Type::Gaussian, int devId= 0);
+    ~ImagePyramid();
+
+    /// Returns the number of levels down to a 1x1 level
+    static int maxLevels(QSize size);
+    /// Returns the number of Gaussian levels built by each launch, as many as the
+    /// tiles of the format fit in local memory
+    static int levelsPerLaunch(IFmt format);
+
+    /// Builds the levels of an image of the size and format of the pyramid
+    /// @retval false on error
+    bool build(Image& base);
+
+    /// Returns a level, 0 being the base
+    Image& level(int level);
+    /// Returns the size of a level
+    QSize levelSize(int level) const;
+    /// Returns the number of levels
+    int levelCount() const { return _levelCount; }
+    Type type() const { return _type; }
+    IFmt format() const { return _format; }
+
+    /// Disable copying
+    ImagePyramid(const ImagePyramid& other) = delete;
+    /// Disable assignments
+    ImagePyramid& operator=(const ImagePyramid& other) = delete;
+
+private:
+    /// Builds the Gaussian levels
+    bool buildGaussian(Image& base);
+    /// Builds the Laplacian levels from the Gaussian ones
+    bool buildLaplacian(Image& base);
+
+    QSize _size;
+    int _levelCount;
+    IFmt _format;
+    Type _type;
+    int _devId;
+
+    Image* _base= nullptr;       // Level 0 of the Gaussian levels, set by build()
+    QVector<Image*> _gaussian;   // Gaussian levels 1 to levelCount - 1
+    QVector<Image*> _laplacian;  // Laplacian levels 0 to levelCount - 2
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_IMAGEPYRAMID_H
@@ -41,6 +41,7 @@ Context::~Context()
     }
     */
     clReleaseContext(_context);
+    delete _snapshot.fetchAndStoreOrdered(nullptr);
 }
 
 
@@ -55,6 +56,7 @@ bool Context::init(cl_device_type devType, bool glInterop)
     // Now we must create the device queues and pass them to the DeviceManager
     if(!createQueues())
         return false;
+    publish();
     _initialized= true;
     return true;
 }
@@ -70,6 +72,7 @@ bool Context::init(QList<int> devIds, bool glInterop)
     // Now we must create the device queues and pass them to the DeviceManager
     if(!createQueues())
         return false;
+    publish();
     _initialized= true;
     return true;
 }
@@ -132,6 +135,20 @@ bool Context::createContext(bool glInterop)
     return true;
 }
 
+// Releases the queues created for the devices, the roles may share a queue
+static void releaseQueues(const QVector<QVector<cl_command_queue>>& queues)
+{
+    QSet<cl_command_queue> released;
+    foreach(const QVector<cl_command_queue>& devQueues, queues) {
+        foreach(const cl_command_queue queue, devQueues) {
+            if(queue and !released.contains(queue)) {
+                clReleaseCommandQueue(queue);
+                released << queue;
+            }
+        }
+    }
+}
+
 bool Context::createQueues()
 {
     // Get selected devices from the dev manager
@@ -140,41 +157,121 @@ bool Context::createQueues()
     if(!devCount)
         return false;
 
-    QVector<cl_command_queue> queues(devCount);
+    QMutexLocker locker(&_lock);
+    QVector<QVector<cl_command_queue>> queues(devCount);
+    QVector<bool> outOfOrder(devCount, false);
     cl_int err;
     for(int i=0; i<devCount; i++) {
-        queues[i]= clCreateCommandQueue(_context, devs[i], CL_QUEUE_PROFILING_ENABLE, &err);
-        if(checkCLError(err, "clCreateCommandQueue"))
+        const QueueConfig config= _devQueueConfigs.value(i, _queueConfig);
+
+        cl_command_queue_properties props= CL_QUEUE_PROFILING_ENABLE;
+        if(config.outOfOrder) {
+            cl_command_queue_properties supported;
+            err= clGetDeviceInfo(devs[i], CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, nullptr);
+            if(!checkCLError(err, "clGetDeviceInfo") and (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+                props|= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+                outOfOrder[i]= true;
+            } else {
+                qDebug() << "Context: device" << i << "has no out-of-order queues, using an in-order one.";
+            }
+        }
+        const cl_command_queue compute= clCreateCommandQueue(_context, devs[i], props, &err);
+        if(checkCLError(err, "clCreateCommandQueue")) {
+            releaseQueues(queues);
             return false;
+        }
+        queues[i] << compute << compute << compute;
+
+        // The transfers stay in order, each one only depends on its image
+        if(config.topology == QueueTopology::Dedicated) {
+            for(int role=(int)QueueRole::Upload; role<=(int)QueueRole::Download; role++) {
+                queues[i][role]= clCreateCommandQueue(_context, devs[i], CL_QUEUE_PROFILING_ENABLE, &err);
+                if(checkCLError(err, "clCreateCommandQueue")) {
+                    queues[i][role]= compute;
+                    releaseQueues(queues);
+                    return false;
+                }
+            }
+        }
     }
     // Pass the queues to the DeviceManager
-    devMgr().setQueues(queues);
+    devMgr().setQueues(queues, outOfOrder);
 
     return true;
 }
 
-bool Context::glInterop()
+bool Context::setQueueTopology(QueueTopology topology, bool outOfOrder, int devId)
 {
-    if(!_initialized and !init())
+    if(_initialized)
         return false;
-    QMutexLocker l(&_lock);
-    return _glInterop;
+    QMutexLocker locker(&_lock);
+    const QueueConfig config { topology, outOfOrder };
+    if(devId < 0) {
+        _queueConfig= config;
+        _devQueueConfigs.clear();
+    } else {
+        _devQueueConfigs[devId]= config;
+    }
+    return true;
 }
 
-cl_context Context::context()
+void Context::publish()
 {
-    if(!_initialized and !init())
-        return nullptr;
+    // Every format the library uses, indexed by iFmtType()
+    static const IFmt formats[]= { IFmt::ARGB, IFmt::ARGB16, IFmt::ARGB16F, IFmt::ARGB32F,
+                                   IFmt::LUMA, IFmt::LUMA16, IFmt::LUMA16F, IFmt::LUMA32F };
+
     QMutexLocker locker(&_lock);
-    return _context;
+    Snapshot* snapshot= new Snapshot;
+    snapshot->context= _context;
+    snapshot->glInterop= _glInterop;
+    snapshot->imgFormats= _imgFormats;
+
+    // clGetSupportedImageFormats lists the formats of the context, the devices
+    // without image support have none
+    quint32 contextMask= 0;
+    for(const IFmt format: formats) {
+        const cl_image_format clFormat= toCLFormat(format);
+        foreach(const cl_image_format& fmt, _imgFormats) {
+            if(clFormat.image_channel_data_type==fmt.image_channel_data_type and
+               clFormat.image_channel_order==fmt.image_channel_order) {
+                contextMask|= 1u << iFmtType(format);
+                break;
+            }
+        }
+    }
+    foreach(const cl_device_id& device, devMgr().devices())
+        snapshot->fmtMasks << (clDeviceInfo<cl_bool>(device, CL_DEVICE_IMAGE_SUPPORT) ? contextMask : 0);
+
+    _snapshot.fetchAndStoreRelease(snapshot);
+}
+
+const Context::Snapshot* Context::snapshot()
+{
+    const Snapshot* s= _snapshot;
+    if(!s and init())
+        s= _snapshot;
+    return s;
+}
+
+bool Context::glInterop()
+{
+    const Snapshot* s= snapshot();
+    return s and s->glInterop;
+}
+
+cl_context Context::context()
+{
+    const Snapshot* s= snapshot();
+    return s ? s->context : nullptr;
 }
 
 bool Context::supportedFormat(const cl_image_format& format)
 {
-    if(!_initialized and !init())
+    const Snapshot* s= snapshot();
+    if(!s)
         return false;
-    QMutexLocker locker(&_lock);
-    foreach(const cl_image_format& fmt, _imgFormats) {
+    foreach(const cl_image_format& fmt, s->imgFormats) {
         if(format.image_channel_data_type==fmt.image_channel_data_type and
            format.image_channel_order==fmt.image_channel_order) {
             return true;
@@ -183,4 +280,10 @@ bool Context::supportedFormat(const cl_image_format& format)
     return false;
 }
 
+bool Context::supportedFormat(IFmt format, int devId)
+{
+    const Snapshot* s= snapshot();
+    return s and devId>=0 and devId<s->fmtMasks.count() and (s->fmtMasks[devId] & (1u << iFmtType(format)));
+}
+
 } // namespace QCLI
@@ -20,13 +20,17 @@
 // CL-GL interop
 #include <CL/cl_gl.h>
 
+#include "devicemanager.h"
+#include "ifmt.h"
+
 namespace QCLI {
 
 /** \brief OpenCL context singleton
  *
  *  All functions are thread-safe.
  *  Calling any functions other than instance(), init() and initialized()
- *  initializes the context if not initialized before.
+ *  initializes the context if not initialized before. Once initialized the
+ *  getters read an immutable snapshot of the context without locking.
 */
 
 class Context
@@ -51,6 +55,15 @@ public:
     /// @retval false on error or if already initialized
     bool init(QList<int> devIds, bool glInterop= true);
 
+    /// Sets the command queues created for a device by init()
+    /// With QueueTopology::Dedicated the uploads and downloads get their own queues, so
+    /// they overlap the kernels. An out-of-order compute queue lets independent kernels
+    /// run concurrently, it is ignored if the device does not support it.
+    /// The commands always wait for the previous ones using the same images.
+    /// @param devId index of a selected device, -1 for all of them
+    /// @retval false if already initialized
+    bool setQueueTopology(QueueTopology topology, bool outOfOrder= false, int devId= -1);
+
     /// Returns true if the context was initialized
     bool initialized() const { return _initialized; }
     /// Returns true if the context was initialized with OpenGL support
@@ -58,8 +71,10 @@ public:
 
     /// Returns true if the context supports images of format format
     bool supportedFormat(const cl_image_format& format);
+    /// Returns true if a selected device supports images of format format
+    bool supportedFormat(IFmt format, int devId);
 
-    /// Returns the OpenCL context#include <GL/glx.h>
+    /// Returns the OpenCL context
     cl_context context();
 
     /// Disable copying
@@ -72,6 +87,26 @@ private:
     Context() = default;
     bool createContext(bool glInterop);
     bool createQueues();
+    /// Publishes the snapshot read by the getters, once initialized
+    void publish();
+
+    /// Immutable state of the initialized context
+    struct Snapshot {
+        cl_context context;
+        bool glInterop;
+        QVector<cl_image_format> imgFormats;
+        /// Supported formats of each device, bit iFmtType() of each IFmt
+        QVector<quint32> fmtMasks;
+    };
+    /// Returns the snapshot, initializing the context if needed
+    /// @retval nullptr if the context could not be initialized
+    const Snapshot* snapshot();
+
+    /// Queues requested for a device
+    struct QueueConfig {
+        QueueTopology topology;
+        bool outOfOrder;
+    };
 
     // State
     mutable QMutex _lock; // Mutable so it can be used in const getters
@@ -83,6 +118,14 @@ private:
 
     // Supported image formats
     QVector<cl_image_format> _imgFormats;
+
+    // Queues of the devices without their own configuration
+    QueueConfig _queueConfig { QueueTopology::Single, false };
+    // Queues of each device index
+    QHash<int, QueueConfig> _devQueueConfigs;
+
+    // Published by init(), nullptr until then
+    QAtomicPointer<const Snapshot> _snapshot;
 };
 
 /// Global function to access the Context instance
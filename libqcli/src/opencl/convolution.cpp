@@ -0,0 +1,328 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "convolution.h"
+
+#include <cassert>
+#include <cmath>
+#include "opencl/imagepool.h"
+#include "opencl/kernel.h"
+#include "opencl/kernelcache.h"
+#include "util/utils.h"
+
+namespace QCLI {
+
+// Work groups of the separable passes, the row pass loads wide tiles and the
+// column pass tall ones so the apron is a small part of the loads
+static const int rowTileWidth= 32;
+static const int rowTileHeight= 8;
+static const int columnTileWidth= 16;
+static const int columnTileHeight= 16;
+// Lines filtered by each work group of the recursive passes
+static const int recursiveGroupSize= 64;
+
+// Constant array of weights, indexed from 0 to 2 * radius
+static QString weightsArray(QString name, const QVector<float>& weights)
+{
+    QStringList values;
+    foreach(const float weight, weights)
+        values << QString::number(weight, 'e', 8) + "f";
+    return QString("__constant float %1[%2]= { %3 };\n").arg(name).arg(weights.count()).arg(values.join(", "));
+}
+
+static QString directSource(IFmt format, const QVector<float>& rowWeights, const QVector<float>& columnWeights)
+{
+    return KernelCache::pixelHeader(iFmtChanCount(format))
+           + QString("#define ROW_RADIUS %1\n#define COLUMN_RADIUS %2\n")
+             .arg(rowWeights.count() / 2).arg(columnWeights.count() / 2)
+           + weightsArray("rowWeights", rowWeights) + weightsArray("columnWeights", columnWeights)
+           + "__kernel void qcli_convolve(__read_only image2d_t src, __write_only image2d_t dst)\n"
+             "{\n"
+             "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+             "    if(pos.x >= get_image_width(dst) || pos.y >= get_image_height(dst))\n"
+             "        return;\n"
+             "    PIXEL sum= 0.0f;\n"
+             "    for(int dy= -COLUMN_RADIUS; dy <= COLUMN_RADIUS; dy++) {\n"
+             "        PIXEL row= 0.0f;\n"
+             "        for(int dx= -ROW_RADIUS; dx <= ROW_RADIUS; dx++)\n"
+             "            row+= rowWeights[dx + ROW_RADIUS] * LOAD(src, pos + (int2)(dx, dy));\n"
+             "        sum+= columnWeights[dy + COLUMN_RADIUS] * row;\n"
+             "    }\n"
+             "    STORE(dst, pos, sum);\n"
+             "}\n";
+}
+
+// Pass of a separable convolution, each work group stages its tile and the apron in local memory
+static QString separableSource(IFmt format, const QVector<float>& weights, bool rows)
+{
+    const int tileWidth= rows ? rowTileWidth : columnTileWidth;
+    const int tileHeight= rows ? rowTileHeight : columnTileHeight;
+    QString source= KernelCache::pixelHeader(iFmtChanCount(format))
+                    + QString("#define RADIUS %1\n#define TILE_WIDTH %2\n#define TILE_HEIGHT %3\n")
+                      .arg(weights.count() / 2).arg(tileWidth).arg(tileHeight)
+                    + weightsArray("weights", weights)
+                    + "__kernel __attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))\n";
+    if(rows) {
+        source+= "void qcli_convolve_rows(__read_only image2d_t src, __write_only image2d_t dst)\n"
+                 "{\n"
+                 "    __local PIXEL tile[TILE_HEIGHT][TILE_WIDTH + 2 * RADIUS];\n"
+                 "    const int lx= get_local_id(0);\n"
+                 "    const int ly= get_local_id(1);\n"
+                 "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+                 "    // Consecutive work items load consecutive pixels of the row and of its apron\n"
+                 "    const int left= get_group_id(0) * TILE_WIDTH - RADIUS;\n"
+                 "    for(int i= lx; i < TILE_WIDTH + 2 * RADIUS; i+= TILE_WIDTH)\n"
+                 "        tile[ly][i]= LOAD(src, (int2)(left + i, pos.y));\n"
+                 "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                 "    if(pos.x >= get_image_width(dst) || pos.y >= get_image_height(dst))\n"
+                 "        return;\n"
+                 "    PIXEL sum= 0.0f;\n"
+                 "    for(int k= 0; k <= 2 * RADIUS; k++)\n"
+                 "        sum+= weights[k] * tile[ly][lx + k];\n"
+                 "    STORE(dst, pos, sum);\n"
+                 "}\n";
+    } else {
+        source+= "void qcli_convolve_columns(__read_only image2d_t src, __write_only image2d_t dst)\n"
+                 "{\n"
+                 "    __local PIXEL tile[TILE_HEIGHT + 2 * RADIUS][TILE_WIDTH];\n"
+                 "    const int lx= get_local_id(0);\n"
+                 "    const int ly= get_local_id(1);\n"
+                 "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+                 "    // Each row of the work group loads a row of the tile or of its apron\n"
+                 "    const int top= get_group_id(1) * TILE_HEIGHT - RADIUS;\n"
+                 "    for(int i= ly; i < TILE_HEIGHT + 2 * RADIUS; i+= TILE_HEIGHT)\n"
+                 "        tile[i][lx]= LOAD(src, (int2)(pos.x, top + i));\n"
+                 "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                 "    if(pos.x >= get_image_width(dst) || pos.y >= get_image_height(dst))\n"
+                 "        return;\n"
+                 "    PIXEL sum= 0.0f;\n"
+                 "    for(int k= 0; k <= 2 * RADIUS; k++)\n"
+                 "        sum+= weights[k] * tile[ly + k][lx];\n"
+                 "    STORE(dst, pos, sum);\n"
+                 "}\n";
+    }
+    return source;
+}
+
+// Pass of a recursive Gaussian (I. T. Young, L. J. van Vliet, "Recursive implementation
+// of the Gaussian filter", Signal Processing 44, 1995), one work item per line
+static QString recursiveSource(IFmt format, float sigma, bool rows)
+{
+    const double q= sigma >= 2.5f ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    const double b0= 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    const double b1= 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    const double b2= -(1.4281 * q * q + 1.26661 * q * q * q);
+    const double b3= 0.422205 * q * q * q;
+    const double b= 1.0 - (b1 + b2 + b3) / b0;
+
+    // The lines are stored interleaved in the scratch buffer, so the work items
+    // of a group access consecutive elements
+    return KernelCache::pixelHeader(iFmtChanCount(format))
+           + QString("#define B %1f\n#define B1 %2f\n#define B2 %3f\n#define B3 %4f\n")
+             .arg(b, 0, 'e', 8).arg(b1 / b0, 0, 'e', 8).arg(b2 / b0, 0, 'e', 8).arg(b3 / b0, 0, 'e', 8)
+           + (rows ? "#define POS(line, i) (int2)(i, line)\n" : "#define POS(line, i) (int2)(line, i)\n")
+           + QString("__kernel void qcli_recursive_%1(__read_only image2d_t src, __global PIXEL* scratch,"
+                     " __write_only image2d_t dst)\n").arg(rows ? "rows" : "columns")
+           + QString("{\n"
+                     "    const int line= get_global_id(0);\n"
+                     "    const int lines= get_image_%1(dst);\n"
+                     "    const int length= get_image_%2(dst);\n").arg(rows ? "height" : "width")
+                                                              .arg(rows ? "width" : "height")
+           + "    if(line >= lines)\n"
+             "        return;\n"
+             "    // Causal pass, the pixels before the line repeat the first one\n"
+             "    PIXEL w1= LOAD(src, POS(line, 0));\n"
+             "    PIXEL w2= w1;\n"
+             "    PIXEL w3= w1;\n"
+             "    for(int i= 0; i < length; i++) {\n"
+             "        const PIXEL w0= B * LOAD(src, POS(line, i)) + (B1 * w1 + B2 * w2 + B3 * w3);\n"
+             "        scratch[(size_t)i * lines + line]= w0;\n"
+             "        w3= w2;\n"
+             "        w2= w1;\n"
+             "        w1= w0;\n"
+             "    }\n"
+             "    // Anti-causal pass, the pixels after the line repeat the last one\n"
+             "    PIXEL y1= w1;\n"
+             "    PIXEL y2= y1;\n"
+             "    PIXEL y3= y1;\n"
+             "    for(int i= length - 1; i >= 0; i--) {\n"
+             "        const PIXEL y0= B * scratch[(size_t)i * lines + line] + (B1 * y1 + B2 * y2 + B3 * y3);\n"
+             "        STORE(dst, POS(line, i), y0);\n"
+             "        y3= y2;\n"
+             "        y2= y1;\n"
+             "        y1= y0;\n"
+             "    }\n"
+             "}\n";
+}
+
+// Returns the kernel of a source from the cache
+// @param blockDim fixed work group size, {0, 0} for the tuned one
+// @retval nullptr if the kernel could not be compiled
+static Kernel* cachedKernel(const QString& source, BlockDim blockDim, int halo)
+{
+    return kernelCache().kernel("Convolution", source, blockDim, halo);
+}
+
+//
+// Construction
+//
+
+Convolution::Convolution(QVector<float> weights, Method method)
+    : Convolution(weights, weights, method)
+{
+}
+
+Convolution::Convolution(QVector<float> rowWeights, QVector<float> columnWeights, Method method)
+    : _rowWeights(rowWeights), _columnWeights(columnWeights), _method(method)
+{
+    assert(rowWeights.count() % 2 and columnWeights.count() % 2);
+    if(_method == Method::Auto) {
+        // A 5x5 single pass reads less than two passes through an intermediate image
+        const int radius= qMax(rowWeights.count(), columnWeights.count()) / 2;
+        _method= radius <= 2 ? Method::Direct : radius <= maxSeparableRadius ? Method::Separable : Method::Direct;
+    }
+}
+
+Convolution Convolution::gaussian(float sigma, Method method)
+{
+    assert(sigma > 0.0f);
+    if(method == Method::Auto)
+        method= gaussianMethod(sigma);
+    const QVector<float> weights= gaussianWeights(sigma, gaussianRadius(sigma));
+    Convolution ret(weights, method);
+    ret._sigma= sigma;
+    return ret;
+}
+
+Convolution::Method Convolution::gaussianMethod(float sigma)
+{
+    const int radius= gaussianRadius(sigma);
+    if(radius <= 2)
+        return Method::Direct;
+    return radius <= maxSeparableRadius ? Method::Separable : Method::Recursive;
+}
+
+QVector<float> Convolution::gaussianWeights(float sigma, int radius)
+{
+    QVector<float> weights(2 * radius + 1);
+    double sum= 0.0;
+    for(int i= -radius; i<=radius; i++) {
+        const double weight= exp(-0.5 * i * i / ((double)sigma * sigma));
+        weights[i + radius]= weight;
+        sum+= weight;
+    }
+    for(int i=0; i<weights.count(); i++)
+        weights[i]/= sum;
+    return weights;
+}
+
+//
+// Execution
+//
+
+bool Convolution::run(Image& src, Image& dst) const
+{
+    if(src.size() != dst.size() or src.devId() != dst.devId() or &src == &dst) {
+        qDebug() << "Convolution::run: the images must be different, of the same size and device.";
+        return false;
+    }
+    switch(_method) {
+    case Method::Direct:
+        return runDirect(src, dst);
+    case Method::Separable:
+        return runSeparable(src, dst);
+    case Method::Recursive:
+        return runRecursive(src, dst);
+    default:
+        return false;
+    }
+}
+
+bool Convolution::runDirect(Image& src, Image& dst) const
+{
+    const int halo= qMax(_rowWeights.count(), _columnWeights.count()) / 2;
+    if(src.tiled() and halo > Image::maxTileHalo) {
+        qDebug() << "Convolution: the radius is too large for tiled images.";
+        return false;
+    }
+    Kernel* kernel= cachedKernel(directSource(src.format(), _rowWeights, _columnWeights), BlockDim {{ 0, 0 }},
+                                 qMin(halo, Image::maxTileHalo));
+    return kernel and (*kernel)(src, dst);
+}
+
+bool Convolution::runSeparable(Image& src, Image& dst) const
+{
+    const int rowRadius= _rowWeights.count() / 2;
+    const int columnRadius= _columnWeights.count() / 2;
+    if(qMax(rowRadius, columnRadius) > maxSeparableRadius) {
+        qDebug() << "Convolution: the radius of the separable passes is limited to" << maxSeparableRadius;
+        return false;
+    }
+    Kernel* rows= cachedKernel(separableSource(src.format(), _rowWeights, true),
+                               BlockDim {{ rowTileWidth, rowTileHeight }}, rowRadius);
+    Kernel* columns= cachedKernel(separableSource(src.format(), _columnWeights, false),
+                                  BlockDim {{ columnTileWidth, columnTileHeight }}, columnRadius);
+    if(!rows or !columns)
+        return false;
+
+    // The rows are kept in float between the passes, the device buffer goes back
+    // to the image pool after the column pass
+    Image pass(src.size(), KernelCache::floatFormat(src.format(), src.devId()), src.devId(), false);
+    return (*rows)(src, pass) and (*columns)(pass, dst);
+}
+
+bool Convolution::runRecursive(Image& src, Image& dst) const
+{
+    if(_sigma <= 0.0f) {
+        qDebug() << "Convolution: the recursive method is only available for Gaussians.";
+        return false;
+    }
+    if(src.tiled()) {
+        qDebug() << "Convolution: the recursive method is not available for tiled images.";
+        return false;
+    }
+    Kernel* rows= cachedKernel(recursiveSource(src.format(), _sigma, true),
+                               BlockDim {{ recursiveGroupSize, 1 }}, 0);
+    Kernel* columns= cachedKernel(recursiveSource(src.format(), _sigma, false),
+                                  BlockDim {{ recursiveGroupSize, 1 }}, 0);
+    if(!rows or !columns)
+        return false;
+
+    // Causal pass results of the lines, recycled by the pool once the passes are done
+    const size_t pixelBytes= iFmtChanCount(src.format()) == 1 ? sizeof(float) : 4 * sizeof(float);
+    const size_t scratchBytes= (size_t)src.width() * src.height() * pixelBytes;
+    Event lastUse;
+    cl_mem scratch= imgPool().acquireBuffer(src.devId(), scratchBytes, CL_MEM_READ_WRITE, &lastUse);
+    if(!scratch)
+        return false;
+    // A recycled buffer may still be used by the passes of a previous run on another queue
+    if(!lastUse.wait()) {
+        imgPool().releaseBuffer(src.devId(), scratchBytes, CL_MEM_READ_WRITE, scratch);
+        return false;
+    }
+
+    Image pass(src.size(), KernelCache::floatFormat(src.format(), src.devId()), src.devId(), false);
+    const bool ok= rows->setRange(QSize(src.height(), 1)) and (*rows)(src, scratch, pass)
+                   and columns->setRange(QSize(src.width(), 1)) and (*columns)(pass, scratch, dst);
+    // The column pass is the last command using the buffer
+    imgPool().releaseBuffer(src.devId(), scratchBytes, CL_MEM_READ_WRITE, scratch, dst.devEvent());
+    return ok;
+}
+
+int Convolution::cacheSize()
+{
+    return kernelCache().count("Convolution");
+}
+
+} // namespace QCLI
@@ -0,0 +1,119 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_CONVOLUTION_H
+#define _QCLI_CONVOLUTION_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+#include "image.h"
+
+namespace QCLI {
+
+class Kernel;
+
+/** \brief Separable convolution, and Gaussian blur
+ *
+ *  Convolves an image with the outer product of a row filter and a column
+ *  filter, the pixels outside the image repeat the edge:
+ *
+ *      Convolution::gaussian(2.5f).run(input, output);
+ *      Convolution(QVector<float>() << 0.25f << 0.5f << 0.25f).run(input, output);
+ *
+ *  Methods:
+ *   - Direct: a single pass reading the (2 * radius + 1)^2 pixels around each
+ *     pixel, the fastest for the smallest filters.
+ *   - Separable: a row pass then a column pass, through a float image. Each work
+ *     group stages its tile and the apron around it in local memory, so each
+ *     pixel is read once per pass instead of once per weight. Up to
+ *     maxSeparableRadius.
+ *   - Recursive: a Gaussian approximated by a recursive filter (Young and van
+ *     Vliet), one work item per row then per column, whose cost does not depend
+ *     on sigma. For Gaussians only, and not for tiled images.
+ *  The radius and the weights are compiled in the kernels, which are compiled
+ *  once per filter, method and channel count, and shared by all the Convolution
+ *  objects.
+ *
+ *  The formats are read and written with read_imagef() and write_imagef(), the
+ *  LUMA formats are staged and convolved as float and the ARGB formats as float4.
+ *
+ *  All methods are thread-safe.
+ */
+
+class Convolution
+{
+public:
+    /// Convolution method
+    enum class Method
+    {
+        Auto,      /// Chosen from the radius (see gaussianMethod())
+        Direct,    /// Single pass, O(radius^2) reads per pixel
+        Separable, /// Row and column passes through local memory, O(radius) per pixel
+        Recursive  /// Recursive Gaussian, O(1) per pixel
+    };
+
+    /// Creates a convolution with the same filter for the rows and the columns
+    /// @param weights odd number of weights, the middle one is the pixel
+    explicit Convolution(QVector<float> weights, Method method= Method::Auto);
+    /// Creates a convolution with a row filter and a column filter
+    Convolution(QVector<float> rowWeights, QVector<float> columnWeights, Method method= Method::Auto);
+
+    /// Returns a Gaussian blur
+    static Convolution gaussian(float sigma, Method method= Method::Auto);
+    /// Returns the method Auto picks for a Gaussian: Direct up to a radius of 2,
+    /// Separable up to maxSeparableRadius, Recursive for larger sigmas
+    static Method gaussianMethod(float sigma);
+    /// Returns the normalized weights of a Gaussian
+    static QVector<float> gaussianWeights(float sigma, int radius);
+    /// Returns the radius of the Gaussian filters
+    static int gaussianRadius(float sigma) { return qMax(1, qCeil(3.0f * sigma)); }
+
+    /// Largest radius of the separable passes, their tiles must fit in local memory
+    static const int maxSeparableRadius= 32;
+
+    /// Returns the method used (never Auto)
+    Method method() const { return _method; }
+    /// Returns the weights of the row filter
+    QVector<float> rowWeights() const { return _rowWeights; }
+    /// Returns the weights of the column filter
+    QVector<float> columnWeights() const { return _columnWeights; }
+    /// Returns the sigma of a Gaussian, 0 for other filters
+    float sigma() const { return _sigma; }
+
+    /// Convolves src into dst
+    /// @param dst image of the same size and device, other than src
+    /// @retval false on error (including compilation errors)
+    bool run(Image& src, Image& dst) const;
+    /// Same as run()
+    bool operator()(Image& src, Image& dst) const { return run(src, dst); }
+
+    /// Returns the number of kernels in the cache
+    static int cacheSize();
+
+private:
+    /// Runs the passes of each method
+    bool runDirect(Image& src, Image& dst) const;
+    bool runSeparable(Image& src, Image& dst) const;
+    bool runRecursive(Image& src, Image& dst) const;
+
+    QVector<float> _rowWeights;
+    QVector<float> _columnWeights;
+    Method _method;
+    float _sigma= 0.0f;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_CONVOLUTION_H
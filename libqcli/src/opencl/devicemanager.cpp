@@ -38,8 +38,40 @@ DeviceManager::DeviceManager()
 
 DeviceManager::~DeviceManager()
 {
-    foreach(const auto& queue, _queues)
-        clReleaseCommandQueue(queue);
+    for(int i=0; i<_queues.count(); i++) {
+        foreach(const auto& queue, queues(i))
+            clReleaseCommandQueue(queue);
+    }
+    delete _snapshot.fetchAndStoreOrdered(nullptr);
+}
+
+QVector<cl_device_id> DeviceManager::devices() const
+{
+    // Context lists the selected devices before the snapshot is published
+    const Snapshot* s= _snapshot;
+    if(s)
+        return s->devs;
+    QMutexLocker locker(&_lock);
+    return _devs;
+}
+
+QVector<cl_command_queue> DeviceManager::queues(int i) const
+{
+    QVector<cl_command_queue> ret;
+    const Snapshot* s= _snapshot;
+    if(!s or !s->validId(i))
+        return ret;
+    for(const auto& queue: s->queues[i]) {
+        if(!ret.contains(queue))
+            ret << queue;
+    }
+    return ret;
+}
+
+void DeviceManager::flush(int i) const
+{
+    foreach(const auto& queue, queues(i))
+        clFlush(queue);
 }
 
 QVector<cl_device_id> DeviceManager::devicesOfType(cl_device_type type)
@@ -103,17 +135,43 @@ bool DeviceManager::selectDevices(QList<int> devIds)
         // Store the corresponding cl_device_id in _devs
         _devs[i]= _allDevs[id];
     }
+    // Cache the properties used to pick the Image allocation policy and tiling
+    _unifiedMemory.resize(_devs.count());
+    _maxImageSize.resize(_devs.count());
+    _maxAllocSize.resize(_devs.count());
+    for(int i=0; i<_devs.count(); i++) {
+        _unifiedMemory[i]= clDeviceInfo<cl_bool>(_devs[i], CL_DEVICE_HOST_UNIFIED_MEMORY);
+        _maxImageSize[i]= QSize(clDeviceInfo<size_t>(_devs[i], CL_DEVICE_IMAGE2D_MAX_WIDTH),
+                                clDeviceInfo<size_t>(_devs[i], CL_DEVICE_IMAGE2D_MAX_HEIGHT));
+        _maxAllocSize[i]= clDeviceInfo<cl_ulong>(_devs[i], CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+    }
     // Context will now call setQueues and only then the devices are marked as
     // selected (with _devsSelected)
     return true;
 }
 
-void DeviceManager::setQueues(QVector<cl_command_queue> queues)
+void DeviceManager::setQueues(QVector<QVector<cl_command_queue>> queues, QVector<bool> outOfOrder)
 {
     QMutexLocker locker(&_lock);
     assert(!_queues.count());
     assert(queues.count() == _devs.count());
+    assert(outOfOrder.count() == _devs.count());
     _queues= queues;
+    _outOfOrder= outOfOrder;
+
+    // Publish the snapshot read by the getters, it is complete before they can see it
+    Snapshot* snapshot= new Snapshot;
+    snapshot->devs= _devs;
+    snapshot->unifiedMemory= _unifiedMemory;
+    snapshot->outOfOrder= _outOfOrder;
+    snapshot->maxImageSize= _maxImageSize;
+    snapshot->maxAllocSize= _maxAllocSize;
+    snapshot->queues.resize(_devs.count());
+    for(int i=0; i<_devs.count(); i++) {
+        for(int role=0; role<(int)snapshot->queues[i].size(); role++)
+            snapshot->queues[i][role]= _queues[i][role];
+    }
+    _snapshot.fetchAndStoreRelease(snapshot);
     // Now store the number of selected devices in an atomic int
     _devsSelected= _devs.count();
 }
@@ -17,12 +17,31 @@
 
 #include <QtCore>
 #include <CL/cl.h>
+#include <array>
 
 namespace QCLI {
 
+/// Role of a device command queue
+enum class QueueRole
+{
+    Compute,  /// Kernels
+    Upload,   /// Host to device transfers
+    Download  /// Device to host transfers
+};
+
+/// Command queues created for each device (see Context::setQueueTopology())
+enum class QueueTopology
+{
+    Single,   /// One in-order queue for the kernels and the transfers
+    Dedicated /// One queue per role, so the transfers overlap the kernels
+};
+
 /** \brief Manager of OpenCL compute devices
  *
  *  All functions are thread-safe.
+ *  The selected devices and their queues never change once the Context is
+ *  initialized, so they are published then in an immutable snapshot that the
+ *  getters read without locking.
  */
 
 class DeviceManager
@@ -42,19 +61,38 @@ public:
     bool initError() const { return _initError; }
 
     /// Returns the vector of selected devices
-    QVector<cl_device_id> devices() const { QMutexLocker l(&_lock); return _devs; }
+    QVector<cl_device_id> devices() const;
     /// Returns the number of selected devices
     int devCount() const { return _devsSelected; }
     /// Returns true if the index is a valid selected device index
     bool validId(int i) const { return i>=0 and i<_devsSelected; }
 
     /// Returns selected device, nullptr if the index is invalid
-    cl_device_id device(int i) const { QMutexLocker l(&_lock); return validId(i) ? _devs[i] : nullptr; }
-    /// Returns the queue of a selected device, nullptr if the index is invalid
-    cl_command_queue queue(int i) const { QMutexLocker l(&_lock); return validId(i) ? _queues[i] : nullptr; }
+    cl_device_id device(int i) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) ? s->devs[i] : nullptr; }
+    /// Returns the queue of a selected device for a role, nullptr if the index is invalid
+    /// With the Single topology all the roles share the same queue
+    cl_command_queue queue(int i, QueueRole role= QueueRole::Compute) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) ? s->queues[i][(int)role] : nullptr; }
+    /// Returns the distinct queues of a selected device
+    QVector<cl_command_queue> queues(int i) const;
+    /// Returns true if the compute queue of a selected device executes out of order
+    bool outOfOrder(int i) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) and s->outOfOrder[i]; }
+    /// Submits the commands of all the queues of a selected device
+    void flush(int i) const;
+    /// Returns true if a selected device shares the host memory (CL_DEVICE_HOST_UNIFIED_MEMORY)
+    bool hostUnifiedMemory(int i) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) and s->unifiedMemory[i]; }
+    /// Returns the largest 2D image of a selected device (CL_DEVICE_IMAGE2D_MAX_WIDTH/HEIGHT)
+    QSize maxImageSize(int i) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) ? s->maxImageSize[i] : QSize(); }
+    /// Returns the largest allocation of a selected device (CL_DEVICE_MAX_MEM_ALLOC_SIZE)
+    qint64 maxAllocSize(int i) const
+        { const Snapshot* s= _snapshot; return s and s->validId(i) ? s->maxAllocSize[i] : 0; }
 
     /// Returns the OpenCL platform object
-    cl_platform_id platform() const { QMutexLocker l(&_lock); return _platform; }
+    cl_platform_id platform() const { return _platform; } // Set by the constructor
 
     /// Disable copying
     DeviceManager(const DeviceManager& other) = delete;
@@ -69,7 +107,9 @@ protected:
     /// @retval false if an index is out of bounds or if the devices where already selected
     bool selectDevices(QList<int> devIds);
     /// Used by Context to set the device queues after being initialized
-    void setQueues(QVector<cl_command_queue> queues);
+    /// @param queues compute, upload and download queue of each device (they can be the same)
+    /// @param outOfOrder true for the devices whose compute queue executes out of order
+    void setQueues(QVector<QVector<cl_command_queue>> queues, QVector<bool> outOfOrder);
 
 private:
     /// Hide constructor
@@ -79,6 +119,19 @@ private:
     /// Use CL_DEVICE_TYPE_ALL to get all devices
     QVector<cl_device_id> devicesOfType(cl_device_type type);
 
+    /// Selected devices and their queues, immutable once published
+    struct Snapshot {
+        bool validId(int i) const { return i>=0 and i<devs.count(); }
+
+        QVector<cl_device_id> devs;
+        /// Queues indexed by device and QueueRole
+        QVector<std::array<cl_command_queue, 3>> queues;
+        QVector<bool> unifiedMemory;
+        QVector<bool> outOfOrder;
+        QVector<QSize> maxImageSize;
+        QVector<qint64> maxAllocSize;
+    };
+
     // OpenCL
     cl_platform_id _platform= nullptr;
     // State
@@ -90,9 +143,19 @@ private:
     QVector<cl_device_id> _allDevs;
     /// Devices selected to be used in the context
     QVector<cl_device_id> _devs;
-
-    /// Device queues
-    QVector<cl_command_queue> _queues;
+    /// CL_DEVICE_HOST_UNIFIED_MEMORY of each selected device
+    QVector<bool> _unifiedMemory;
+    /// Image and allocation limits of each selected device
+    QVector<QSize> _maxImageSize;
+    QVector<qint64> _maxAllocSize;
+
+    /// Device queues, indexed by device and QueueRole
+    QVector<QVector<cl_command_queue>> _queues;
+    /// True for the out-of-order compute queues
+    QVector<bool> _outOfOrder;
+
+    /// Published by setQueues(), nullptr until then
+    QAtomicPointer<const Snapshot> _snapshot;
 };
 
 /// Global function to access the DeviceManager
@@ -0,0 +1,102 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "event.h"
+
+#include "util/utils.h"
+
+namespace QCLI {
+
+Event::Event(const Event& other)
+    : _event(other._event)
+{
+    if(_event)
+        clRetainEvent(_event);
+}
+
+Event& Event::operator=(const Event& other)
+{
+    if(other._event)
+        clRetainEvent(other._event);
+    if(_event)
+        clReleaseEvent(_event);
+    _event= other._event;
+    return *this;
+}
+
+Event::~Event()
+{
+    if(_event)
+        clReleaseEvent(_event);
+}
+
+bool Event::isComplete() const
+{
+    if(!_event)
+        return true;
+    cl_int status;
+    cl_int err= clGetEventInfo(_event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    if(checkCLError(err, "clGetEventInfo"))
+        return false;
+    // Negative status values are errors, the command will not run
+    return status <= CL_COMPLETE;
+}
+
+bool Event::wait() const
+{
+    if(!_event)
+        return true;
+    cl_int err= clWaitForEvents(1, &_event);
+    return !checkCLError(err, "clWaitForEvents");
+}
+
+cl_ulong Event::profilingInfo(cl_profiling_info param) const
+{
+    if(!_event)
+        return 0;
+    cl_ulong value;
+    cl_int err= clGetEventProfilingInfo(_event, param, sizeof(value), &value, nullptr);
+    if(checkCLError(err, "clGetEventProfilingInfo"))
+        return 0;
+    return value;
+}
+
+bool Event::waitAll(const QVector<Event>& events)
+{
+    const auto list= waitList(events);
+    if(list.isEmpty())
+        return true;
+    cl_int err= clWaitForEvents(list.count(), list.data());
+    return !checkCLError(err, "clWaitForEvents");
+}
+
+QVector<cl_event> Event::waitList(const QVector<Event>& events, cl_command_queue queue)
+{
+    QVector<cl_event> ret;
+    foreach(const Event& event, events) {
+        if(!event._event)
+            continue;
+        ret << event._event;
+        // A command of an unflushed queue may never be submitted, and then the waiting one never runs
+        if(queue) {
+            cl_command_queue eventQueue;
+            cl_int err= clGetEventInfo(event._event, CL_EVENT_COMMAND_QUEUE, sizeof(eventQueue), &eventQueue, nullptr);
+            if(!checkCLError(err, "clGetEventInfo") and eventQueue and eventQueue != queue)
+                clFlush(eventQueue);
+        }
+    }
+    return ret;
+}
+
+} // namespace QCLI
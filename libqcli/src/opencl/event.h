@@ -0,0 +1,71 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_EVENT_H
+#define _QCLI_EVENT_H
+
+#include <QtCore>
+#include <CL/cl.h>
+
+namespace QCLI {
+
+/** \brief Waitable handle of an enqueued OpenCL command
+ *
+ *  Wraps a cl_event with reference counting, so it can be copied freely.
+ *  A null Event is always complete.
+ *
+ *  All methods are thread-safe.
+ */
+
+class Event
+{
+public:
+    Event() = default;
+    /// Takes ownership of event (it is released by the destructor)
+    explicit Event(cl_event event) : _event(event) { }
+    Event(const Event& other);
+    Event& operator=(const Event& other);
+    ~Event();
+
+    /// Returns true if there is no command associated to the event
+    bool isNull() const { return !_event; }
+    /// Returns true if the command finished (or the event is null)
+    bool isComplete() const;
+    /// Blocks until the command finishes
+    /// @retval false on error
+    bool wait() const;
+
+    /// Returns a device timestamp of the command in ns (CL_PROFILING_COMMAND_START, etc.)
+    /// The queue of the command must have CL_QUEUE_PROFILING_ENABLE
+    /// @retval 0 on error or if the event is null
+    cl_ulong profilingInfo(cl_profiling_info param) const;
+
+    /// Returns the OpenCL event
+    cl_event clEvent() const { return _event; }
+
+    /// Blocks until all the commands finish
+    /// @retval false on error
+    static bool waitAll(const QVector<Event>& events);
+    /// Returns the cl_events of the non-null events, to use as an event wait list
+    /// @param queue queue of the command waiting for the events, the other queues of the
+    ///        events are flushed so their commands are submitted (nullptr to skip it)
+    static QVector<cl_event> waitList(const QVector<Event>& events, cl_command_queue queue= nullptr);
+
+private:
+    cl_event _event= nullptr;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_EVENT_H
@@ -0,0 +1,218 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "imagepool.h"
+
+#include "util/utils.h"
+#include "opencl/context.h"
+
+namespace QCLI {
+
+uint qHash(const ImagePool::Key& key)
+{
+    return ::qHash(((quint64)key.width << 32 | (uint)key.height) ^ ((quint64)(ifmt_t)key.format << 8)
+                   ^ ((quint64)key.flags << 40) ^ (quint64)key.devId);
+}
+
+class ImagePool::Reaper : public QThread
+{
+public:
+    Reaper(ImagePool& pool) : _pool(pool) { }
+protected:
+    void run()
+    {
+        QMutexLocker locker(&_pool._lock);
+        while(!_pool._stopping) {
+            if(_pool._order.isEmpty()) {
+                _pool._released.wait(&_pool._lock);
+                continue;
+            }
+            // Sleep until the oldest image expires, or a change of maxIdle
+            const Entry& oldest= _pool._idle[_pool._order.begin().value()].first();
+            const qint64 left= oldest.released + _pool._maxIdle - _pool._clock.elapsed();
+            if(left > 0)
+                _pool._released.wait(&_pool._lock, (unsigned long)left);
+            else
+                _pool._trimBefore(_pool._clock.elapsed() - _pool._maxIdle);
+        }
+    }
+private:
+    ImagePool& _pool;
+};
+
+ImagePool::ImagePool()
+{
+    _budget= 256 * 1024 * 1024;
+    _maxIdle= 10000;
+    _clock.start();
+}
+
+ImagePool::~ImagePool()
+{
+    if(_reaper) {
+        {
+            QMutexLocker locker(&_lock);
+            _stopping= true;
+            _released.wakeAll();
+        }
+        _reaper->wait();
+        delete _reaper;
+    }
+    QMutexLocker locker(&_lock);
+    _trimTo(0);
+}
+
+cl_mem ImagePool::acquire(int devId, int width, int height, IFmt format, cl_mem_flags flags, Event* lastUse)
+{
+    cl_mem image= _take(Key { devId, width, height, format, flags }, lastUse);
+    if(image)
+        return image;
+    cl_int err;
+    auto clFormat= toCLFormat(format);
+    image= clCreateImage2D(clCtx(), flags, &clFormat, width, height, 0, nullptr, &err);
+    if(checkCLError(err, "clCreateImage2D"))
+        return nullptr;
+    return image;
+}
+
+void ImagePool::release(int devId, int width, int height, IFmt format, cl_mem_flags flags, cl_mem image,
+                        const Event& lastUse)
+{
+    if(image)
+        _put(Key { devId, width, height, format, flags }, (qint64)width * height * iFmtBPP(format) / 8, image, lastUse);
+}
+
+cl_mem ImagePool::acquireBuffer(int devId, size_t bytes, cl_mem_flags flags, Event* lastUse)
+{
+    cl_mem buffer= _take(Key { devId, (qint64)bytes, 0, IFmt(), flags }, lastUse);
+    if(buffer)
+        return buffer;
+    cl_int err;
+    buffer= clCreateBuffer(clCtx(), flags, bytes, nullptr, &err);
+    if(checkCLError(err, "clCreateBuffer"))
+        return nullptr;
+    return buffer;
+}
+
+void ImagePool::releaseBuffer(int devId, size_t bytes, cl_mem_flags flags, cl_mem buffer, const Event& lastUse)
+{
+    if(buffer)
+        _put(Key { devId, (qint64)bytes, 0, IFmt(), flags }, bytes, buffer, lastUse);
+}
+
+cl_mem ImagePool::_take(const Key& key, Event* lastUse)
+{
+    QMutexLocker locker(&_lock);
+    auto found= _idle.find(key);
+    if(found == _idle.end()) {
+        _misses++;
+        if(lastUse)
+            *lastUse= Event();
+        return nullptr;
+    }
+    // The most recently released image is the most likely to be cached
+    const Entry entry= found.value().takeLast();
+    if(found.value().isEmpty())
+        _idle.erase(found);
+    _order.remove(entry.serial);
+    _idleBytes-= entry.bytes;
+    _hits++;
+    if(lastUse)
+        *lastUse= entry.lastUse;
+    return entry.image;
+}
+
+void ImagePool::_put(const Key& key, qint64 bytes, cl_mem image, const Event& lastUse)
+{
+    QMutexLocker locker(&_lock);
+    _trimBefore(_clock.elapsed() - _maxIdle);
+    if(bytes > _budget) {
+        // The device keeps the image alive until its pending commands finish
+        clReleaseMemObject(image);
+        return;
+    }
+    _trimTo(_budget - bytes);
+    const Entry entry { image, lastUse, bytes, _clock.elapsed(), ++_serial };
+    _idle[key] << entry;
+    _order.insert(entry.serial, key);
+    _idleBytes+= bytes;
+
+    // The reaper frees the image if no other release trims it in time
+    if(!_reaper) {
+        _reaper= new Reaper(*this);
+        _reaper->start(QThread::LowestPriority);
+    }
+    if(_order.count() == 1)
+        _released.wakeAll();
+}
+
+void ImagePool::setMaxIdle(int msecs)
+{
+    QMutexLocker locker(&_lock);
+    _maxIdle= msecs;
+    _released.wakeAll();
+}
+
+void ImagePool::setBudget(qint64 bytes)
+{
+    QMutexLocker locker(&_lock);
+    _budget= qMax(bytes, (qint64)0);
+    _trimTo(_budget);
+}
+
+void ImagePool::trim(int msecs)
+{
+    QMutexLocker locker(&_lock);
+    _trimBefore(_clock.elapsed() - msecs);
+}
+
+ImagePool::Stats ImagePool::stats() const
+{
+    QMutexLocker locker(&_lock);
+    return Stats { _hits, _misses, _order.count(), _idleBytes };
+}
+
+void ImagePool::resetStats()
+{
+    QMutexLocker locker(&_lock);
+    _hits= 0;
+    _misses= 0;
+}
+
+void ImagePool::_freeOldest()
+{
+    const auto oldest= _order.begin();
+    const auto found= _idle.find(oldest.value());
+    // The oldest image of the pool is the oldest one of its key
+    const Entry entry= found.value().takeFirst();
+    if(found.value().isEmpty())
+        _idle.erase(found);
+    _order.erase(oldest);
+    _idleBytes-= entry.bytes;
+    clReleaseMemObject(entry.image);
+}
+
+void ImagePool::_trimTo(qint64 bytes)
+{
+    while(_idleBytes > bytes and !_order.isEmpty())
+        _freeOldest();
+}
+
+void ImagePool::_trimBefore(qint64 time)
+{
+    while(!_order.isEmpty() and _idle[_order.begin().value()].first().released <= time)
+        _freeOldest();
+}
+
+} // namespace QCLI
@@ -0,0 +1,166 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_IMAGEPOOL_H
+#define _QCLI_IMAGEPOOL_H
+
+#include <QtCore>
+#include <CL/cl.h>
+
+#include "ifmt.h"
+#include "opencl/event.h"
+
+namespace QCLI {
+
+/** \brief Recycles the device images of each device
+ *
+ *  Creating and releasing cl_mem images is expensive, so the device images
+ *  released by Image are kept in the pool and handed out again to the next
+ *  image of the same device, size, format and flags. The scratch buffers of the
+ *  kernels are recycled the same way (see acquireBuffer()).
+ *
+ *  A recycled image may still be used by commands of its previous owner; the
+ *  last of them is returned with it, and the new owner must wait for it on the
+ *  device before using the image.
+ *
+ *  The pool keeps at most budget() bytes of idle images, the least recently
+ *  released ones are freed first. Images idle for more than maxIdle() ms are
+ *  freed too.
+ *
+ *  All functions are thread-safe.
+ */
+
+class ImagePool
+{
+public:
+    /// Usage statistics
+    struct Stats {
+        qint64 hits;        // acquire() calls served with a pooled image
+        qint64 misses;      // acquire() calls that created a new image
+        int idleCount;      // Images currently in the pool
+        qint64 idleBytes;   // Bytes of the images currently in the pool
+    };
+
+    ~ImagePool();
+
+    /// Static instance method (thread safe in C++11)
+    static ImagePool& instance() {
+        static ImagePool inst;
+        return inst;
+    }
+
+    /// Returns a device image, recycled if possible
+    /// The caller owns the image and must give it back with release() (or
+    /// clReleaseMemObject). lastUse is set to the last command using it.
+    /// @retval nullptr on error
+    cl_mem acquire(int devId, int width, int height, IFmt format, cl_mem_flags flags, Event* lastUse);
+    /// Gives an image created by acquire() back to the pool
+    /// @param lastUse last command using the image
+    void release(int devId, int width, int height, IFmt format, cl_mem_flags flags, cl_mem image,
+                 const Event& lastUse= Event());
+    /// Returns a device buffer, recycled if possible, like acquire()
+    /// @retval nullptr on error
+    cl_mem acquireBuffer(int devId, size_t bytes, cl_mem_flags flags, Event* lastUse);
+    /// Gives a buffer created by acquireBuffer() back to the pool
+    /// @param lastUse last command using the buffer
+    void releaseBuffer(int devId, size_t bytes, cl_mem_flags flags, cl_mem buffer, const Event& lastUse= Event());
+
+    /// Returns the maximum number of bytes kept in the pool
+    qint64 budget() const { QMutexLocker l(&_lock); return _budget; }
+    /// Sets the maximum number of bytes kept in the pool (0 disables pooling)
+    void setBudget(qint64 bytes);
+    /// Returns the time after which an idle image is freed, in ms
+    int maxIdle() const { return _maxIdle; }
+    /// Sets the time after which an idle image is freed, in ms
+    void setMaxIdle(int msecs);
+
+    /// Frees the images idle for more than msecs
+    void trim(int msecs= 0);
+    /// Returns the usage statistics
+    Stats stats() const;
+    /// Resets the hit and miss counters
+    void resetStats();
+
+    /// Disable copying
+    ImagePool(const ImagePool& other) = delete;
+    /// Disable assignments
+    ImagePool& operator=(const ImagePool& other) = delete;
+
+private:
+    /// Hide constructor
+    ImagePool();
+
+    /// Device, size, format and flags of the interchangeable images
+    /// The buffers have a height of 0 and their size in bytes as width
+    struct Key {
+        int devId;
+        qint64 width;
+        int height;
+        IFmt format;
+        cl_mem_flags flags;
+        bool operator==(const Key& other) const {
+            return devId == other.devId and width == other.width and height == other.height
+                   and format == other.format and flags == other.flags;
+        }
+    };
+    friend uint qHash(const Key& key);
+    /// Idle image
+    struct Entry {
+        cl_mem image;
+        Event lastUse;
+        qint64 bytes;
+        qint64 released; // Time of release, in ms since the pool creation
+        quint64 serial;  // Release order, key of _order
+    };
+    /// Frees the idle images after maxIdle() when no release trims them
+    class Reaper;
+
+    /// Takes an idle image of a key
+    /// @retval nullptr if there is none
+    cl_mem _take(const Key& key, Event* lastUse);
+    /// Keeps an image released by its owner, or frees it if it exceeds the budget
+    void _put(const Key& key, qint64 bytes, cl_mem image, const Event& lastUse);
+    /// Frees the oldest idle image (lock held)
+    void _freeOldest();
+    /// Frees the oldest idle images until the pool fits in bytes (lock held)
+    void _trimTo(qint64 bytes);
+    /// Frees the images released before time (lock held)
+    void _trimBefore(qint64 time);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    qint64 _budget;
+    QAtomicInt _maxIdle;
+    QElapsedTimer _clock;
+
+    /// Idle images of each key, the oldest first
+    QHash<Key, QList<Entry>> _idle;
+    /// Keys of the idle images in release order, to free the oldest first
+    QMap<quint64, Key> _order;
+    quint64 _serial= 0;
+    qint64 _idleBytes= 0;
+    Reaper* _reaper= nullptr;  // Started by the first release
+    QWaitCondition _released;  // Wakes the reaper
+    bool _stopping= false;
+    qint64 _hits= 0;
+    qint64 _misses= 0;
+};
+
+/// Global function to access the ImagePool
+inline
+ImagePool& imgPool() { return ImagePool::instance(); }
+
+} // namespace QCLI
+
+#endif // _QCLI_IMAGEPOOL_H
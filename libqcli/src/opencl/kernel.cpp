@@ -15,6 +15,11 @@
 #include "context.h"
 #include "util/utils.h"
 #include "opencl/kernel.h"
+#include "opencl/imagepool.h"
+#include "opencl/profiler.h"
+#include "opencl/programmanager.h"
+#include "opencl/worksizetuner.h"
+#include "opencl/devicemanager.h"
 #include "image.h"
 
 namespace QCLI {
@@ -36,14 +41,21 @@ bool Kernel::loadProgram(QString fileName, QString functionName)
         return false;
     }
 
-    Q_UNUSED(fileName);
-    Q_UNUSED(functionName);
-    
-    // TODO
-    // QMutexLocker locker(&_lock);
-    // prgMng().addFile(fileName);
-    // _kernel= prgMng().getKernel(functionName)
-    
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Could not open kernel file" << fileName;
+        return false;
+    }
+    const QString source= QString::fromUtf8(file.readAll().constData());
+
+    QMutexLocker locker(&_lock);
+    _kernel= prgMng().kernel(source, functionName);
+    if(!_kernel)
+        return false;
+    _functionName= functionName;
+    _tuningKey= functionName + ":"
+                + QString::fromLatin1(QCryptographicHash::hash(source.toUtf8(), QCryptographicHash::Md5).toHex());
+
     _initialized= true;
     return true;
 }
@@ -54,96 +66,522 @@ bool Kernel::loadSource(QString source)
         qDebug() << "A kernel is already loaded.";
         return false;
     }
-    
-    Q_UNUSED(source);
-    
-    // TODO
-    // QMutexLocker locker(&_lock);
-    // prgMng().addSource(source);
-    // QString functionName = getKernelFunctionName(source);
-    // _kernel = prgMng().getKernel(functionName);
-    
+
+    const QString functionName= kernelFunctionName(source);
+    if(functionName.isEmpty()) {
+        qDebug() << "No __kernel function found in the source.";
+        return false;
+    }
+
+    QMutexLocker locker(&_lock);
+    _kernel= prgMng().kernel(source, functionName);
+    if(!_kernel)
+        return false;
+    _functionName= functionName;
+    _tuningKey= functionName + ":"
+                + QString::fromLatin1(QCryptographicHash::hash(source.toUtf8(), QCryptographicHash::Md5).toHex());
+
     _initialized= true;
     return true;
 }
 
-template<typename T>
-bool Kernel::setArg(int argIndex, T&& arg) 
+QString Kernel::kernelFunctionName(QString source)
+{
+    // First function declared with the __kernel (or kernel) qualifier, attributes
+    // such as reqd_work_group_size may follow it on the same line
+    QRegExp regExp("(?:__)?kernel\\s+(?:__attribute__\\s*\\(\\([^\\n]*\\)\\)\\s+)?void\\s+(\\w+)\\s*\\(");
+    if(regExp.indexIn(source) == -1)
+        return QString();
+    return regExp.cap(1);
+}
+
+bool Kernel::setArg(int argIndex, Image& image)
 {
     if(isNull()) {
         qDebug() << "No kernel loaded.";
         return false;
     }
-    
-    QMutexLocker locker(&_lock);
-    
-    cl_int err = clSetKernelArg(_kernel, argIndex, sizeof(T), (const void*)&arg);
-    
-    return checkCLError(err, "clSetKernelArg");
+    Instance* instance= threadInstance();
+    return instance and setKernelArg(*instance, argIndex, image);
+}
+
+bool Kernel::setArg(int argIndex, const Image& image)
+{
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+    Instance* instance= threadInstance();
+    return instance and setKernelArg(*instance, argIndex, image);
 }
 
-bool Kernel::setLayout(BlockDim blockDim, GridDim gridDim) 
+bool Kernel::setArg(int argIndex, ImageBatch& batch)
 {
-    Q_UNUSED(blockDim); Q_UNUSED(gridDim);
-    // TODO
-    // _globalWorkSize[0] = 
-    // _globalWorkSize[1] = 
-    // _localWorkSize[0] = 
-    // _localWorkSize[1] = 
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+    Instance* instance= threadInstance();
+    return instance and setKernelArg(*instance, argIndex, batch);
+}
+
+bool Kernel::setRange(QSize size)
+{
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+    if(size.isEmpty()) {
+        qDebug() << "Kernel::setRange: invalid size.";
+        return false;
+    }
+    Instance* instance= threadInstance();
+    if(!instance)
+        return false;
+    instance->range= size;
     return true;
 }
 
-template<typename T>
-void Kernel::getImageSize(T&&) { }
+bool Kernel::setLayout(BlockDim blockDim, GridDim gridDim)
+{
+    if(!blockDim[0] or !blockDim[1]) {
+        qDebug() << "Kernel::setLayout: invalid block size.";
+        return false;
+    }
+    QMutexLocker locker(&_lock);
+    _blockDim= blockDim;
+    _gridDim= gridDim;
+    // The instances pick it up in their next launch
+    _layoutVersion.ref();
+    return true;
+}
 
-// TODO We could also check if the user specified at least one Image type!
-template<>
-void Kernel::getImageSize<Image>(Image&& arg) 
+bool Kernel::setHalo(int halo)
 {
-    Q_UNUSED(arg);
-    // TODO: set the global_work_size from the size of the image and the local_work_size
-    // _globalWorkSize[0] = roundUp(arg.width, _localWorkSize[0]);
-    // _globalWorkSize[1] = roundUp(arg.height, _localWorkSize[1]);
+    if(halo < 0 or halo > Image::maxTileHalo) {
+        qDebug() << "Kernel::setHalo: the halo must be between 0 and" << (int)Image::maxTileHalo;
+        return false;
+    }
+    _halo= halo;
+    return true;
 }
 
-template<int argN, typename First, typename... Rest>
-bool Kernel::setArguments(First arg0, Rest... rest)
+bool Kernel::operator()()
 {
-    cl_int err = clSetKernelArg(_kernel, argN, sizeof(First), (const void*)&arg0);
-    getImageSize(arg0);
-    return checkCLError(err, "clSetKernelArg") // TODO, we could show the index too (argN)
-           and setArguments<argN+1>(rest...);
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+    Instance* instance= threadInstance();
+    return instance and enqueue(*instance);
 }
 
-template<typename... Args>
-bool Kernel::operator()(Args... args)
+bool Kernel::runImages(const QVector<Image*>& images)
 {
     if(isNull()) {
         qDebug() << "No kernel loaded.";
         return false;
     }
+    Instance* instance= threadInstance();
+    if(!instance)
+        return false;
+    for(int i=0; i<images.count(); i++) {
+        if(!setKernelArg(*instance, i, *images[i]))
+            return false;
+    }
+    return enqueue(*instance);
+}
+
+QThreadStorage<Kernel::ThreadInstances*>& Kernel::threadInstances()
+{
+    static QThreadStorage<ThreadInstances*> instances;
+    return instances;
+}
+
+int Kernel::newId()
+{
+    static QAtomicInt lastId;
+    return lastId.fetchAndAddRelaxed(1) + 1;
+}
+
+Kernel::Instance* Kernel::threadInstance()
+{
+    QThreadStorage<ThreadInstances*>& storage= threadInstances();
+    if(!storage.hasLocalData())
+        storage.setLocalData(new ThreadInstances());
+    ThreadInstances& instances= *storage.localData();
+    {
+        const auto found= instances.constFind(_id);
+        if(found != instances.constEnd())
+            return found.value().data();
+    }
+
+    // The instances of the destroyed kernels are pruned when the thread uses a
+    // new one, so long-lived threads do not accumulate them
+    for(auto i= instances.begin(); i != instances.end();) {
+        if((*i)->retired)
+            i= instances.erase(i);
+        else
+            ++i;
+    }
+
+    // Same program and function, but its own arguments
+    cl_program program;
+    cl_int err= clGetKernelInfo(_kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, nullptr);
+    if(checkCLError(err, "clGetKernelInfo"))
+        return nullptr;
+    cl_kernel kernel= clCreateKernel(program, _functionName.toLatin1().constData(), &err);
+    if(checkCLError(err, "clCreateKernel"))
+        return nullptr;
+    QSharedPointer<Instance> instance(new Instance());
+    instance->kernel= kernel;
+    instances.insert(_id, instance);
 
+    // The instances of the finished threads are dropped, so the kernels living
+    // as long as the process do not accumulate them
     QMutexLocker locker(&_lock);
+    for(auto i= _instances.begin(); i != _instances.end();) {
+        if(i->isNull())
+            i= _instances.erase(i);
+        else
+            ++i;
+    }
+    _instances << instance.toWeakRef();
+    return instance.data();
+}
+
+bool Kernel::setKernelArg(Instance& instance, int argIndex, Image& image)
+{
+    // Make sure the device buffer exists and holds the current data
+    if(!image._prepareDev())
+        return false;
+    // The tiles are bound by each launch
+    if(image._tiled) {
+        instance.imageArgs[argIndex]= &image;
+        instance.readOnlyArgs.remove(argIndex);
+        return true;
+    }
+    cl_int err= clSetKernelArg(instance.kernel, argIndex, sizeof(cl_mem), (const void*)&image._devBuffer);
+    if(checkCLError(err, QString("clSetKernelArg (index %1)").arg(argIndex).toStdString()))
+        return false;
+    instance.imageArgs[argIndex]= &image;
+    instance.readOnlyArgs.remove(argIndex);
+    return true;
+}
 
-    // 1) Set the kernel arguments 
-    if(sizeof...(Args) != 0) {
-        bool argSetOk= setArguments<0>(args...);
-        if (!argSetOk) 
+bool Kernel::setKernelArg(Instance& instance, int argIndex, const Image& image)
+{
+    // Only the launch ordering of the image changes, not its data
+    if(!setKernelArg(instance, argIndex, const_cast<Image&>(image)))
+        return false;
+    instance.readOnlyArgs.insert(argIndex);
+    return true;
+}
+
+bool Kernel::setKernelArg(Instance& instance, int argIndex, ImageBatch& batch)
+{
+    if(batch.isNull()) {
+        qDebug() << "Kernel: null ImageBatch argument" << argIndex;
+        return false;
+    }
+    // The images of all the batches are processed by the same work items
+    if(instance.batchCount and (batch.count() != instance.batchCount or batch.size() != instance.batchSize)) {
+        qDebug() << "Kernel: the ImageBatch arguments of" << _functionName << "must have the same size and count.";
+        return false;
+    }
+    if(!setKernelArg(instance, argIndex, batch.stack()))
+        return false;
+    instance.batchSize= batch.size();
+    instance.batchCount= batch.count();
+    return true;
+}
+
+bool Kernel::enqueue(Instance& instance)
+{
+    if(!instance.imageArgs.isEmpty()) {
+        // Run in the queue of the first image, over the size of the last image
+        Image* const first= instance.imageArgs.begin().value();
+        instance.queue= first->_queue;
+        instance.devId= first->_devId;
+    }
+    if(!instance.queue) {
+        qDebug() << "Kernel: no Image argument to take the queue from.";
+        return false;
+    }
+
+    // Layout set with setLayout() since the last launch
+    const int layoutVersion= _layoutVersion;
+    if(layoutVersion != instance.layoutVersion) {
+        QMutexLocker locker(&_lock);
+        instance.localWorkSize[0]= _blockDim[0];
+        instance.localWorkSize[1]= _blockDim[1];
+        instance.gridDim= _gridDim;
+        instance.layoutVersion= _layoutVersion;
+    }
+
+    // Images too large for the device run tile by tile
+    foreach(Image* image, instance.imageArgs) {
+        if(!image->_tiled)
+            continue;
+        if(instance.batchCount or instance.range.isValid()) {
+            qDebug() << "Kernel: ImageBatch arguments and setRange() can not be used with the tiled images of"
+                     << _functionName;
+            instance.batchCount= 0;
+            instance.range= QSize();
             return false;
+        }
+        return enqueueTiles(instance);
+    }
+
+    // Wait for the pending transfers and kernels using the images
+    QVector<Event> pending;
+    foreach(Image* image, instance.imageArgs)
+        pending << image->_devEvent;
+    const auto waitList= Event::waitList(pending, instance.queue);
+
+    QSize size= instance.imageArgs.isEmpty() ? QSize() : (--instance.imageArgs.end()).value()->size();
+    if(instance.batchCount)
+        size= instance.batchSize;
+    if(instance.range.isValid())
+        size= instance.range;
+    Event launch;
+    const bool ok= enqueueRange(instance, size, waitList, &launch);
+    instance.batchCount= 0;
+    instance.range= QSize();
+    if(!ok)
+        return false;
+
+    // The kernel may have written any image but the const ones, the device copies are now the valid ones
+    for(auto it= instance.imageArgs.constBegin(); it != instance.imageArgs.constEnd(); ++it) {
+        if(instance.readOnlyArgs.contains(it.key()))
+            it.value()->_devEvent= launch;
+    }
+    for(auto it= instance.imageArgs.constBegin(); it != instance.imageArgs.constEnd(); ++it) {
+        if(!instance.readOnlyArgs.contains(it.key()))
+            it.value()->_devWritten(launch);
     }
-    
-    // 2) Enqueue the kernel for execution
-    cl_command_queue queue; // = TODO, queue from where?
-    cl_int err = clEnqueueNDRangeKernel(queue, _kernel, layoutDim, nullptr, _globalWorkSize, _localWorkSize, 0, nullptr, nullptr);
-    
-    return checkCLError(err, "clEnqueuNDRangeKernel");
+    instance.imageArgs.clear();
+    instance.readOnlyArgs.clear();
+    return true;
 }
 
+bool Kernel::enqueueTiles(Instance& instance)
+{
+    const QMap<int, Image*> imageArgs= instance.imageArgs;
+    const QSet<int> readOnlyArgs= instance.readOnlyArgs;
+    instance.imageArgs.clear();
+    instance.readOnlyArgs.clear();
+
+    // The tiled images share the same grid
+    Image* tiled= nullptr;
+    foreach(Image* image, imageArgs) {
+        if(!image->_tiled)
+            continue;
+        if(tiled and (image->size() != tiled->size() or image->_devId != tiled->_devId)) {
+            qDebug() << "Kernel: the tiled images of" << _functionName << "must have the same size and device.";
+            return false;
+        }
+        tiled= image;
+    }
+    if(instance.gridDim[0] and instance.gridDim[1]) {
+        qDebug() << "Kernel: the grid of" << _functionName << "can not be set for tiled images.";
+        return false;
+    }
+
+    // The images written by the kernel, their temporary images are copied back
+    QSet<Image*> written;
+    for(auto it= imageArgs.constBegin(); it != imageArgs.constEnd(); ++it) {
+        if(!readOnlyArgs.contains(it.key()))
+            written << it.value();
+    }
+
+    const int halo= _halo;
+    const QRect bounds(QPoint(0, 0), tiled->size());
+    bool ok= true;
+    for(int i=0; ok and i<tiled->_tiles.count(); i++) {
+        const QRect inner= tiled->_tiles[i].rect;
+        const QRect outer= inner.adjusted(-halo, -halo, halo, halo).intersected(bounds);
+
+        // Bind the tile of each tiled image, or a copy of it with the halo. The untiled
+        // images of the same size (e.g. of a smaller format) are bound as a copy of the
+        // tile area, the other ones as a whole.
+        QMap<Image*, cl_mem> temps;
+        QVector<Event> pending;
+        for(auto it= imageArgs.constBegin(); ok and it != imageArgs.constEnd(); ++it) {
+            Image* const image= it.value();
+            const bool area= !image->_tiled and image->size() == bounds.size();
+            if(!image->_tiled and !area) {
+                pending << image->_devEvent;
+                continue;
+            }
+            cl_mem buffer= image->_tiled ? image->_tiles[i].buffer : nullptr;
+            if(halo or area) {
+                buffer= temps.value(image);
+                if(!buffer) {
+                    Event lastUse;
+                    buffer= imgPool().acquire(instance.devId, outer.width(), outer.height(), image->_format,
+                                              CL_MEM_READ_WRITE, &lastUse);
+                    ok= buffer and image->_copyTiles(buffer, outer, QPoint(0, 0), false, lastUse);
+                    if(buffer)
+                        temps[image]= buffer;
+                }
+            }
+            pending << image->_devEvent;
+            ok= ok and !checkCLError(clSetKernelArg(instance.kernel, it.key(), sizeof(cl_mem), (const void*)&buffer),
+                                     QString("clSetKernelArg (index %1)").arg(it.key()).toStdString());
+        }
+
+        Event launch;
+        ok= ok and enqueueRange(instance, outer.size(), Event::waitList(pending, instance.queue), &launch);
+        if(ok) {
+            foreach(Image* image, imageArgs)
+                image->_devEvent= launch;
+        }
+
+        // The inner part of the temporary images goes back to the images, unless only read
+        for(auto it= temps.constBegin(); it != temps.constEnd(); ++it) {
+            Image* const image= it.key();
+            if(written.contains(image))
+                ok= ok and image->_copyTiles(it.value(), inner, inner.topLeft() - outer.topLeft(), true, Event());
+            imgPool().release(instance.devId, outer.width(), outer.height(), image->_format, CL_MEM_READ_WRITE,
+                              it.value(), image->_devEvent);
+        }
+    }
+    if(!ok)
+        return false;
+
+    // The kernel may have written any image but the const ones, the device copies are now the valid ones
+    for(auto it= imageArgs.constBegin(); it != imageArgs.constEnd(); ++it) {
+        if(!readOnlyArgs.contains(it.key()))
+            it.value()->_devWritten(it.value()->_devEvent);
+    }
+    return true;
+}
+
+bool Kernel::enqueueRange(Instance& instance, QSize size, const QVector<cl_event>& waitList, Event* launch)
+{
+    if(size.isValid()) {
+        if(!instance.layoutVersion)
+            chooseLayout(instance, size, waitList);
+        instance.globalWorkSize[0]= roundUp(size.width(), instance.localWorkSize[0]);
+        instance.globalWorkSize[1]= roundUp(size.height(), instance.localWorkSize[1]);
+    }
+    if(instance.gridDim[0] and instance.gridDim[1]) {
+        instance.globalWorkSize[0]= instance.gridDim[0] * instance.localWorkSize[0];
+        instance.globalWorkSize[1]= instance.gridDim[1] * instance.localWorkSize[1];
+    }
+    if(!instance.globalWorkSize[0] or !instance.globalWorkSize[1]) {
+        qDebug() << "Kernel: no Image argument or layout to take the global size from.";
+        return false;
+    }
+
+    // The images of a batch are the third dimension, a work group never spans two of them
+    const size_t globalWorkSize[3] { instance.globalWorkSize[0], instance.globalWorkSize[1],
+                                     (size_t)qMax(instance.batchCount, 1) };
+    const size_t localWorkSize[3] { instance.localWorkSize[0], instance.localWorkSize[1], 1 };
+    cl_event event;
+    cl_int err= clEnqueueNDRangeKernel(instance.queue, instance.kernel, instance.batchCount ? 3 : layoutDim, nullptr,
+                                       globalWorkSize, localWorkSize,
+                                       waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+    if(checkCLError(err, "clEnqueueNDRangeKernel"))
+        return false;
+    *launch= Event(event);
+    profiler().record(_functionName, Profiler::Category::Kernel, instance.devId, *launch);
+    return true;
+}
+
+void Kernel::chooseLayout(Instance& instance, QSize imageSize, const QVector<cl_event>& waitList)
+{
+    // Same as the last launch
+    const QSize sizeClass= WorkSizeTuner::sizeClass(imageSize);
+    if(instance.devId == instance.layoutDevId and sizeClass == instance.layoutSizeClass)
+        return;
+
+    BlockDim workSize {{ 8, 8 }};
+    if(!wsTuner().find(_tuningKey, instance.devId, imageSize, &workSize) and wsTuner().enabled()) {
+        // Launches writing buffers may read them too, repeating them would change the result
+        if(instance.bufferArgs) {
+            qDebug() << "Kernel: not tuning" << _functionName << "because it has buffer arguments.";
+        } else if(tuneLayout(instance, imageSize, waitList, &workSize)) {
+            wsTuner().store(_tuningKey, instance.devId, imageSize, workSize);
+        }
+    }
+    instance.localWorkSize[0]= workSize[0];
+    instance.localWorkSize[1]= workSize[1];
+    instance.layoutDevId= instance.devId;
+    instance.layoutSizeClass= sizeClass;
+}
+
+bool Kernel::tuneLayout(Instance& instance, QSize imageSize, const QVector<cl_event>& waitList, BlockDim* best)
+{
+    const cl_device_id device= devMgr().device(instance.devId);
+    size_t maxGroupSize;
+    cl_int err= clGetKernelWorkGroupInfo(instance.kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxGroupSize),
+                                         &maxGroupSize, nullptr);
+    if(checkCLError(err, "clGetKernelWorkGroupInfo"))
+        return false;
+    size_t maxItemSizes[3];
+    err= clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItemSizes), maxItemSizes, nullptr);
+    if(checkCLError(err, "clGetDeviceInfo"))
+        return false;
+
+    // The pending commands using the images must not be timed
+    if(waitList.count()) {
+        err= clWaitForEvents(waitList.count(), waitList.data());
+        if(checkCLError(err, "clWaitForEvents"))
+            return false;
+    }
+
+    cl_ulong bestNs= 0;
+    foreach(const auto& candidate, WorkSizeTuner::candidates(maxGroupSize, maxItemSizes, imageSize)) {
+        // Same range as the launch, over all the images of a batch
+        const size_t globalWorkSize[3] { roundUp(imageSize.width(), candidate[0]),
+                                         roundUp(imageSize.height(), candidate[1]),
+                                         (size_t)qMax(instance.batchCount, 1) };
+        const size_t localWorkSize[3] { candidate[0], candidate[1], 1 };
+        cl_ulong fastestNs= 0;
+        for(int i=0; i<wsTuner().repetitions(); i++) {
+            // Some devices reject shapes within the limits (registers, local memory)
+            cl_event event;
+            if(clEnqueueNDRangeKernel(instance.queue, instance.kernel, instance.batchCount ? 3 : layoutDim, nullptr,
+                                      globalWorkSize, localWorkSize, 0, nullptr, &event) != CL_SUCCESS)
+                break;
+            const Event launch(event);
+            clFlush(instance.queue);
+            if(!launch.wait())
+                break;
+            const cl_ulong start= launch.profilingInfo(CL_PROFILING_COMMAND_START);
+            const cl_ulong end= launch.profilingInfo(CL_PROFILING_COMMAND_END);
+            const cl_ulong ns= end > start ? end - start : 1;
+            if(!fastestNs or ns < fastestNs)
+                fastestNs= ns;
+        }
+        if(fastestNs and (!bestNs or fastestNs < bestNs)) {
+            bestNs= fastestNs;
+            *best= candidate;
+        }
+    }
+    if(!bestNs) {
+        qDebug() << "Kernel: could not tune" << _functionName;
+        return false;
+    }
+    return true;
+}
 
 Kernel::~Kernel()
 {
     QMutexLocker locker(&_lock);
-    clReleaseKernel(_kernel);
+    // The instances of the threads are released now, the threads only keep empty ones
+    foreach(const QWeakPointer<Instance>& weak, _instances) {
+        const QSharedPointer<Instance> instance= weak.toStrongRef();
+        if(instance and instance->kernel) {
+            clReleaseKernel(instance->kernel);
+            instance->kernel= nullptr;
+            instance->retired= 1;
+        }
+    }
+    if(_kernel)
+        clReleaseKernel(_kernel);
 }
 
 } // namespace QCLI
@@ -18,18 +18,28 @@
 #include <QtCore>
 #include <CL/cl.h>
 #include <array>
+#include <type_traits>
+
+#include "image.h"
+#include "imagebatch.h"
+#include "util/utils.h"
 
 namespace QCLI {
 
+class PixelKernel;
+
 constexpr cl_uint layoutDim { 2 }; // 2D space, for image processing
-using BlockDim = array<size_t, 2>;
-using GridDim = array<size_t, 2>;
+using BlockDim = std::array<size_t, 2>;
+using GridDim = std::array<size_t, 2>;
     
 /// \brief OpenCL Kernel class
 /**
  * All methods are thread-safe
- * 
- * 
+ *
+ * Each thread launches its own copy of the cl_kernel, created the first time
+ * it uses the kernel, so threads sharing a Kernel set their arguments and
+ * launch it concurrently without locking each other. The arguments set with
+ * setArg() are only seen by the launches of the same thread.
 */
 
 class Kernel
@@ -50,50 +60,207 @@ public:
     bool loadSource(QString code);
     
     /// State of the created kernel
-    /// @retval false if the kernel failed to compile
-    bool isNull() const { return _initialized; }
+    /// @retval true if the kernel was not loaded or failed to compile
+    bool isNull() const { return !_initialized; }
     
-    /// Releases the OpenCL kernel
+    /// Releases the OpenCL kernel and its copies
     ~Kernel();
     
     /// Set the argument index of a kernel
     /// @retval false on error
     template<typename T>
-    bool setArg(int argIndex, T&& arg);
+    bool setArg(int argIndex, const T& arg);
+    /// Set an image as the argument index of a kernel
+    /// @retval false on error
+    bool setArg(int argIndex, Image& image);
+    /// Set an image only read by the kernel as the argument index of a kernel
+    /// The launch does not invalidate the host copy of the image
+    /// @retval false on error
+    bool setArg(int argIndex, const Image& image);
+    /// Set a batch of images as the argument index of a kernel
+    /// The launches with ImageBatch arguments run over a 3D range covering all the
+    /// images of the batch, the third dimension being the image (see ImageBatch)
+    /// @retval false on error
+    bool setArg(int argIndex, ImageBatch& batch);
     
-    /// Set the layout of execution
+    /// Set the layout of execution, instead of the tuned or default one
+    /// @param blockDim local work size
+    /// @param gridDim work groups in each dimension, {0, 0} to cover the last Image argument
+    /// (it can not be set for the launches over tiled images)
+    /// @retval false on error
+    bool setLayout(BlockDim blockDim, GridDim gridDim= GridDim {{ 0, 0 }});
+    /// Set the global size of the next launch of this thread, instead of the size of the
+    /// last Image argument, e.g. to run one work item per row
+    /// (it can not be set for the launches over tiled images)
     /// @retval false on error
-    bool setLayout(BlockDim blockDim, GridDim gridDim);
+    bool setRange(QSize size);
+
+    /// Returns the pixels read around each output pixel
+    int halo() const { return _halo; }
+    /// Set the pixels read around each output pixel (0 by default)
+    /// The launches with tiled Image arguments run once per tile. With a halo each
+    /// tile is first copied with its neighbour pixels to a temporary image, so the
+    /// kernel reads the same pixels as on the whole image.
+    /// @retval false if larger than Image::maxTileHalo
+    bool setHalo(int halo);
     
-    /// Execute the kernel
+    /// Execute the kernel with the arguments set with setArg
     /// @retval false on error
     bool operator()();
     
     /// Execute the kernel with the given parameters
+    /// The global size is taken from the ImageBatch arguments, or else from the last
+    /// Image argument, and the kernel runs
+    /// in the queue of the device of the first Image argument. Image arguments are
+    /// uploaded if needed and are assumed to be written by the kernel, unless they
+    /// are const.
     /// @retval false on error
     template<typename... Args>
-    bool operator()(Args... args);
+    bool operator()(Args&&... args);
+    /// Execute the kernel with a list of images as its arguments
+    /// @retval false on error
+    bool runImages(const QVector<Image*>& images);
     
+    /// Returns the name of the first __kernel function declared in source
+    /// @retval empty string if there is none
+    static QString kernelFunctionName(QString source);
+
+    /// Returns a per-pixel operation generated from an expression (see PixelKernel)
+    static PixelKernel perPixel(QString expression);
+
 private:
-    
-    template<int argN, typename First, typename... Rest>
-    bool setArguments(First arg0, Rest... rest);
-    
+    /// Copy of the kernel used by one thread, with its own arguments
+    struct Instance {
+        ~Instance() { if(kernel) clReleaseKernel(kernel); }
+
+        cl_kernel kernel= nullptr;
+        QAtomicInt retired;      // Set when the Kernel is destroyed, the entry can be pruned
+        // Image arguments of the next launch, indexed by argument index
+        QMap<int, Image*> imageArgs;
+        QSet<int> readOnlyArgs;  // Indexes of the const Image arguments
+        QSize batchSize;         // Size and count of the images of the ImageBatch arguments
+        int batchCount= 0;       // 0 if none
+        QSize range;             // Global size set with setRange() for the next launch
+        bool bufferArgs= false;  // Launches may not be repeatable to tune them
+        cl_command_queue queue= nullptr;
+        int devId= 0;            // Device of queue
+        size_t globalWorkSize[layoutDim] { 0, 0 };
+        size_t localWorkSize[layoutDim] { 8, 8 };
+        GridDim gridDim {{ 0, 0 }};
+        int layoutVersion= 0;    // Version of the setLayout() layout in use, 0 if none
+        int layoutDevId= -1;     // Device and size class of the chosen localWorkSize
+        QSize layoutSizeClass;
+    };
+    typedef QHash<int, QSharedPointer<Instance>> ThreadInstances;
+
+    /// Returns the instances of the calling thread, by kernel id
+    static QThreadStorage<ThreadInstances*>& threadInstances();
+    /// Returns a new kernel id
+    static int newId();
+    /// Returns the instance of the calling thread, creating it if needed
+    /// @retval nullptr on error
+    Instance* threadInstance();
+
+    bool setArguments(Instance&, int) { return true; }
+    template<typename First, typename... Rest>
+    bool setArguments(Instance& instance, int argIndex, First&& arg0, Rest&&... rest);
+
+    // Argument setters of an instance
     template<typename T>
-    void getImageSize(T&&);
+    bool setKernelArg(Instance& instance, int argIndex, const T& arg);
+    bool setKernelArg(Instance& instance, int argIndex, Image& image);
+    bool setKernelArg(Instance& instance, int argIndex, const Image& image);
+    bool setKernelArg(Instance& instance, int argIndex, ImageBatch& batch);
+
+    /// Enqueues an instance with its current arguments
+    bool enqueue(Instance& instance);
+    /// Enqueues an instance once per tile of its tiled Image arguments
+    bool enqueueTiles(Instance& instance);
+    /// Enqueues an instance over an image size, or the last global size if the size is not valid
+    /// The range is 3D over the images of the ImageBatch arguments, if any
+    /// @retval false on error
+    bool enqueueRange(Instance& instance, QSize size, const QVector<cl_event>& waitList, Event* launch);
+    /// Chooses the local work size of an instance for an image size, from the
+    /// WorkSizeTuner or tuning it now if enabled
+    void chooseLayout(Instance& instance, QSize imageSize, const QVector<cl_event>& waitList);
+    /// Times the candidate local work sizes with an instance
+    /// @retval false if no candidate could be timed
+    bool tuneLayout(Instance& instance, QSize imageSize, const QVector<cl_event>& waitList, BlockDim* best);
     
     // State
-    mutable QMutex _lock; // Mutable so it can be used in const getters
+    mutable QMutex _lock; // Protects the loading, the layout and _instances
     QAtomicInt _initialized;
     QAtomicInt _compiled;
+    const int _id { newId() }; // Key of the instances in the threads
     
     // OpenCL
-    size_t _globalWorkSize[layoutDim];
-    size_t _localWorkSize[layoutDim] { 8, 8 };
-    cl_kernel _kernel { nullptr };
-    
+    cl_kernel _kernel { nullptr }; // Loaded kernel, cloned by the instances
+    QString _functionName;         // Name of the launches in the profiler
+    QString _tuningKey;            // Function name and source hash, for the WorkSizeTuner
+
+    // Layout set with setLayout()
+    QAtomicInt _layoutVersion;     // Incremented by each setLayout()
+    BlockDim _blockDim {{ 8, 8 }};
+    GridDim _gridDim {{ 0, 0 }};
+    QAtomicInt _halo;              // Pixels read around each output pixel
+
+    /// Instances of the live threads, emptied when the kernel is destroyed
+    QList<QWeakPointer<Instance>> _instances;
 };
 
+//
+// Template implementation
+//
+
+template<typename T>
+bool Kernel::setArg(int argIndex, const T& arg)
+{
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+    Instance* instance= threadInstance();
+    return instance and setKernelArg(*instance, argIndex, arg);
+}
+
+template<typename T>
+bool Kernel::setKernelArg(Instance& instance, int argIndex, const T& arg)
+{
+    // Buffers may be read and written by the same launch
+    if(std::is_same<T, cl_mem>::value)
+        instance.bufferArgs= true;
+    cl_int err= clSetKernelArg(instance.kernel, argIndex, sizeof(T), (const void*)&arg);
+    return !checkCLError(err, QString("clSetKernelArg (index %1)").arg(argIndex).toStdString());
+}
+
+template<typename First, typename... Rest>
+bool Kernel::setArguments(Instance& instance, int argIndex, First&& arg0, Rest&&... rest)
+{
+    return setKernelArg(instance, argIndex, std::forward<First>(arg0))
+           and setArguments(instance, argIndex+1, std::forward<Rest>(rest)...);
+}
+
+template<typename... Args>
+bool Kernel::operator()(Args&&... args)
+{
+    if(isNull()) {
+        qDebug() << "No kernel loaded.";
+        return false;
+    }
+
+    // The instance of this thread is not shared, there is nothing to lock
+    Instance* instance= threadInstance();
+    if(!instance)
+        return false;
+
+    // 1) Set the kernel arguments
+    if(!setArguments(*instance, 0, std::forward<Args>(args)...))
+        return false;
+
+    // 2) Enqueue the kernel for execution
+    return enqueue(*instance);
+}
+
 } // namespace QCLI
 
-#endif // _QCLI_CONTEXT_H
+#endif // _QCLI_KERNEL_H
@@ -0,0 +1,82 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "kernelcache.h"
+
+#include "opencl/context.h"
+
+namespace QCLI {
+
+Kernel* KernelCache::kernel(const QString& owner, const QString& source, BlockDim blockDim, int halo)
+{
+    return kernel(owner, source, [&source]() { return source; }, blockDim, halo);
+}
+
+Kernel* KernelCache::kernel(const QString& owner, const QString& key, const std::function<QString()>& generate,
+                            BlockDim blockDim, int halo)
+{
+    {
+        QMutexLocker locker(&_lock);
+        const QSharedPointer<Kernel> kernel= _kernels.value(owner).value(key);
+        if(kernel)
+            return kernel->isNull() ? nullptr : kernel.data();
+    }
+
+    // Compile outside the lock, so the other kernels can be used meanwhile
+    const QString source= generate();
+    QSharedPointer<Kernel> kernel(source.isEmpty() ? new Kernel() : new Kernel(source));
+    if(kernel->isNull()) {
+        qDebug() << owner << ": could not compile" << Kernel::kernelFunctionName(source);
+    } else {
+        if(blockDim[0] and blockDim[1])
+            kernel->setLayout(blockDim);
+        kernel->setHalo(halo);
+    }
+
+    QMutexLocker locker(&_lock);
+    // Another thread may have compiled the same kernel in the meantime, the first one is kept
+    QSharedPointer<Kernel>& cached= _kernels[owner][key];
+    if(!cached)
+        cached= kernel;
+    return cached->isNull() ? nullptr : cached.data();
+}
+
+int KernelCache::count(const QString& owner) const
+{
+    QMutexLocker locker(&_lock);
+    return _kernels.value(owner).count();
+}
+
+//
+// Source snippets
+//
+
+QString KernelCache::pixelHeader(int channels)
+{
+    const bool luma= channels == 1;
+    return QString("#define PIXEL %1\n"
+                   "#define LOAD(image, pos) read_imagef(image, sampler, pos)%2\n"
+                   "#define STORE(image, pos, value) write_imagef(image, pos, (float4)(value))\n"
+                   "__constant sampler_t sampler= CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE |"
+                   " CLK_FILTER_NEAREST;\n")
+           .arg(luma ? "float" : "float4").arg(luma ? ".x" : "");
+}
+
+IFmt KernelCache::floatFormat(IFmt format, int devId)
+{
+    const IFmt floatFormat= iFmtChanCount(format) == 1 ? IFmt::LUMA32F : IFmt::ARGB32F;
+    return qcliCtx().supportedFormat(floatFormat, devId) ? floatFormat : format;
+}
+
+} // namespace QCLI
@@ -0,0 +1,97 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_KERNELCACHE_H
+#define _QCLI_KERNELCACHE_H
+
+#include <QtCore>
+#include <functional>
+
+#include "ifmt.h"
+#include "opencl/kernel.h"
+
+namespace QCLI {
+
+/** \brief Kernels generated at run time, compiled once and shared
+ *
+ *  PixelKernel, Convolution, Reduction and ImagePyramid generate the source of
+ *  their kernels from their parameters. The cache compiles each source once and
+ *  keeps the Kernel, which has one copy per thread, for the whole process:
+ *
+ *      Kernel* kernel= kernelCache().kernel("Convolution", source, BlockDim {{ 16, 16 }});
+ *      if(kernel and (*kernel)(src, dst)) ...
+ *
+ *  The kernels that fail to compile are cached too, so they are not recompiled
+ *  on every call. The snippets shared by the generated sources, like
+ *  pixelHeader(), are here too.
+ *
+ *  All functions are thread-safe.
+ */
+
+class KernelCache
+{
+public:
+    /// Static instance method (thread safe in C++11)
+    static KernelCache& instance() {
+        static KernelCache inst;
+        return inst;
+    }
+
+    /// Returns the kernel of a source, compiling it if it is not in the cache
+    /// @param owner name of the class generating the source, for the errors and count()
+    /// @param blockDim fixed work group size (see Kernel::setLayout()), {0, 0} for the tuned one
+    /// @param halo see Kernel::setHalo()
+    /// @retval nullptr if the kernel could not be compiled
+    Kernel* kernel(const QString& owner, const QString& source, BlockDim blockDim= BlockDim {{ 0, 0 }},
+                   int halo= 0);
+    /// Returns the kernel of a key, compiling the source returned by generate if it is
+    /// not in the cache, to skip the generation of the cached sources
+    /// @param generate returns the source, or an empty string if it can not be generated
+    /// @retval nullptr if the kernel could not be generated or compiled
+    Kernel* kernel(const QString& owner, const QString& key, const std::function<QString()>& generate,
+                   BlockDim blockDim= BlockDim {{ 0, 0 }}, int halo= 0);
+
+    /// Returns the number of kernels of an owner in the cache
+    int count(const QString& owner) const;
+
+    /// Returns the source defining the PIXEL type, the LOAD and STORE macros of the
+    /// images and their sampler, for images of 1 (float) or 4 (float4) channels
+    static QString pixelHeader(int channels);
+    /// Returns the float format with the channels of a format, to store intermediate
+    /// results that may be negative or out of range, or the format itself if the
+    /// device does not support it
+    static IFmt floatFormat(IFmt format, int devId);
+
+    /// Disable copying
+    KernelCache(const KernelCache& other) = delete;
+    /// Disable assignments
+    KernelCache& operator=(const KernelCache& other) = delete;
+
+private:
+    /// Hide constructor
+    KernelCache() = default;
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    /// Kernels of each owner, by key
+    QHash<QString, QHash<QString, QSharedPointer<Kernel>>> _kernels;
+};
+
+/// Global function to access the KernelCache
+inline
+KernelCache& kernelCache() { return KernelCache::instance(); }
+
+} // namespace QCLI
+
+#endif // _QCLI_KERNELCACHE_H
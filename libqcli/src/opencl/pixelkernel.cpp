@@ -0,0 +1,170 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "pixelkernel.h"
+
+#include <cassert>
+#include "graph.h"
+#include "opencl/kernelcache.h"
+#include "util/utils.h"
+
+namespace QCLI {
+
+// OpenCL type holding the value of a pixel of format
+static QString pixelType(IFmt format)
+{
+    return iFmtChanCount(format) == 1 ? "float" : "float4";
+}
+
+// Adds the trailing semicolon to one-liners
+static QString statement(QString expression)
+{
+    expression= expression.trimmed();
+    return expression.endsWith(";") ? expression : expression + ";";
+}
+
+PixelKernel::PixelKernel(QString expression)
+{
+    _expressions << statement(expression);
+    _extraInputs << 0;
+}
+
+PixelKernel PixelKernel::then(QString expression, int extraInputs) const
+{
+    assert(extraInputs >= 0);
+    PixelKernel ret(*this);
+    ret._expressions << statement(expression);
+    ret._extraInputs << extraInputs;
+    return ret;
+}
+
+QString PixelKernel::generateSource(const QVector<IFmt>& formats) const
+{
+    assert(!formats.isEmpty());
+    const int inputCount= formats.count() - 1;
+    const IFmt outFormat= formats.last();
+    const QString valueType= pixelType(outFormat);
+
+    // The first stage reads the inputs not taken by the later stages
+    int firstInputs= inputCount;
+    for(int i=1; i<_extraInputs.count(); i++)
+        firstInputs-= _extraInputs[i];
+    if(firstInputs < 0) {
+        qDebug() << "PixelKernel: not enough images for the stage inputs.";
+        return QString();
+    }
+
+    // Kernel header, the last argument is the output
+    QString source= "__kernel void qcli_perpixel(";
+    for(int i=0; i<inputCount; i++)
+        source+= QString("__read_only image2d_t in%1, ").arg(i);
+    source+= "__write_only image2d_t out)\n{\n";
+
+    source+= "    const int2 pos= (int2)(get_global_id(0), get_global_id(1));\n"
+             "    if(pos.x >= get_image_width(out) || pos.y >= get_image_height(out))\n"
+             "        return;\n"
+             "    const sampler_t sampler= CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE |"
+             " CLK_FILTER_NEAREST;\n";
+    // Value passed from one stage to the next one, kept in registers
+    source+= QString("    %1 value= 0.0f;\n").arg(valueType);
+
+    int nextInput= 0;
+    for(int stage=0; stage<_expressions.count(); stage++) {
+        source+= QString("    // Stage %1\n    {\n").arg(stage);
+
+        // x0 is the previous value, except for the first stage that reads all its inputs
+        const int stageInputs= stage ? _extraInputs[stage] : firstInputs;
+        int var= 0;
+        QString x0Type;
+        if(stage) {
+            source+= QString("        const %1 x0= value;\n").arg(valueType);
+            x0Type= valueType;
+            var= 1;
+        }
+        // Read the inputs, LUMA images only use the first component
+        for(int i=0; i<stageInputs; i++, var++, nextInput++) {
+            const QString type= pixelType(formats[nextInput]);
+            const bool luma= iFmtChanCount(formats[nextInput]) == 1;
+            source+= QString("        const %1 x%2= read_imagef(in%3, sampler, pos)%4;\n")
+                     .arg(type).arg(var).arg(nextInput).arg(luma ? ".x" : "");
+            if(!var)
+                x0Type= type;
+        }
+        if(var)
+            source+= QString("        const %1 x= x0;\n").arg(x0Type);
+
+        // The expression, in its own scope so it can declare temporaries
+        source+= QString("        %1 y= 0.0f;\n").arg(valueType);
+        source+= "        {\n            " + _expressions[stage] + "\n        }\n";
+        source+= "        value= y;\n    }\n";
+    }
+
+    // A float value is broadcast, LUMA images only store the first component
+    source+= "    write_imagef(out, pos, (float4)(value));\n}\n";
+    return source;
+}
+
+bool PixelKernel::runImages(const QVector<Image*>& images) const
+{
+    assert(!images.isEmpty());
+    Graph* graph= Graph::current();
+    return graph ? graph->record(*this, images) : launch(images);
+}
+
+bool PixelKernel::launch(const QVector<Image*>& images) const
+{
+    QVector<IFmt> formats;
+    foreach(const Image* image, images)
+        formats << image->format();
+
+    Kernel* kernel= cachedKernel(formats);
+    if(!kernel)
+        return false;
+    // Only the output is written, the inputs keep their host copy
+    const int output= images.count() - 1;
+    for(int i=0; i<output; i++) {
+        if(!kernel->setArg(i, static_cast<const Image&>(*images[i])))
+            return false;
+    }
+    return kernel->setArg(output, *images[output]) and (*kernel)();
+}
+
+int PixelKernel::cacheSize()
+{
+    return kernelCache().count("PixelKernel");
+}
+
+Kernel* PixelKernel::cachedKernel(const QVector<IFmt>& formats) const
+{
+    // The key is the signature of the stages, the arity and the formats of the images
+    QString key= QString::number(formats.count());
+    foreach(const IFmt format, formats)
+        key+= QString("|%1").arg((ifmt_t)format, 0, 16);
+    for(int i=0; i<_expressions.count(); i++)
+        key+= QString("\n%1:").arg(_extraInputs[i]) + _expressions[i];
+
+    // The source is only generated for the kernels that are not cached yet
+    return kernelCache().kernel("PixelKernel", key, [this, &formats]() { return generateSource(formats); });
+}
+
+//
+// Kernel factory
+//
+
+PixelKernel Kernel::perPixel(QString expression)
+{
+    return PixelKernel(expression);
+}
+
+} // namespace QCLI
@@ -0,0 +1,126 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_PIXELKERNEL_H
+#define _QCLI_PIXELKERNEL_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+#include "image.h"
+#include "opencl/kernel.h"
+
+namespace QCLI {
+
+/** \brief Per-pixel operation generated from an expression
+ *
+ *  The expression is wrapped in a __kernel that reads every image but the last
+ *  one at the current pixel, and writes the last image:
+ *
+ *      Kernel::perPixel("y= 2.0f * x;").run(input, output);
+ *
+ *  Variables available in the expression:
+ *   - x0, x1, ...: value of the input images (x is an alias of x0)
+ *   - y: value written to the output image, initialized to zero
+ *   - pos: int2 coordinates of the pixel
+ *  Values are float4 (r, g, b, a) for ARGB formats and float for LUMA formats,
+ *  normalized to [0..1] for the integer formats.
+ *
+ *  Several operations can be fused into a single launch with then(). The y of
+ *  each stage is kept in registers and becomes the x of the next one, so the
+ *  chain reads and writes global memory once instead of once per stage:
+ *
+ *      Kernel::perPixel("y= x * 1.5f;")
+ *          .then("y= pow(x, 1.0f/2.2f);")
+ *          .then("y= mix(x0, x1, 0.5f);", 1)  // Blends with another image
+ *          .run(input, blendImage, output);
+ *
+ *  The intermediate values have the type of the output image.
+ *
+ *  Separate run() calls are launched right away, each one reading and writing
+ *  global memory. They are only fused automatically when recorded by a Graph,
+ *  which builds the then() chains of the operations whose intermediate images
+ *  are not used elsewhere (see Graph).
+ *
+ *  The generated kernels are compiled once per (stages, arity, formats) and
+ *  shared by all the PixelKernel objects, so creating a PixelKernel is cheap.
+ *
+ *  All methods are thread-safe.
+ */
+
+class PixelKernel
+{
+    // Graph fuses and launches the recorded operations
+    friend class Graph;
+public:
+    /// Creates an operation from an expression, nothing is compiled until it runs
+    explicit PixelKernel(QString expression);
+
+    /// Returns the per-pixel expression of the first stage
+    QString expression() const { return _expressions.first(); }
+
+    /// Returns a copy of the operation with another stage fused after the last one
+    /// The x (x0) of the new stage is the y of the previous stage, and x1, x2, ... are
+    /// extraInputs more images, passed to run() after the inputs of the previous stages
+    PixelKernel then(QString expression, int extraInputs= 0) const;
+    /// Returns the number of fused stages
+    int stageCount() const { return _expressions.count(); }
+
+    /// Runs the operation, the last image is the output
+    /// @retval false on error (including compilation errors)
+    template<typename... Images>
+    bool run(Images&... images);
+    /// Same as run()
+    template<typename... Images>
+    bool operator()(Images&... images) { return run(images...); }
+    /// Runs the operation over a list of images, the last image is the output
+    /// If a Graph is recording in this thread the operation is deferred to it
+    /// @retval false on error
+    bool runImages(const QVector<Image*>& images) const;
+
+    /// Returns the kernel source generated for the stages and the formats of the
+    /// images (the last one is the output)
+    /// @retval empty string if the formats do not match the stage inputs
+    QString generateSource(const QVector<IFmt>& formats) const;
+    /// Returns the number of kernels in the cache
+    static int cacheSize();
+
+private:
+    /// Launches the operation right away
+    bool launch(const QVector<Image*>& images) const;
+    /// Returns the kernel for the stages and the image formats, compiling it if
+    /// it is not in the cache
+    /// @retval nullptr if the kernel could not be compiled
+    Kernel* cachedKernel(const QVector<IFmt>& formats) const;
+
+    /// Per-pixel expression of each stage
+    QStringList _expressions;
+    /// Extra inputs of each stage (the first stage reads all the remaining images)
+    QVector<int> _extraInputs;
+};
+
+template<typename... Images>
+bool PixelKernel::run(Images&... images)
+{
+    static_assert(sizeof...(Images) >= 1, "PixelKernel::run needs at least the output image");
+
+    QVector<Image*> list;
+    for(Image* image: { &images... })
+        list << image;
+    return runImages(list);
+}
+
+} // namespace QCLI
+
+#endif // _QCLI_PIXELKERNEL_H
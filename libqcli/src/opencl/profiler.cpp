@@ -0,0 +1,245 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "profiler.h"
+
+#include <cmath>
+#include "util/utils.h"
+#include "opencl/devicemanager.h"
+
+namespace QCLI {
+
+// Histogram buckets, the last one reaches 2^31 us (35 minutes)
+static const int bucketCount= 32;
+
+static const char* categoryNames[]= { "kernel", "upload", "download" };
+
+// Returns a string as a JSON string literal
+static QByteArray jsonString(const QString& string)
+{
+    const QByteArray utf8= string.toUtf8();
+    QByteArray ret= "\"";
+    for(int i=0; i<utf8.size(); i++) {
+        const char c= utf8[i];
+        if(c == '"' or c == '\\')
+            ret+= '\\';
+        if((unsigned char)c < 0x20)
+            ret+= QString("\\u%1").arg((int)c, 4, 16, QChar('0')).toLatin1();
+        else
+            ret+= c;
+    }
+    return ret + "\"";
+}
+
+QString Profiler::categoryName(Category category)
+{
+    return categoryNames[(int)category];
+}
+
+double Profiler::Histogram::percentileMs(double p) const
+{
+    const qint64 rank= qMax((qint64)1, (qint64)ceil(count * qBound(0.0, p, 100.0) / 100.0));
+    qint64 seen= 0;
+    for(int i=0; i<buckets.count(); i++) {
+        seen+= buckets[i];
+        if(seen >= rank)
+            return qMin((double)(1ll << i) * 1e-3, maxMs);
+    }
+    return maxMs;
+}
+
+Profiler::Profiler()
+{
+    _enabled= false;
+    _sampling= 1;
+    _counter= 0;
+    _maxRecords= 100000;
+}
+
+void Profiler::setMaxRecords(int count)
+{
+    QMutexLocker locker(&_lock);
+    // Keep the newest records
+    const QVector<Record> ordered= _records.mid(_nextRecord) + _records.mid(0, _nextRecord);
+    _maxRecords= qMax(count, 0);
+    _records= ordered.mid(qMax(ordered.count() - _maxRecords, 0));
+    _nextRecord= 0;
+}
+
+void Profiler::_record(const QString& name, Category category, int devId, const Event& event, qint64 bytes)
+{
+    Pending* pending= new Pending { this, Record { name, category, devId, bytes, 0, 0, 0, 0 } };
+    {
+        QMutexLocker locker(&_lock);
+        _pending++;
+    }
+    cl_int err= clSetEventCallback(event.clEvent(), CL_COMPLETE, &Profiler::_completed, pending);
+    if(checkCLError(err, "clSetEventCallback")) {
+        delete pending;
+        QMutexLocker locker(&_lock);
+        _pending--;
+        _timed.wakeAll();
+    }
+}
+
+void CL_CALLBACK Profiler::_completed(cl_event event, cl_int status, void* data)
+{
+    Pending* pending= static_cast<Pending*>(data);
+    Profiler* const self= pending->profiler;
+    Record& record= pending->record;
+
+    // Failed commands and queues without profiling are not timed
+    bool ok= status == CL_COMPLETE;
+    const cl_profiling_info params[4] { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+                                        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+    cl_ulong* const values[4] { &record.queued, &record.submit, &record.start, &record.end };
+    for(int i=0; i<4 and ok; i++)
+        ok= clGetEventProfilingInfo(event, params[i], sizeof(cl_ulong), values[i], nullptr) == CL_SUCCESS;
+    if(ok)
+        self->_add(record);
+    delete pending;
+
+    QMutexLocker locker(&self->_lock);
+    self->_pending--;
+    self->_timed.wakeAll();
+}
+
+void Profiler::_add(const Record& record)
+{
+    const double us= record.end > record.start ? (record.end - record.start) * 1e-3 : 0.0;
+
+    QMutexLocker locker(&_lock);
+    if(_maxRecords) {
+        if(_records.count() < _maxRecords) {
+            _records << record;
+        } else {
+            _records[_nextRecord]= record;
+            _nextRecord= (_nextRecord + 1) % _maxRecords;
+        }
+    }
+
+    Histogram& histogram= _histograms[record.name];
+    if(!histogram.count) {
+        histogram.totalMs= 0.0;
+        histogram.minMs= histogram.maxMs= us * 1e-3;
+        histogram.buckets.fill(0, bucketCount);
+    }
+    histogram.count++;
+    histogram.totalMs+= us * 1e-3;
+    histogram.minMs= qMin(histogram.minMs, us * 1e-3);
+    histogram.maxMs= qMax(histogram.maxMs, us * 1e-3);
+    int bucket= 0;
+    while(bucket < bucketCount-1 and (double)(1ll << bucket) <= us)
+        bucket++;
+    histogram.buckets[bucket]++;
+}
+
+void Profiler::sync()
+{
+    // The callbacks only run once the commands are submitted
+    for(int i=0; i<devMgr().devCount(); i++)
+        devMgr().flush(i);
+    QMutexLocker locker(&_lock);
+    while(_pending)
+        _timed.wait(&_lock);
+}
+
+void Profiler::clear()
+{
+    QMutexLocker locker(&_lock);
+    _records.clear();
+    _nextRecord= 0;
+    _histograms.clear();
+}
+
+QVector<Profiler::Record> Profiler::records() const
+{
+    QMutexLocker locker(&_lock);
+    return _records.mid(_nextRecord) + _records.mid(0, _nextRecord);
+}
+
+QHash<QString, Profiler::Histogram> Profiler::histograms() const
+{
+    QMutexLocker locker(&_lock);
+    return _histograms;
+}
+
+QByteArray Profiler::chromeTrace() const
+{
+    const QVector<Record> all= records();
+
+    // Each device clock starts at its first record
+    QMap<int, cl_ulong> origins;
+    foreach(const Record& record, all) {
+        if(!origins.contains(record.devId) or record.queued < origins[record.devId])
+            origins[record.devId]= record.queued;
+    }
+
+    QByteArray json= "{\"traceEvents\":[\n";
+    bool first= true;
+    auto add= [&](const QByteArray& event) {
+        if(!first)
+            json+= ",\n";
+        json+= event;
+        first= false;
+    };
+
+    // Names of the processes and threads
+    foreach(const int devId, origins.keys()) {
+        add(QString("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%1,\"args\":{\"name\":\"Device %1\"}}")
+            .arg(devId).toUtf8());
+        for(int i=0; i<3; i++) {
+            add(QString("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%1,\"tid\":%2,\"args\":{\"name\":\"%3\"}}")
+                .arg(devId).arg(i).arg(categoryNames[i]).toUtf8());
+        }
+    }
+
+    // Complete events, in us
+    foreach(const Record& record, all) {
+        const cl_ulong origin= origins[record.devId];
+        const double start= (record.start - origin) * 1e-3;
+        const double duration= record.end > record.start ? (record.end - record.start) * 1e-3 : 0.0;
+        const double queued= record.start > record.queued ? (record.start - record.queued) * 1e-3 : 0.0;
+        const double submitted= record.start > record.submit ? (record.start - record.submit) * 1e-3 : 0.0;
+        QByteArray event= "{\"name\":" + jsonString(record.name);
+        event+= QString(",\"cat\":\"%1\",\"ph\":\"X\",\"pid\":%2,\"tid\":%3,\"ts\":%4,\"dur\":%5")
+                .arg(categoryNames[(int)record.category]).arg(record.devId).arg((int)record.category)
+                .arg(start, 0, 'f', 3).arg(duration, 0, 'f', 3).toUtf8();
+        event+= QString(",\"args\":{\"queuedUs\":%1,\"submittedUs\":%2")
+                .arg(queued, 0, 'f', 3).arg(submitted, 0, 'f', 3).toUtf8();
+        if(record.bytes)
+            event+= QString(",\"bytes\":%1").arg(record.bytes).toUtf8();
+        add(event + "}}");
+    }
+
+    json+= "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return json;
+}
+
+bool Profiler::writeChromeTrace(const QString& fileName) const
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug() << "Profiler: could not open" << fileName;
+        return false;
+    }
+    const QByteArray trace= chromeTrace();
+    if(file.write(trace) != trace.size()) {
+        qDebug() << "Profiler: could not write" << fileName;
+        return false;
+    }
+    return true;
+}
+
+} // namespace QCLI
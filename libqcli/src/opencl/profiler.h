@@ -0,0 +1,176 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_PROFILER_H
+#define _QCLI_PROFILER_H
+
+#include <QtCore>
+#include <CL/cl.h>
+
+#include "opencl/event.h"
+
+namespace QCLI {
+
+/** \brief Device timings of the kernel launches and transfers
+ *
+ *  When enabled, every kernel launch, upload and download is timed with the
+ *  OpenCL profiling counters of its event. The timestamps are read by an event
+ *  callback once the command completes, so recording never blocks:
+ *
+ *      profiler().setEnabled(true);
+ *      ... run the pipeline ...
+ *      profiler().sync();
+ *      profiler().writeChromeTrace("trace.json"); // Open in chrome://tracing
+ *
+ *  Each operation adds a Record, the latest maxRecords() are kept for the trace,
+ *  and a running Histogram of the durations per name (kernel function name,
+ *  "upload" or "download"), kept for all the operations.
+ *
+ *  With setSampling(n) only one operation in n is timed, so the profiler can
+ *  stay on in production: the overhead of the other ones is an atomic increment.
+ *  A disabled profiler costs an atomic read per operation.
+ *
+ *  All functions are thread-safe.
+ */
+
+class Profiler
+{
+public:
+    /// Kind of operation, each one is a separate lane of the trace
+    enum class Category {
+        Kernel,
+        Upload,
+        Download
+    };
+
+    /// Timed operation, timestamps in ns of the device clock
+    struct Record {
+        QString name;
+        Category category;
+        int devId;
+        qint64 bytes;    // Bytes transferred, 0 for kernels
+        cl_ulong queued; // CL_PROFILING_COMMAND_QUEUED
+        cl_ulong submit; // CL_PROFILING_COMMAND_SUBMIT
+        cl_ulong start;  // CL_PROFILING_COMMAND_START
+        cl_ulong end;    // CL_PROFILING_COMMAND_END
+    };
+
+    /// Durations of the operations of a name
+    struct Histogram {
+        qint64 count;
+        double totalMs;
+        double minMs;
+        double maxMs;
+        QVector<qint64> buckets; // Bucket i counts the durations in [2^(i-1), 2^i) us, 0 below 1 us
+
+        /// Returns the average duration in ms
+        double averageMs() const { return count ? totalMs / count : 0.0; }
+        /// Returns an upper bound of the duration of percentile p (0..100) in ms, from the buckets
+        double percentileMs(double p) const;
+    };
+
+    /// Static instance method (thread safe in C++11)
+    static Profiler& instance() {
+        static Profiler inst;
+        return inst;
+    }
+
+    /// Returns true if the operations are timed
+    bool enabled() const { return _enabled; }
+    /// Enables the timing of the operations, disabled by default
+    void setEnabled(bool enabled) { _enabled= enabled; }
+    /// Returns the sampling interval, one operation in sampling() is timed
+    int sampling() const { return _sampling; }
+    /// Times one operation in every operations, 1 (the default) times them all
+    void setSampling(int every) { _sampling= qMax(every, 1); }
+    /// Returns the maximum number of records kept for the trace
+    int maxRecords() const { QMutexLocker l(&_lock); return _maxRecords; }
+    /// Sets the maximum number of records kept for the trace, the oldest ones are dropped
+    void setMaxRecords(int count);
+
+    /// Times the command of event, called by the operations of the library
+    /// The queue of the command must have CL_QUEUE_PROFILING_ENABLE
+    void record(const QString& name, Category category, int devId, const Event& event, qint64 bytes= 0) {
+        if(_enabled and !event.isNull() and (unsigned)_counter.fetchAndAddRelaxed(1) % (unsigned)_sampling == 0)
+            _record(name, category, devId, event, bytes);
+    }
+    /// Times a transfer, named after its category
+    void record(Category category, int devId, const Event& event, qint64 bytes) {
+        if(_enabled and !event.isNull() and (unsigned)_counter.fetchAndAddRelaxed(1) % (unsigned)_sampling == 0)
+            _record(categoryName(category), category, devId, event, bytes);
+    }
+    /// Returns the name of a category ("kernel", "upload" or "download")
+    static QString categoryName(Category category);
+
+    /// Flushes the device queues and waits until the recorded commands are timed
+    void sync();
+    /// Discards the records and histograms
+    void clear();
+
+    /// Returns the kept records, the oldest first
+    QVector<Record> records() const;
+    /// Returns the histograms of the timed operations, by name
+    QHash<QString, Histogram> histograms() const;
+
+    /// Returns the kept records as a Chrome trace_event JSON document
+    /// Each device is a process, with a thread per category. The devices have
+    /// independent clocks, the timestamps of each one start at its first record.
+    QByteArray chromeTrace() const;
+    /// Writes chromeTrace() to a file
+    /// @retval false on error
+    bool writeChromeTrace(const QString& fileName) const;
+
+    /// Disable copying
+    Profiler(const Profiler& other) = delete;
+    /// Disable assignments
+    Profiler& operator=(const Profiler& other) = delete;
+
+private:
+    /// Hide constructor
+    Profiler();
+
+    /// Record waiting for its command to complete
+    struct Pending {
+        Profiler* profiler;
+        Record record;
+    };
+
+    /// Sets a callback reading the timestamps of the command
+    void _record(const QString& name, Category category, int devId, const Event& event, qint64 bytes);
+    /// Event callback of the recorded commands
+    static void CL_CALLBACK _completed(cl_event event, cl_int status, void* pending);
+    /// Adds a timed record
+    void _add(const Record& record);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QWaitCondition _timed;
+    QAtomicInt _enabled;
+    QAtomicInt _sampling;
+    QAtomicInt _counter;
+    int _pending= 0; // Callbacks not called yet
+
+    int _maxRecords;
+    QVector<Record> _records;
+    int _nextRecord= 0; // Oldest record once _records is full
+    QHash<QString, Histogram> _histograms;
+};
+
+/// Global function to access the Profiler
+inline
+Profiler& profiler() { return Profiler::instance(); }
+
+} // namespace QCLI
+
+#endif // _QCLI_PROFILER_H
@@ -0,0 +1,261 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "programmanager.h"
+
+#include <cassert>
+#include "util/utils.h"
+#include "opencl/context.h"
+#include "opencl/devicemanager.h"
+
+namespace QCLI {
+
+// Header of the cached binary files, bump the version if the layout changes
+static const QByteArray binaryMagic("QCLIBIN1");
+
+ProgramManager::ProgramManager()
+{
+    _diskCache= true;
+
+    // Default cache directory
+    QString path= QString::fromLocal8Bit(qgetenv("QCLI_CACHE_DIR"));
+    if(path.isEmpty()) {
+        const QString xdgCache= QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+        path= xdgCache.isEmpty() ? QDir::homePath() + "/.cache/qcli" : xdgCache + "/qcli";
+    }
+    setCacheDir(path);
+}
+
+ProgramManager::~ProgramManager()
+{
+    QMutexLocker locker(&_lock);
+    foreach(const auto& program, _programs)
+        clReleaseProgram(program);
+}
+
+void ProgramManager::setCacheDir(QString path)
+{
+    if(!QDir().mkpath(path))
+        qDebug() << "ProgramManager: could not create cache dir" << path;
+    QMutexLocker locker(&_lock);
+    _cacheDir= path;
+}
+
+bool ProgramManager::clearDiskCache()
+{
+    QDir dir(cacheDir());
+    bool ok= true;
+    foreach(const QString& file, dir.entryList(QStringList() << "*.bin", QDir::Files))
+        ok= dir.remove(file) and ok;
+    return ok;
+}
+
+cl_program ProgramManager::program(QString source, QString options)
+{
+    const QByteArray sourceData= source.toUtf8();
+    const QByteArray optionsData= options.toUtf8();
+    const QByteArray sourceHash= QCryptographicHash::hash(sourceData, QCryptographicHash::Sha1);
+    const QByteArray key= sourceHash + optionsData;
+
+    // Fast path, the program was already built by this process
+    {
+        QMutexLocker locker(&_lock);
+        if(_programs.contains(key))
+            return _programs[key];
+    }
+
+    // The context must be ready before listing the selected devices
+    const cl_context context= clCtx();
+    if(!context)
+        return nullptr;
+
+    // Try the cached binaries first, built outside the lock since it is slow
+    QStringList paths;
+    if(_diskCache) {
+        foreach(const cl_device_id& device, devMgr().devices())
+            paths << binaryPath(sourceHash, device, optionsData);
+    }
+    cl_program program= paths.isEmpty() ? nullptr : buildFromBinaries(paths, optionsData);
+    if(!program) {
+        program= buildFromSource(sourceData, optionsData);
+        if(!program)
+            return nullptr;
+        if(_diskCache)
+            storeBinaries(program, paths);
+    }
+
+    QMutexLocker locker(&_lock);
+    // Another thread may have built the same program in the meantime
+    if(_programs.contains(key)) {
+        clReleaseProgram(program);
+        return _programs[key];
+    }
+    _programs.insert(key, program);
+    return program;
+}
+
+cl_program ProgramManager::programFromFile(QString fileName, QString options)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "ProgramManager: could not open" << fileName;
+        return nullptr;
+    }
+    return program(QString::fromUtf8(file.readAll().constData()), options);
+}
+
+cl_kernel ProgramManager::kernel(QString source, QString functionName, QString options)
+{
+    const cl_program prog= program(source, options);
+    if(!prog)
+        return nullptr;
+
+    cl_int err;
+    cl_kernel kernel= clCreateKernel(prog, functionName.toLatin1().constData(), &err);
+    if(checkCLError(err, "clCreateKernel"))
+        return nullptr;
+    return kernel;
+}
+
+QString ProgramManager::binaryPath(const QByteArray& sourceHash, cl_device_id device,
+                                   const QByteArray& options)
+{
+    // The binary depends on the device and on the compiler that generated it
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(sourceHash);
+    hash.addData(clDeviceString(device, CL_DEVICE_NAME).toUtf8());
+    hash.addData(clDeviceString(device, CL_DRIVER_VERSION).toUtf8());
+    hash.addData(options);
+    return QDir(cacheDir()).filePath(QString::fromLatin1(hash.result().toHex()) + ".bin");
+}
+
+cl_program ProgramManager::buildFromBinaries(const QStringList& paths, const QByteArray& options)
+{
+    const auto devs= devMgr().devices();
+    assert(devs.count() == paths.count());
+
+    // Read the binaries of all devices, all of them must be cached
+    QVector<QByteArray> binaries;
+    foreach(const QString& path, paths) {
+        QFile file(path);
+        if(!file.open(QIODevice::ReadOnly))
+            return nullptr;
+        const QByteArray data= file.readAll();
+        if(!data.startsWith(binaryMagic.constData()) or data.size() <= binaryMagic.size())
+            return nullptr;
+        binaries << data.mid(binaryMagic.size());
+    }
+
+    QVector<size_t> sizes;
+    QVector<const unsigned char*> ptrs;
+    foreach(const QByteArray& binary, binaries) {
+        sizes << binary.size();
+        ptrs << reinterpret_cast<const unsigned char*>(binary.constData());
+    }
+
+    cl_int err;
+    QVector<cl_int> binaryStatus(devs.count());
+    cl_program program= clCreateProgramWithBinary(clCtx(), devs.count(), devs.data(), sizes.data(),
+                                                  ptrs.data(), binaryStatus.data(), &err);
+    bool rejected= err != CL_SUCCESS;
+    foreach(const cl_int& status, binaryStatus)
+        rejected= rejected or status != CL_SUCCESS;
+    // Binaries must be built too, this fails if they were generated by another driver
+    if(!rejected)
+        rejected= clBuildProgram(program, devs.count(), devs.data(), options.constData(),
+                                 nullptr, nullptr) != CL_SUCCESS;
+
+    if(rejected) {
+        qDebug() << "ProgramManager: cached binary rejected, building from source.";
+        if(program)
+            clReleaseProgram(program);
+        // Remove the stale binaries, they will be replaced after the source build
+        foreach(const QString& path, paths)
+            QFile::remove(path);
+        return nullptr;
+    }
+    return program;
+}
+
+cl_program ProgramManager::buildFromSource(const QByteArray& source, const QByteArray& options)
+{
+    cl_int err;
+    const char* sourcePtr= source.constData();
+    const size_t sourceSize= source.size();
+    cl_program program= clCreateProgramWithSource(clCtx(), 1, &sourcePtr, &sourceSize, &err);
+    if(checkCLError(err, "clCreateProgramWithSource"))
+        return nullptr;
+
+    const auto devs= devMgr().devices();
+    err= clBuildProgram(program, devs.count(), devs.data(), options.constData(), nullptr, nullptr);
+    if(checkCLError(err, "clBuildProgram")) {
+        // Print the build log of each device
+        foreach(const cl_device_id& device, devs) {
+            size_t logSize= 0;
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+            QByteArray log(logSize, '\0');
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log.data(), nullptr);
+            qDebug() << "Build log for" << clDeviceString(device, CL_DEVICE_NAME) << ":\n"
+                     << log.constData();
+        }
+        clReleaseProgram(program);
+        return nullptr;
+    }
+    return program;
+}
+
+void ProgramManager::storeBinaries(cl_program program, const QStringList& paths)
+{
+    cl_uint devCount;
+    cl_int err= clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(devCount), &devCount, nullptr);
+    if(checkCLError(err, "clGetProgramInfo") or (int)devCount != paths.count())
+        return;
+
+    QVector<size_t> sizes(devCount);
+    err= clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, devCount*sizeof(size_t), sizes.data(), nullptr);
+    if(checkCLError(err, "clGetProgramInfo"))
+        return;
+
+    QVector<QByteArray> binaries(devCount);
+    QVector<unsigned char*> ptrs(devCount);
+    for(cl_uint i=0; i<devCount; i++) {
+        binaries[i].resize(sizes[i]);
+        ptrs[i]= reinterpret_cast<unsigned char*>(binaries[i].data());
+    }
+    err= clGetProgramInfo(program, CL_PROGRAM_BINARIES, devCount*sizeof(unsigned char*), ptrs.data(), nullptr);
+    if(checkCLError(err, "clGetProgramInfo"))
+        return;
+
+    for(cl_uint i=0; i<devCount; i++) {
+        // Some runtimes do not provide binaries
+        if(!sizes[i])
+            continue;
+        // Write to a temporary file and rename it, so concurrent processes never
+        // read a partially written binary
+        const QString tmpPath= QString("%1.%2.tmp").arg(paths[i]).arg(QCoreApplication::applicationPid());
+        QFile file(tmpPath);
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qDebug() << "ProgramManager: could not write" << tmpPath;
+            continue;
+        }
+        const bool written= file.write(binaryMagic) == binaryMagic.size() and
+                            file.write(binaries[i]) == binaries[i].size();
+        file.close();
+        // If rename fails the binary was already stored by another process
+        if(!written or !QFile::rename(tmpPath, paths[i]))
+            QFile::remove(tmpPath);
+    }
+}
+
+} // namespace QCLI
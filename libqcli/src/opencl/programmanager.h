@@ -0,0 +1,109 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_PROGRAMMANAGER_H
+#define _QCLI_PROGRAMMANAGER_H
+
+#include <QtCore>
+#include <CL/cl.h>
+
+namespace QCLI {
+
+/** \brief Builds and caches OpenCL programs
+ *
+ *  Programs are built for all the selected devices and kept in memory for the
+ *  lifetime of the process. The binaries returned by CL_PROGRAM_BINARIES are
+ *  also stored in a cache directory, so later processes can skip the source
+ *  build with clCreateProgramWithBinary. A binary is keyed by the source hash,
+ *  the device name, the driver version and the build options; a binary rejected
+ *  by the runtime is discarded and the program is built from source again.
+ *
+ *  The cache directory is taken from $QCLI_CACHE_DIR, then $XDG_CACHE_HOME/qcli
+ *  and finally ~/.cache/qcli.
+ *
+ *  All functions are thread-safe.
+ */
+
+class ProgramManager
+{
+public:
+    ~ProgramManager();
+
+    /// Static instance method (thread safe in C++11)
+    static ProgramManager& instance() {
+        static ProgramManager inst;
+        return inst;
+    }
+
+    /// Returns the program built from source with the build options
+    /// The program is owned by the manager, do not release it
+    /// @retval nullptr on error
+    cl_program program(QString source, QString options= QString());
+    /// Returns the program built from the source file fileName
+    /// @retval nullptr on error
+    cl_program programFromFile(QString fileName, QString options= QString());
+
+    /// Creates a kernel for functionName of the program built from source
+    /// The caller owns the kernel and must release it with clReleaseKernel
+    /// @retval nullptr on error
+    cl_kernel kernel(QString source, QString functionName, QString options= QString());
+
+    /// Returns the directory used to store the program binaries
+    QString cacheDir() const { QMutexLocker l(&_lock); return _cacheDir; }
+    /// Sets the directory used to store the program binaries (created if needed)
+    void setCacheDir(QString path);
+    /// Returns true if the binaries are read and written from the cache directory
+    bool diskCache() const { return _diskCache; }
+    /// Enables or disables the on-disk binary cache (enabled by default)
+    void setDiskCache(bool enabled) { _diskCache= enabled; }
+    /// Removes all the binaries stored in the cache directory
+    /// @retval false if a file could not be removed
+    bool clearDiskCache();
+
+    /// Disable copying
+    ProgramManager(const ProgramManager& other) = delete;
+    /// Disable assignments
+    ProgramManager& operator=(const ProgramManager& other) = delete;
+
+private:
+    /// Hide constructor
+    ProgramManager();
+
+    /// Returns the cache file path of the binary of a program for a device
+    QString binaryPath(const QByteArray& sourceHash, cl_device_id device, const QByteArray& options);
+    /// Creates and builds a program from the cached binaries of all devices
+    /// @retval nullptr if a binary is missing or rejected
+    cl_program buildFromBinaries(const QStringList& paths, const QByteArray& options);
+    /// Creates and builds a program from source
+    /// @retval nullptr on error
+    cl_program buildFromSource(const QByteArray& source, const QByteArray& options);
+    /// Writes the binaries of a built program to the cache paths (one per device)
+    void storeBinaries(cl_program program, const QStringList& paths);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QAtomicInt _diskCache;
+    QString _cacheDir;
+
+    /// Built programs, indexed by the hash of the source and the options
+    QHash<QByteArray, cl_program> _programs;
+};
+
+/// Global function to access the ProgramManager
+inline
+ProgramManager& prgMng() { return ProgramManager::instance(); }
+
+} // namespace QCLI
+
+#endif // _QCLI_PROGRAMMANAGER_H
@@ -0,0 +1,418 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "reduction.h"
+
+#include <climits>
+#include <cmath>
+#include "opencl/devicemanager.h"
+#include "opencl/imagepool.h"
+#include "opencl/kernel.h"
+#include "opencl/kernelcache.h"
+#include "opencl/profiler.h"
+#include "util/utils.h"
+
+namespace QCLI {
+
+// Work groups of the reductions, each work item visits the pixels of a grid
+// the size of all the work items
+static const int groupWidth= 16;
+static const int groupHeight= 16;
+
+const int Reduction::maxGroups;
+const int Reduction::maxBins;
+
+// Types and loads of the pixels, and the loop over the pixels of a work item
+static QString reductionHeader(int channels)
+{
+    const bool luma= channels == 1;
+    return KernelCache::pixelHeader(channels)
+           + QString("#define CHANNELS %1\n"
+                     "#define INDEX %2\n"
+                     "#define CONVERT_INDEX %3\n"
+                     "#define STORE_PIXEL(value, i, buffer) %4\n"
+                     "#define GROUP_WIDTH %5\n"
+                     "#define GROUP_HEIGHT %6\n"
+                     "#define GROUP_SIZE (GROUP_WIDTH * GROUP_HEIGHT)\n"
+                     "#define GROUP_ID (get_group_id(1) * get_num_groups(0) + get_group_id(0))\n"
+                     "#define LOCAL_ID (get_local_id(1) * GROUP_WIDTH + get_local_id(0))\n"
+                     "#define FOR_EACH_PIXEL(image, x, y) \\\n"
+                     "    for(int y= get_global_id(1); y < get_image_height(image); y+= get_global_size(1)) \\\n"
+                     "        for(int x= get_global_id(0); x < get_image_width(image); x+= get_global_size(0))\n")
+             .arg(channels).arg(luma ? "int" : "int4").arg(luma ? "convert_int_sat" : "convert_int4_sat")
+             .arg(luma ? "(buffer)[i]= (value)" : "vstore4(value, i, buffer)")
+             .arg(groupWidth).arg(groupHeight)
+           + "__kernel __attribute__((reqd_work_group_size(GROUP_WIDTH, GROUP_HEIGHT, 1)))\n";
+}
+
+// Smallest and largest values and their first index in row order, per work group
+static QString minMaxSource(int channels)
+{
+    return reductionHeader(channels)
+           + "void qcli_minmax(__read_only image2d_t image, __global float* values, __global int* indexes)\n"
+             "{\n"
+             "    __local PIXEL mins[GROUP_SIZE];\n"
+             "    __local PIXEL maxs[GROUP_SIZE];\n"
+             "    __local INDEX minIndexes[GROUP_SIZE];\n"
+             "    __local INDEX maxIndexes[GROUP_SIZE];\n"
+             "    const int width= get_image_width(image);\n"
+             "    PIXEL low= INFINITY;\n"
+             "    PIXEL high= -INFINITY;\n"
+             "    INDEX lowIndex= INT_MAX;\n"
+             "    INDEX highIndex= INT_MAX;\n"
+             "    FOR_EACH_PIXEL(image, x, y) {\n"
+             "        const PIXEL value= LOAD(image, (int2)(x, y));\n"
+             "        const INDEX index= (INDEX)(y * width + x);\n"
+             "        // The pixels of a work item are visited in row order, the first one wins the ties\n"
+             "        lowIndex= select(lowIndex, index, value < low);\n"
+             "        low= select(low, value, value < low);\n"
+             "        highIndex= select(highIndex, index, value > high);\n"
+             "        high= select(high, value, value > high);\n"
+             "    }\n"
+             "    const int id= LOCAL_ID;\n"
+             "    mins[id]= low;\n"
+             "    maxs[id]= high;\n"
+             "    minIndexes[id]= lowIndex;\n"
+             "    maxIndexes[id]= highIndex;\n"
+             "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+             "    for(int stride= GROUP_SIZE / 2; stride > 0; stride/= 2) {\n"
+             "        if(id < stride) {\n"
+             "            const PIXEL otherMin= mins[id + stride];\n"
+             "            const INDEX otherMinIndex= minIndexes[id + stride];\n"
+             "            const INDEX takeMin= otherMin < mins[id]\n"
+             "                                  || (otherMin == mins[id] && otherMinIndex < minIndexes[id]);\n"
+             "            mins[id]= select(mins[id], otherMin, takeMin);\n"
+             "            minIndexes[id]= select(minIndexes[id], otherMinIndex, takeMin);\n"
+             "            const PIXEL otherMax= maxs[id + stride];\n"
+             "            const INDEX otherMaxIndex= maxIndexes[id + stride];\n"
+             "            const INDEX takeMax= otherMax > maxs[id]\n"
+             "                                  || (otherMax == maxs[id] && otherMaxIndex < maxIndexes[id]);\n"
+             "            maxs[id]= select(maxs[id], otherMax, takeMax);\n"
+             "            maxIndexes[id]= select(maxIndexes[id], otherMaxIndex, takeMax);\n"
+             "        }\n"
+             "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+             "    }\n"
+             "    if(id == 0) {\n"
+             "        STORE_PIXEL(mins[0], 2 * GROUP_ID, values);\n"
+             "        STORE_PIXEL(maxs[0], 2 * GROUP_ID + 1, values);\n"
+             "        STORE_PIXEL(minIndexes[0], 2 * GROUP_ID, indexes);\n"
+             "        STORE_PIXEL(maxIndexes[0], 2 * GROUP_ID + 1, indexes);\n"
+             "    }\n"
+             "}\n";
+}
+
+// Count, mean and sum of the squared deviations, per work group. The work items
+// update them one pixel at a time (Welford) and the tree merges them (Chan et al.),
+// which stays accurate in single precision
+static QString momentsSource(int channels)
+{
+    return reductionHeader(channels)
+           + "void qcli_moments(__read_only image2d_t image, __global int* counts, __global float* values)\n"
+             "{\n"
+             "    __local int ns[GROUP_SIZE];\n"
+             "    __local PIXEL means[GROUP_SIZE];\n"
+             "    __local PIXEL m2s[GROUP_SIZE];\n"
+             "    int n= 0;\n"
+             "    PIXEL mean= 0.0f;\n"
+             "    PIXEL m2= 0.0f;\n"
+             "    FOR_EACH_PIXEL(image, x, y) {\n"
+             "        const PIXEL value= LOAD(image, (int2)(x, y));\n"
+             "        n++;\n"
+             "        const PIXEL delta= value - mean;\n"
+             "        mean+= delta / (float)n;\n"
+             "        m2+= delta * (value - mean);\n"
+             "    }\n"
+             "    const int id= LOCAL_ID;\n"
+             "    ns[id]= n;\n"
+             "    means[id]= mean;\n"
+             "    m2s[id]= m2;\n"
+             "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+             "    for(int stride= GROUP_SIZE / 2; stride > 0; stride/= 2) {\n"
+             "        if(id < stride && ns[id + stride]) {\n"
+             "            const int na= ns[id];\n"
+             "            const int nb= ns[id + stride];\n"
+             "            const float weight= (float)nb / (na + nb);\n"
+             "            const PIXEL delta= means[id + stride] - means[id];\n"
+             "            means[id]+= delta * weight;\n"
+             "            m2s[id]+= m2s[id + stride] + delta * delta * (na * weight);\n"
+             "            ns[id]= na + nb;\n"
+             "        }\n"
+             "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+             "    }\n"
+             "    if(id == 0) {\n"
+             "        counts[GROUP_ID]= ns[0];\n"
+             "        STORE_PIXEL(means[0], 2 * GROUP_ID, values);\n"
+             "        STORE_PIXEL(m2s[0], 2 * GROUP_ID + 1, values);\n"
+             "    }\n"
+             "}\n";
+}
+
+// Histograms of the channels, counted in local memory and added to the global ones
+static QString histogramSource(int channels)
+{
+    QString source= reductionHeader(channels)
+                    + QString("#define MAX_BINS %1\n").arg(Reduction::maxBins)
+                    + "void qcli_histogram(__read_only image2d_t image, __global uint* histograms, int bins,"
+                      " float low, float scale)\n"
+                      "{\n"
+                      "    __local uint counts[CHANNELS * MAX_BINS];\n"
+                      "    const int id= LOCAL_ID;\n"
+                      "    for(int i= id; i < CHANNELS * bins; i+= GROUP_SIZE)\n"
+                      "        counts[i]= 0;\n"
+                      "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                      "    FOR_EACH_PIXEL(image, x, y) {\n"
+                      "        const PIXEL value= LOAD(image, (int2)(x, y));\n"
+                      "        const INDEX bin= clamp(CONVERT_INDEX(floor((value - low) * scale)), 0, bins - 1);\n";
+    static const char* const components[]= { ".x", ".y", ".z", ".w" };
+    for(int c=0; c<channels; c++) {
+        source+= QString("        atomic_inc(&counts[%1 * bins + bin%2]);\n")
+                 .arg(c).arg(channels == 1 ? "" : components[c]);
+    }
+    source+= "    }\n"
+             "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+             "    for(int i= id; i < CHANNELS * bins; i+= GROUP_SIZE) {\n"
+             "        if(counts[i])\n"
+             "            atomic_add(&histograms[i], counts[i]);\n"
+             "    }\n"
+             "}\n";
+    return source;
+}
+
+// Zeroes the first count values of a buffer, in the queue of an image
+static QString zeroSource()
+{
+    return "__kernel void qcli_zero(__read_only image2d_t image, __global uint* buffer, int count)\n"
+           "{\n"
+           "    const int i= get_global_id(0);\n"
+           "    if(i < count)\n"
+           "        buffer[i]= 0;\n"
+           "}\n";
+}
+
+// Returns the kernel of a source from the cache
+// @retval nullptr if the kernel could not be compiled
+static Kernel* cachedKernel(const QString& source)
+{
+    return kernelCache().kernel("Reduction", source, BlockDim {{ groupWidth, groupHeight }});
+}
+
+// Returns the work items of a reduction over an image, at most maxGroups work groups
+static QSize reductionRange(QSize size)
+{
+    const int groupsX= qMin((size.width() + groupWidth - 1) / groupWidth, 8);
+    const int groupsY= qMin((size.height() + groupHeight - 1) / groupHeight, Reduction::maxGroups / groupsX);
+    return QSize(groupsX * groupWidth, groupsY * groupHeight);
+}
+
+// Returns the number of work groups of a range
+static int groupCount(QSize range)
+{
+    return range.width() / groupWidth * (range.height() / groupHeight);
+}
+
+// Takes a buffer for the results of a reduction over an image from the pool
+// @retval nullptr on error
+static cl_mem acquireBuffer(const Image& image, size_t bytes)
+{
+    Event lastUse;
+    cl_mem buffer= imgPool().acquireBuffer(image.devId(), bytes, CL_MEM_READ_WRITE, &lastUse);
+    // A recycled buffer may still be used by the commands of its previous owner
+    if(buffer and !lastUse.wait()) {
+        imgPool().releaseBuffer(image.devId(), bytes, CL_MEM_READ_WRITE, buffer);
+        return nullptr;
+    }
+    return buffer;
+}
+
+// Gives a buffer of acquireBuffer() back to the pool, once the last command
+// over the image is done
+static void releaseBuffer(const Image& image, size_t bytes, cl_mem buffer)
+{
+    if(buffer)
+        imgPool().releaseBuffer(image.devId(), bytes, CL_MEM_READ_WRITE, buffer, image.devEvent());
+}
+
+// Reads the results of the last reduction over an image, blocking
+static bool readBuffer(const Image& image, cl_mem buffer, size_t bytes, void* data)
+{
+    const cl_command_queue queue= devMgr().queue(image.devId(), QueueRole::Download);
+    const auto waitList= Event::waitList(QVector<Event>() << image.devEvent(), queue);
+    cl_event event;
+    cl_int err= clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, bytes, data,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+    if(checkCLError(err, "clEnqueueReadBuffer"))
+        return false;
+    profiler().record(Profiler::Category::Download, image.devId(), Event(event), bytes);
+    return true;
+}
+
+// Checks that an image can be reduced
+static bool reducible(const Image& image)
+{
+    if(image.tiled()) {
+        qDebug() << "Reduction: tiled images are not supported.";
+        return false;
+    }
+    return true;
+}
+
+//
+// Reductions
+//
+
+bool Reduction::minMax(const Image& image, MinMax* result)
+{
+    if(!reducible(image))
+        return false;
+    const int channels= iFmtChanCount(image.format()) == 1 ? 1 : 4;
+    Kernel* kernel= cachedKernel(minMaxSource(channels));
+    if(!kernel)
+        return false;
+
+    const QSize range= reductionRange(image.size());
+    const int groups= groupCount(range);
+    QVector<float> values(2 * groups * channels);
+    QVector<int> indexes(2 * groups * channels);
+    const size_t valueBytes= values.count() * sizeof(float);
+    const size_t indexBytes= indexes.count() * sizeof(int);
+    cl_mem valueBuffer= acquireBuffer(image, valueBytes);
+    cl_mem indexBuffer= acquireBuffer(image, indexBytes);
+    bool ok= valueBuffer and indexBuffer and kernel->setRange(range)
+             and (*kernel)(image, valueBuffer, indexBuffer)
+             and readBuffer(image, valueBuffer, valueBytes, values.data())
+             and readBuffer(image, indexBuffer, indexBytes, indexes.data());
+    releaseBuffer(image, valueBytes, valueBuffer);
+    releaseBuffer(image, indexBytes, indexBuffer);
+    if(!ok)
+        return false;
+
+    // The work groups visit interleaved pixels, the smallest index wins the ties
+    const int width= image.size().width();
+    result->min= QVector<float>(channels, INFINITY);
+    result->max= QVector<float>(channels, -INFINITY);
+    QVector<int> minIndexes(channels, INT_MAX);
+    QVector<int> maxIndexes(channels, INT_MAX);
+    for(int g=0; g<groups; g++) {
+        for(int c=0; c<channels; c++) {
+            const float low= values[2 * g * channels + c];
+            const int lowIndex= indexes[2 * g * channels + c];
+            if(low < result->min[c] or (low == result->min[c] and lowIndex < minIndexes[c])) {
+                result->min[c]= low;
+                minIndexes[c]= lowIndex;
+            }
+            const float high= values[(2 * g + 1) * channels + c];
+            const int highIndex= indexes[(2 * g + 1) * channels + c];
+            if(high > result->max[c] or (high == result->max[c] and highIndex < maxIndexes[c])) {
+                result->max[c]= high;
+                maxIndexes[c]= highIndex;
+            }
+        }
+    }
+    result->minPos.clear();
+    result->maxPos.clear();
+    for(int c=0; c<channels; c++) {
+        result->minPos << QPoint(minIndexes[c] % width, minIndexes[c] / width);
+        result->maxPos << QPoint(maxIndexes[c] % width, maxIndexes[c] / width);
+    }
+    return true;
+}
+
+bool Reduction::moments(const Image& image, Moments* result)
+{
+    if(!reducible(image))
+        return false;
+    const int channels= iFmtChanCount(image.format()) == 1 ? 1 : 4;
+    Kernel* kernel= cachedKernel(momentsSource(channels));
+    if(!kernel)
+        return false;
+
+    const QSize range= reductionRange(image.size());
+    const int groups= groupCount(range);
+    QVector<int> counts(groups);
+    QVector<float> values(2 * groups * channels);
+    const size_t countBytes= counts.count() * sizeof(int);
+    const size_t valueBytes= values.count() * sizeof(float);
+    cl_mem countBuffer= acquireBuffer(image, countBytes);
+    cl_mem valueBuffer= acquireBuffer(image, valueBytes);
+    bool ok= countBuffer and valueBuffer and kernel->setRange(range)
+             and (*kernel)(image, countBuffer, valueBuffer)
+             and readBuffer(image, countBuffer, countBytes, counts.data())
+             and readBuffer(image, valueBuffer, valueBytes, values.data());
+    releaseBuffer(image, countBytes, countBuffer);
+    releaseBuffer(image, valueBytes, valueBuffer);
+    if(!ok)
+        return false;
+
+    // Same merge as the work groups, in double precision
+    qint64 count= 0;
+    QVector<double> mean(channels, 0.0);
+    QVector<double> m2(channels, 0.0);
+    for(int g=0; g<groups; g++) {
+        if(!counts[g])
+            continue;
+        const qint64 total= count + counts[g];
+        const double weight= (double)counts[g] / total;
+        for(int c=0; c<channels; c++) {
+            const double delta= values[2 * g * channels + c] - mean[c];
+            mean[c]+= delta * weight;
+            m2[c]+= values[(2 * g + 1) * channels + c] + delta * delta * (count * weight);
+        }
+        count= total;
+    }
+    result->count= count;
+    result->mean= mean;
+    result->sum.clear();
+    result->variance.clear();
+    for(int c=0; c<channels; c++) {
+        result->sum << mean[c] * count;
+        result->variance << (count ? m2[c] / count : 0.0);
+    }
+    return true;
+}
+
+bool Reduction::histogram(const Image& image, int bins, QVector<QVector<quint32>>* histograms, float min, float max)
+{
+    if(bins < 1 or bins > maxBins or !(max > min)) {
+        qDebug() << "Reduction::histogram: invalid bins or range.";
+        return false;
+    }
+    if(!reducible(image))
+        return false;
+    const int channels= iFmtChanCount(image.format()) == 1 ? 1 : 4;
+    Kernel* kernel= cachedKernel(histogramSource(channels));
+    Kernel* zero= kernelCache().kernel("Reduction", zeroSource(), BlockDim {{ 64, 1 }});
+    if(!kernel or !zero)
+        return false;
+
+    // The work groups add their counts to the histograms zeroed before, in the
+    // queue of the image so the launches are ordered by the image
+    QVector<quint32> counts(channels * bins);
+    const size_t bytes= counts.count() * sizeof(quint32);
+    cl_mem buffer= acquireBuffer(image, bytes);
+    const float scale= bins / (max - min);
+    bool ok= buffer and zero->setRange(QSize(counts.count(), 1)) and (*zero)(image, buffer, counts.count())
+             and kernel->setRange(reductionRange(image.size()))
+             and (*kernel)(image, buffer, bins, min, scale)
+             and readBuffer(image, buffer, bytes, counts.data());
+    releaseBuffer(image, bytes, buffer);
+    if(!ok)
+        return false;
+
+    histograms->clear();
+    for(int c=0; c<channels; c++)
+        *histograms << counts.mid(c * bins, bins);
+    return true;
+}
+
+} // namespace QCLI
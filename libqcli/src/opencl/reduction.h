@@ -0,0 +1,87 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_REDUCTION_H
+#define _QCLI_REDUCTION_H
+
+#include <QtCore>
+
+#include "image.h"
+
+namespace QCLI {
+
+/** \brief Statistics of an image computed on the device
+ *
+ *  The pixels are reduced where they are, only a few kilobytes of partial
+ *  results come back to the host instead of the whole image:
+ *
+ *      Reduction::MinMax range;
+ *      if(Reduction::minMax(frame, &range))
+ *          normalize(frame, range.min[0], range.max[0]);
+ *
+ *  Each work group reduces the pixels it visits in local memory, the histograms
+ *  with local atomics merged with global atomics, and the other reductions with a
+ *  tree whose results (one per work group, at most maxGroups) are merged on the
+ *  host.
+ *
+ *  The channels are r, g, b, a for the ARGB formats and the luma for the LUMA
+ *  formats, with the values of read_imagef(): normalized to [0..1] for the
+ *  integer formats. The image is only read, its host copy stays valid (see
+ *  Kernel::setArg()).
+ *
+ *  Tiled images are not supported. All functions are thread-safe, for different images.
+ */
+
+class Reduction
+{
+public:
+    /// Smallest and largest values of each channel
+    struct MinMax {
+        QVector<float> min;
+        QVector<float> max;
+        QVector<QPoint> minPos;  // First pixel of the smallest value in row order
+        QVector<QPoint> maxPos;
+    };
+
+    /// Moments of each channel
+    struct Moments {
+        qint64 count;            // Number of pixels
+        QVector<double> sum;
+        QVector<double> mean;
+        QVector<double> variance; // Population variance
+    };
+
+    /// Largest number of work groups of the tree reductions
+    static const int maxGroups= 64;
+    /// Largest number of bins of the histograms
+    static const int maxBins= 256;
+
+    /// Computes the minimum and maximum of each channel, and their location
+    /// @retval false on error
+    static bool minMax(const Image& image, MinMax* result);
+    /// Computes the sum, the mean and the variance of each channel
+    /// @retval false on error
+    static bool moments(const Image& image, Moments* result);
+    /// Counts the values of each channel in bins of [min..max], the values outside
+    /// are counted in the first and the last bin
+    /// @param bins between 1 and maxBins
+    /// @param histograms returns the counts of each bin for each channel
+    /// @retval false on error
+    static bool histogram(const Image& image, int bins, QVector<QVector<quint32>>* histograms,
+                          float min= 0.0f, float max= 1.0f);
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_REDUCTION_H
@@ -0,0 +1,171 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "worksizetuner.h"
+
+#include <cstdio>
+#include "util/utils.h"
+#include "opencl/devicemanager.h"
+
+namespace QCLI {
+
+// Smallest work groups tried, fewer work items leave most of the device idle
+static const size_t minGroupSize= 16;
+
+// Returns the smallest power of two >= value
+static int nextPowerOfTwo(int value)
+{
+    int ret= 1;
+    while(ret < value)
+        ret*= 2;
+    return ret;
+}
+
+WorkSizeTuner::WorkSizeTuner()
+{
+    _enabled= false;
+    _repetitions= 3;
+    const QByteArray fileName= qgetenv("QCLI_TUNING_FILE");
+    _fileName= fileName.isEmpty() ? QDir::homePath() + "/.qcli/worksizes.txt" : QString::fromLocal8Bit(fileName);
+}
+
+void WorkSizeTuner::setFileName(QString fileName)
+{
+    QMutexLocker locker(&_lock);
+    _fileName= fileName;
+    _choices.clear();
+    _loaded= false;
+}
+
+QSize WorkSizeTuner::sizeClass(QSize imageSize)
+{
+    return QSize(nextPowerOfTwo(imageSize.width()), nextPowerOfTwo(imageSize.height()));
+}
+
+QVector<WorkSizeTuner::WorkSize> WorkSizeTuner::candidates(size_t maxGroupSize, const size_t* maxItemSizes,
+                                                            QSize imageSize)
+{
+    // Power of two shapes, not wider or taller than the image (rounded up)
+    const QSize bounds= sizeClass(imageSize);
+    QVector<WorkSize> ret;
+    for(size_t width=1; width<=maxItemSizes[0] and width<=(size_t)bounds.width(); width*=2) {
+        for(size_t height=1; height<=maxItemSizes[1] and height<=(size_t)bounds.height(); height*=2) {
+            const size_t items= width * height;
+            if(items <= maxGroupSize and items >= qMin(minGroupSize, maxGroupSize)) {
+                const WorkSize workSize {{ width, height }};
+                ret << workSize;
+            }
+        }
+    }
+    return ret;
+}
+
+QString WorkSizeTuner::_key(const QString& kernelKey, int devId, QSize imageSize)
+{
+    // A new driver may have other best shapes
+    if(!_deviceKeys.contains(devId)) {
+        const cl_device_id device= devMgr().device(devId);
+        _deviceKeys[devId]= clDeviceString(device, CL_DEVICE_NAME) + " " + clDeviceString(device, CL_DRIVER_VERSION);
+    }
+    const QSize size= sizeClass(imageSize);
+    return QString("%1|%2|%3x%4").arg(_deviceKeys[devId]).arg(kernelKey).arg(size.width()).arg(size.height());
+}
+
+bool WorkSizeTuner::find(const QString& kernelKey, int devId, QSize imageSize, WorkSize* workSize)
+{
+    QMutexLocker locker(&_lock);
+    _load();
+    const auto it= _choices.constFind(_key(kernelKey, devId, imageSize));
+    if(it == _choices.constEnd())
+        return false;
+    *workSize= it.value();
+    return true;
+}
+
+void WorkSizeTuner::store(const QString& kernelKey, int devId, QSize imageSize, WorkSize workSize)
+{
+    QMutexLocker locker(&_lock);
+    _load();
+    _choices[_key(kernelKey, devId, imageSize)]= workSize;
+    _save();
+}
+
+void WorkSizeTuner::clear()
+{
+    QMutexLocker locker(&_lock);
+    _choices.clear();
+    _loaded= true;
+    QFile::remove(_fileName);
+}
+
+// Reads the choices of a file, one per line: key, tab, width, tab, height
+static void readChoices(const QString& fileName, QHash<QString, WorkSizeTuner::WorkSize>* choices)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return;
+    while(!file.atEnd()) {
+        const QStringList fields= QString::fromUtf8(file.readLine()).trimmed().split('\t');
+        if(fields.count() != 3)
+            continue;
+        const WorkSizeTuner::WorkSize workSize {{ (size_t)fields[1].toUInt(), (size_t)fields[2].toUInt() }};
+        if(workSize[0] and workSize[1])
+            (*choices)[fields[0]]= workSize;
+    }
+}
+
+void WorkSizeTuner::_load()
+{
+    if(_loaded)
+        return;
+    _loaded= true;
+    readChoices(_fileName, &_choices);
+}
+
+bool WorkSizeTuner::_save()
+{
+    // Keep the choices stored by other processes since the file was loaded
+    QHash<QString, WorkSize> stored;
+    readChoices(_fileName, &stored);
+    for(auto it= stored.constBegin(); it != stored.constEnd(); ++it) {
+        if(!_choices.contains(it.key()))
+            _choices.insert(it.key(), it.value());
+    }
+
+    // Write to a temporary file and rename it, so concurrent processes never
+    // read a partly written file
+    QDir().mkpath(QFileInfo(_fileName).absolutePath());
+    const QString tmpPath= QString("%1.%2.tmp").arg(_fileName).arg(QCoreApplication::applicationPid());
+    QFile file(tmpPath);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        qDebug() << "WorkSizeTuner: could not write" << tmpPath;
+        return false;
+    }
+    bool written= true;
+    for(auto it= _choices.constBegin(); it != _choices.constEnd(); ++it) {
+        const QByteArray line= QString("%1\t%2\t%3\n").arg(it.key()).arg(it.value()[0]).arg(it.value()[1]).toUtf8();
+        written= written and file.write(line) == line.size();
+    }
+    file.close();
+    // QFile::rename does not replace an existing file, rename() does it atomically on POSIX
+    if(!written or (std::rename(QFile::encodeName(tmpPath).constData(), QFile::encodeName(_fileName).constData())
+                    and (!QFile::remove(_fileName) or !QFile::rename(tmpPath, _fileName)))) {
+        qDebug() << "WorkSizeTuner: could not write" << _fileName;
+        QFile::remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+} // namespace QCLI
@@ -0,0 +1,116 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_WORKSIZETUNER_H
+#define _QCLI_WORKSIZETUNER_H
+
+#include <QtCore>
+#include <CL/cl.h>
+#include <array>
+
+namespace QCLI {
+
+/** \brief Database of the fastest local work size of each kernel
+ *
+ *  The best work-group shape depends on the device, the kernel and the image
+ *  size. When tuning is enabled, the first launch of a kernel on a device for
+ *  an image size class (the size rounded up to powers of two) times the
+ *  candidate shapes and stores the fastest one. The choices are saved to a
+ *  tuning file and loaded by the next processes, and each Kernel caches the
+ *  shape of its last launch, so the launches using a stored choice cost nothing.
+ *
+ *  The stored choices are used even if tuning is disabled; kernels without a
+ *  choice use the default 8x8 work groups.
+ *
+ *  All functions are thread-safe.
+ */
+
+class WorkSizeTuner
+{
+public:
+    /// Local work size, as in Kernel
+    typedef std::array<size_t, 2> WorkSize;
+
+    /// Static instance method (thread safe in C++11)
+    static WorkSizeTuner& instance() {
+        static WorkSizeTuner inst;
+        return inst;
+    }
+
+    /// Returns true if the kernels without a stored choice are tuned
+    bool enabled() const { return _enabled; }
+    /// Enables the tuning of the kernels without a stored choice, disabled by default
+    void setEnabled(bool enabled) { _enabled= enabled; }
+    /// Returns the timed launches of each candidate
+    int repetitions() const { return _repetitions; }
+    /// Sets the timed launches of each candidate, the fastest one counts (3 by default)
+    void setRepetitions(int count) { _repetitions= qMax(count, 1); }
+
+    /// Returns the tuning file
+    QString fileName() const { QMutexLocker l(&_lock); return _fileName; }
+    /// Sets the tuning file, its choices replace the ones in memory
+    /// The default is $QCLI_TUNING_FILE, or ~/.qcli/worksizes.txt
+    void setFileName(QString fileName);
+
+    /// Returns the stored choice of a kernel
+    /// @param kernelKey identifies the kernel source and function (see Kernel)
+    /// @retval false if there is none
+    bool find(const QString& kernelKey, int devId, QSize imageSize, WorkSize* workSize);
+    /// Stores the choice of a kernel and saves the tuning file
+    void store(const QString& kernelKey, int devId, QSize imageSize, WorkSize workSize);
+    /// Forgets the stored choices, and removes the tuning file
+    void clear();
+
+    /// Returns the size class of an image size, its dimensions rounded up to powers of two
+    static QSize sizeClass(QSize imageSize);
+    /// Returns the shapes to try, with at most maxGroupSize work items
+    /// @param maxItemSizes maximum work items in each dimension (CL_DEVICE_MAX_WORK_ITEM_SIZES)
+    static QVector<WorkSize> candidates(size_t maxGroupSize, const size_t* maxItemSizes, QSize imageSize);
+
+    /// Disable copying
+    WorkSizeTuner(const WorkSizeTuner& other) = delete;
+    /// Disable assignments
+    WorkSizeTuner& operator=(const WorkSizeTuner& other) = delete;
+
+private:
+    /// Hide constructor
+    WorkSizeTuner();
+
+    /// Returns the database key of a choice (lock held)
+    QString _key(const QString& kernelKey, int devId, QSize imageSize);
+    /// Loads the tuning file if it was not loaded (lock held)
+    void _load();
+    /// Writes the tuning file (lock held)
+    bool _save();
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QAtomicInt _enabled;
+    QAtomicInt _repetitions;
+    QString _fileName;
+    bool _loaded= false;
+
+    /// Choices, by key
+    QHash<QString, WorkSize> _choices;
+    /// Name and driver version of each device, part of the keys
+    QHash<int, QString> _deviceKeys;
+};
+
+/// Global function to access the WorkSizeTuner
+inline
+WorkSizeTuner& wsTuner() { return WorkSizeTuner::instance(); }
+
+} // namespace QCLI
+
+#endif // _QCLI_WORKSIZETUNER_H
@@ -0,0 +1,72 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "rowstream.h"
+
+#include <cassert>
+
+namespace QCLI {
+
+RawImageFile::RawImageFile(QString fileName, QSize size, IFmt format, bool write, qint64 headerBytes)
+    : _file(fileName), _size(size), _format(format), _headerBytes(headerBytes),
+      _rowBytes((qint64)size.width() * iFmtBPP(format) / 8)
+{
+    assert(size.width() > 0 and size.height() > 0);
+    assert(headerBytes >= 0);
+
+    if(write) {
+        // The header is kept if the file exists, the rows are written in any order
+        if(!_file.open(QIODevice::ReadWrite) or !_file.resize(rowPos(size.height()))) {
+            qDebug() << "RawImageFile: could not create" << fileName;
+            _file.close();
+        }
+        return;
+    }
+    if(!_file.open(QIODevice::ReadOnly)) {
+        qDebug() << "RawImageFile: could not open" << fileName;
+        return;
+    }
+    if(_file.size() < rowPos(size.height())) {
+        qDebug() << "RawImageFile:" << fileName << "is smaller than the image.";
+        _file.close();
+    }
+}
+
+bool RawImageFile::readRows(int y, int count, void* data)
+{
+    if(isNull() or y < 0 or count < 0 or y + count > _size.height())
+        return false;
+    QMutexLocker locker(&_lock);
+    const qint64 bytes= count * _rowBytes;
+    if(!_file.seek(rowPos(y)) or _file.read(static_cast<char*>(data), bytes) != bytes) {
+        qDebug() << "RawImageFile: could not read rows" << y << "to" << y + count - 1 << "of" << _file.fileName();
+        return false;
+    }
+    return true;
+}
+
+bool RawImageFile::writeRows(int y, int count, const void* data)
+{
+    if(isNull() or y < 0 or count < 0 or y + count > _size.height())
+        return false;
+    QMutexLocker locker(&_lock);
+    const qint64 bytes= count * _rowBytes;
+    if(!_file.seek(rowPos(y)) or _file.write(static_cast<const char*>(data), bytes) != bytes) {
+        qDebug() << "RawImageFile: could not write rows" << y << "to" << y + count - 1 << "of" << _file.fileName();
+        return false;
+    }
+    return true;
+}
+
+} // namespace QCLI
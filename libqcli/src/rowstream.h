@@ -0,0 +1,109 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_ROWSTREAM_H
+#define _QCLI_ROWSTREAM_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+
+namespace QCLI {
+
+/** \brief Image read a few rows at a time, without loading it whole
+ *
+ *  Rows are tightly packed pixels of format(), top to bottom.
+ */
+
+class RowSource
+{
+public:
+    virtual ~RowSource() { }
+
+    /// Returns the size of the image
+    virtual QSize size() const = 0;
+    /// Returns the format of the pixels
+    virtual IFmt format() const = 0;
+    /// Reads count rows starting at row y
+    /// @retval false on error
+    virtual bool readRows(int y, int count, void* data) = 0;
+};
+
+/** \brief Image written a few rows at a time, without holding it whole
+ *
+ *  Rows are tightly packed pixels of format(), in any order.
+ */
+
+class RowSink
+{
+public:
+    virtual ~RowSink() { }
+
+    /// Returns the size of the image
+    virtual QSize size() const = 0;
+    /// Returns the format of the pixels
+    virtual IFmt format() const = 0;
+    /// Writes count rows starting at row y
+    /// @retval false on error
+    virtual bool writeRows(int y, int count, const void* data) = 0;
+};
+
+/** \brief Image file of raw pixels, read and written by rows
+ *
+ *  The file holds the tightly packed rows of an IFmt, top to bottom, after an
+ *  optional header that is skipped:
+ *
+ *      RawImageFile src("scan.raw", QSize(100000, 100000), IFmt::LUMA);
+ *      RawImageFile dst("scan_out.raw", src.size(), IFmt::LUMA, true);
+ *
+ *  All functions are thread-safe.
+ */
+
+class RawImageFile : public RowSource, public RowSink
+{
+public:
+    /// Opens a file
+    /// @param write creates or truncates the file to be written, instead of reading it
+    /// @param headerBytes bytes before the first row
+    RawImageFile(QString fileName, QSize size, IFmt format, bool write= false, qint64 headerBytes= 0);
+
+    /// Returns true if the file could not be opened or is too short
+    bool isNull() const { return !_file.isOpen(); }
+
+    QSize size() const { return _size; }
+    IFmt format() const { return _format; }
+    bool readRows(int y, int count, void* data);
+    bool writeRows(int y, int count, const void* data);
+
+    /// Disable copying
+    RawImageFile(const RawImageFile& other) = delete;
+    /// Disable assignments
+    RawImageFile& operator=(const RawImageFile& other) = delete;
+
+private:
+    /// Returns the file position of a row (lock held)
+    qint64 rowPos(int y) const { return _headerBytes + (qint64)y * _rowBytes; }
+
+    // State
+    QMutex _lock; // Serializes the seeks and transfers
+    QFile _file;
+    QSize _size;
+    IFmt _format;
+    qint64 _headerBytes;
+    qint64 _rowBytes;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_ROWSTREAM_H
@@ -0,0 +1,207 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "stripestreamer.h"
+
+#include <cassert>
+#include "graph.h"
+#include "image.h"
+#include "rowstream.h"
+#include "opencl/devicemanager.h"
+
+namespace QCLI {
+
+struct StripeStreamer::Run {
+    RowSource* src;
+    int devId;
+    QVector<Stripe> stripes;
+
+    QSemaphore free;  // Stripes the reader may read before the oldest one is written
+    QSemaphore ready; // Stripes read and not processed yet
+    QAtomicInt failed;
+    qint64 readMsecs; // Only written by the reader
+};
+
+/// Reads the stripes in the threads of the streamer
+class StripeStreamer::Reader : public QRunnable
+{
+public:
+    Reader(Run& run, QSemaphore* done) : _run(run), _done(done) { }
+    void run() { readStripes(_run); _done->release(); }
+private:
+    Run& _run;
+    QSemaphore* const _done;
+};
+
+StripeStreamer::StripeStreamer(int stripeHeight, int halo, int depth, int devId)
+    : _devId(devId)
+{
+    assert(stripeHeight > 0);
+    assert(halo >= 0);
+    assert(depth > 0);
+    _stripeHeight= stripeHeight;
+    _halo= halo;
+    _depth= depth;
+    _stats.stripes= 0;
+    _stats.residentBytes= 0;
+    _stats.readMsecs= 0;
+    _stats.waitMsecs= 0;
+    _stats.writeMsecs= 0;
+    _stats.msecs= 0;
+}
+
+qint64 StripeStreamer::residentBytes(int width, int srcBytesPerPixel, int dstBytesPerPixel) const
+{
+    // Input and output images of the stripes in flight, with their halo
+    const qint64 rows= _stripeHeight + 2 * _halo;
+    return _depth * rows * width * (srcBytesPerPixel + dstBytesPerPixel);
+}
+
+bool StripeStreamer::run(RowSource& src, RowSink& dst, Process process)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if(src.size() != dst.size() or src.size().isEmpty()) {
+        qDebug() << "StripeStreamer::run: the images must have the same size.";
+        return false;
+    }
+
+    Run run;
+    run.src= &src;
+    run.devId= _devId;
+    run.failed= 0;
+    run.readMsecs= 0;
+
+    // Split the image in stripes of full rows, the halo is clamped to the image
+    const QRect bounds(QPoint(0, 0), src.size());
+    const int stripeHeight= _stripeHeight;
+    const int halo= _halo;
+    const int depth= _depth;
+    for(int y=0; y<bounds.height(); y+=stripeHeight) {
+        const QRect inner= QRect(0, y, bounds.width(), stripeHeight).intersected(bounds);
+        const Stripe stripe { inner, inner.adjusted(0, -halo, 0, halo).intersected(bounds), nullptr, nullptr };
+        run.stripes << stripe;
+    }
+
+    // The operations must run now, not be recorded by a graph of this thread
+    Graph* graph= Graph::current();
+    if(graph)
+        graph->end();
+
+    run.free.release(depth);
+    QSemaphore done;
+    _pool.start(new Reader(run, &done));
+
+    const IFmt dstFormat= dst.format();
+    const qint64 dstRowBytes= (qint64)bounds.width() * iFmtBPP(dstFormat) / 8;
+    qint64 waitMsecs= 0;
+    qint64 writeMsecs= 0;
+    QQueue<int> inFlight;
+    for(int i=0; i<=run.stripes.count(); i++) {
+        // Process the next stripe once read
+        if(i < run.stripes.count() and !run.failed) {
+            QElapsedTimer wait;
+            wait.start();
+            run.ready.acquire();
+            waitMsecs+= wait.elapsed();
+            Stripe& stripe= run.stripes[i];
+            if(stripe.input) {
+                stripe.output= new Image(stripe.outer.width(), stripe.outer.height(), dstFormat, _devId);
+                const bool ok= process(*stripe.input, *stripe.output)
+                               and (stripe.output->_hostValid or !stripe.output->downloadAsync().isNull());
+                // Submit it before waiting for the previous stripes
+                devMgr().flush(_devId);
+                if(!ok) {
+                    qDebug() << "StripeStreamer: the stripe at row" << stripe.inner.y() << "failed.";
+                    run.failed= 1;
+                }
+                inFlight.enqueue(i);
+            }
+        }
+
+        // Write the oldest results, their slots can then be read again
+        while(!inFlight.isEmpty() and (inFlight.count() >= depth or run.failed or i == run.stripes.count())) {
+            Stripe& stripe= run.stripes[inFlight.dequeue()];
+            if(!run.failed) {
+                bool ok= stripe.output->_waitHost() and stripe.output->_hostValid;
+                QElapsedTimer write;
+                write.start();
+                ok= ok and dst.writeRows(stripe.inner.y(), stripe.inner.height(),
+                                         stripe.output->_hostBuffer
+                                         + (stripe.inner.y() - stripe.outer.y()) * dstRowBytes);
+                writeMsecs+= write.elapsed();
+                if(!ok) {
+                    qDebug() << "StripeStreamer: could not write the stripe at row" << stripe.inner.y();
+                    run.failed= 1;
+                }
+            }
+            delete stripe.input;
+            delete stripe.output;
+            stripe.input= nullptr;
+            stripe.output= nullptr;
+            run.free.release();
+        }
+    }
+
+    // Let the reader stop, and free the stripes it read in vain
+    run.free.release(run.stripes.count());
+    done.acquire();
+    for(int i=0; i<run.stripes.count(); i++) {
+        delete run.stripes[i].input;
+        delete run.stripes[i].output;
+    }
+
+    if(graph)
+        graph->begin();
+
+    QMutexLocker locker(&_lock);
+    _stats.stripes= run.stripes.count();
+    _stats.residentBytes= residentBytes(bounds.width(), iFmtBPP(src.format()) / 8, iFmtBPP(dstFormat) / 8);
+    _stats.readMsecs= run.readMsecs;
+    _stats.waitMsecs= waitMsecs;
+    _stats.writeMsecs= writeMsecs;
+    _stats.msecs= timer.elapsed();
+    return !run.failed;
+}
+
+void StripeStreamer::readStripes(Run& run)
+{
+    const IFmt srcFormat= run.src->format();
+    for(int i=0; i<run.stripes.count(); i++) {
+        run.free.acquire();
+        if(run.failed)
+            break;
+        QElapsedTimer timer;
+        timer.start();
+
+        // Read straight into the host buffer of the stripe image
+        Stripe& stripe= run.stripes[i];
+        Image* input= new Image(stripe.outer.width(), stripe.outer.height(), srcFormat, run.devId, false, true);
+        if(!input->_hostBuffer or !input->_waitHost()
+           or !run.src->readRows(stripe.outer.y(), stripe.outer.height(), input->_hostBuffer)) {
+            qDebug() << "StripeStreamer: could not read the stripe at row" << stripe.inner.y();
+            delete input;
+            run.failed= 1;
+            run.ready.release();
+            break;
+        }
+        input->_hostValid= true;
+        input->_devValid= false;
+        stripe.input= input;
+        run.readMsecs+= timer.elapsed();
+        run.ready.release();
+    }
+}
+
+} // namespace QCLI
@@ -0,0 +1,132 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_STRIPESTREAMER_H
+#define _QCLI_STRIPESTREAMER_H
+
+#include <QtCore>
+#include <functional>
+
+namespace QCLI {
+
+class Image;
+class RowSource;
+class RowSink;
+
+/** \brief Processes images that do not fit in memory, a stripe of rows at a time
+ *
+ *  The source is read in stripes of full rows, plus a halo of rows above and
+ *  below for neighbourhood operations. Each stripe is processed on the device
+ *  and the inner rows of the result are written to the sink, so only depth()
+ *  stripes are resident at any time:
+ *
+ *      RawImageFile src("scan.raw", QSize(100000, 100000), IFmt::LUMA);
+ *      RawImageFile dst("scan_out.raw", src.size(), IFmt::LUMA, true);
+ *      StripeStreamer streamer(256, 3); // 7x7 filter
+ *      streamer.run(src, dst, [&](Image& in, Image& out) { return blur(in, out); });
+ *
+ *  A reader thread reads the next stripes while the device processes the
+ *  current one and the previous results are written. Stripes wider than the
+ *  device images are tiled (see Image), so the kernels need their halo set
+ *  with Kernel::setHalo() too.
+ *
+ *  Stripes at the top and bottom of the image get no halo on that side, so
+ *  operations clamping the coordinates to the edge see the same pixels as on
+ *  the whole image.
+ *
+ *  All functions are thread-safe.
+ */
+
+class StripeStreamer
+{
+public:
+    /// Operation on a stripe, runs on the device of the stripe images
+    /// @retval false on error
+    typedef std::function<bool(Image& input, Image& output)> Process;
+
+    /// Statistics of the last run
+    struct Stats {
+        int stripes;
+        qint64 residentBytes; // Host memory of the stripes in flight, at most
+        qint64 readMsecs;     // Time spent reading the source, in the reader thread
+        qint64 waitMsecs;     // Time the device waited for the reader
+        qint64 writeMsecs;    // Time spent writing the sink
+        qint64 msecs;         // Duration of the run
+    };
+
+    /// @param halo rows read above and below each output row by the operation
+    /// @param depth stripes in flight, 2 overlaps the reads with the processing
+    StripeStreamer(int stripeHeight= 256, int halo= 0, int depth= 2, int devId= 0);
+
+    /// Returns the rows of each stripe, without the halo
+    int stripeHeight() const { return _stripeHeight; }
+    /// Sets the rows of each stripe, without the halo
+    void setStripeHeight(int rows) { _stripeHeight= qMax(rows, 1); }
+    /// Returns the halo of the stripes
+    int halo() const { return _halo; }
+    /// Sets the halo of the stripes
+    void setHalo(int halo) { _halo= qMax(halo, 0); }
+    /// Returns the stripes in flight
+    int depth() const { return _depth; }
+    /// Sets the stripes in flight
+    void setDepth(int depth) { _depth= qMax(depth, 1); }
+    /// Returns the device processing the stripes
+    int devId() const { return _devId; }
+
+    /// Returns the host memory used by run() for an image width and formats
+    qint64 residentBytes(int width, int srcBytesPerPixel, int dstBytesPerPixel) const;
+
+    /// Runs process over src writing dst, blocking until all the rows are written
+    /// @param dst sink of the same size as src, of any format
+    /// @retval false on error
+    bool run(RowSource& src, RowSink& dst, Process process);
+
+    /// Returns the statistics of the last run
+    Stats stats() const { QMutexLocker l(&_lock); return _stats; }
+
+    /// Disable copying
+    StripeStreamer(const StripeStreamer& other) = delete;
+    /// Disable assignments
+    StripeStreamer& operator=(const StripeStreamer& other) = delete;
+
+private:
+    /// Stripe of the image
+    struct Stripe {
+        QRect inner;  // Rows written
+        QRect outer;  // Rows read, inner plus the halo
+        Image* input;
+        Image* output;
+    };
+    /// State of a run shared with the reader
+    struct Run;
+    class Reader;
+
+    /// Reads the stripes into input images until there are none left
+    static void readStripes(Run& run);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QAtomicInt _stripeHeight;
+    QAtomicInt _halo;
+    QAtomicInt _depth;
+    const int _devId;
+    Stats _stats;
+    // Threads of the readers, apart from the global pool so a run called from a
+    // pool thread can not wait for a reader that never starts
+    QThreadPool _pool;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_STRIPESTREAMER_H
@@ -0,0 +1,276 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "tilescheduler.h"
+
+#include <cassert>
+#include "graph.h"
+#include "image.h"
+#include "opencl/devicemanager.h"
+#include "opencl/profiler.h"
+#include "util/utils.h"
+
+namespace QCLI {
+
+// Tiles enqueued by a device before waiting for the oldest one, enough to
+// overlap the transfers of a tile with the processing of the previous one
+static const int maxTilesInFlight= 2;
+
+struct TileScheduler::Run {
+    Image* src;
+    Image* dst;
+    Process process;
+    QVector<Tile> tiles;
+    QVector<int> devIds;
+
+    QMutex lock;
+    QVector<QList<int>> queued; // Tiles left of each device
+    QVector<int> processed;
+    QVector<int> stolen;
+    QAtomicInt failed;
+};
+
+namespace {
+    /// Tile enqueued in a device
+    struct InFlight {
+        Image* input;
+        Image* output;
+        Event done; // Download of the result
+    };
+}
+
+/// Processes the tiles of a device in the threads of the scheduler
+class TileScheduler::Worker : public QRunnable
+{
+public:
+    Worker(Run& run, int device, QSemaphore* done) : _run(run), _device(device), _done(done) { }
+    void run() { processTiles(_run, _device); _done->release(); }
+private:
+    Run& _run;
+    const int _device;
+    QSemaphore* const _done;
+};
+
+TileScheduler::TileScheduler(QSize tileSize, int halo)
+    : _tileSize(tileSize)
+{
+    assert(tileSize.width() > 0 and tileSize.height() > 0);
+    assert(halo >= 0);
+    _halo= halo;
+    _stats.msecs= 0;
+}
+
+bool TileScheduler::run(Image& src, Image& dst, Process process)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if(src.size() != dst.size()) {
+        qDebug() << "TileScheduler::run: the images must have the same size.";
+        return false;
+    }
+    if(!src.sync() or !dst.sync())
+        return false;
+
+    // The tiles are uploaded from the source host data
+    if(!src._hostValid and src._devValid)
+        src.downloadAsync();
+    if(!src._hostValid or !src._waitHost()) {
+        qDebug() << "TileScheduler::run: the source image has no valid data.";
+        return false;
+    }
+    // The tiles are downloaded straight into the destination host buffer
+    if(!dst._hostBuffer and !dst._allocHost())
+        return false;
+    if(!dst._waitHost())
+        return false;
+
+    Run run;
+    run.src= &src;
+    run.dst= &dst;
+    run.process= process;
+    run.failed= 0;
+
+    QSize tileSize;
+    {
+        QMutexLocker locker(&_lock);
+        tileSize= _tileSize;
+        run.devIds= _devIds;
+    }
+    if(run.devIds.isEmpty()) {
+        for(int i=0; i<devMgr().devCount(); i++)
+            run.devIds << i;
+    }
+    const int devCount= run.devIds.count();
+
+    // Split the image, the halo is clamped to the image
+    const QRect bounds(QPoint(0, 0), src.size());
+    const int halo= _halo;
+    for(int y=0; y<bounds.height(); y+=tileSize.height()) {
+        for(int x=0; x<bounds.width(); x+=tileSize.width()) {
+            const QRect inner= QRect(x, y, tileSize.width(), tileSize.height()).intersected(bounds);
+            const Tile tile { inner, inner.adjusted(-halo, -halo, halo, halo).intersected(bounds) };
+            run.tiles << tile;
+        }
+    }
+
+    // Deal contiguous runs of tiles, so neighbour tiles share the device caches
+    run.queued.resize(devCount);
+    run.processed.fill(0, devCount);
+    run.stolen.fill(0, devCount);
+    for(int i=0; i<run.tiles.count(); i++)
+        run.queued[(qint64)i * devCount / run.tiles.count()] << i;
+
+    // The operations must run now, not be recorded by a graph of this thread
+    Graph* graph= Graph::current();
+    if(graph)
+        graph->end();
+
+    // The calling thread works for the first device
+    QSemaphore done;
+    for(int i=1; i<devCount; i++)
+        _pool.start(new Worker(run, i, &done));
+    processTiles(run, 0);
+    done.acquire(devCount - 1);
+
+    if(graph)
+        graph->begin();
+
+    // The tiles written before a failure leave the host buffer partly updated,
+    // the device copy is still the valid one then
+    if(run.failed) {
+        dst._hostValid= false;
+    } else {
+        dst._hostValid= true;
+        dst._devValid= false;
+    }
+
+    QMutexLocker locker(&_lock);
+    _stats.tiles= run.processed;
+    _stats.stolen= run.stolen;
+    _stats.msecs= timer.elapsed();
+    return !run.failed;
+}
+
+int TileScheduler::takeTile(Run& run, int device)
+{
+    QMutexLocker locker(&run.lock);
+    if(!run.queued[device].isEmpty()) {
+        run.processed[device]++;
+        return run.queued[device].takeFirst();
+    }
+
+    // Steal from the end of the longest queue, away from the tiles its device is processing
+    int victim= -1;
+    for(int i=0; i<run.queued.count(); i++) {
+        if(!run.queued[i].isEmpty() and (victim == -1 or run.queued[i].count() > run.queued[victim].count()))
+            victim= i;
+    }
+    if(victim == -1)
+        return -1;
+    run.processed[device]++;
+    run.stolen[device]++;
+    return run.queued[victim].takeLast();
+}
+
+void TileScheduler::processTiles(Run& run, int device)
+{
+    const int devId= run.devIds[device];
+    const cl_command_queue uploadQueue= devMgr().queue(devId, QueueRole::Upload);
+    const cl_command_queue downloadQueue= devMgr().queue(devId, QueueRole::Download);
+    const IFmt srcFormat= run.src->format();
+    const IFmt dstFormat= run.dst->format();
+    const int srcPixelBytes= iFmtBPP(srcFormat) / 8;
+    const int dstPixelBytes= iFmtBPP(dstFormat) / 8;
+    const int srcPitch= run.src->width() * srcPixelBytes;
+    const int dstPitch= run.dst->width() * dstPixelBytes;
+
+    QQueue<InFlight> inFlight;
+
+    int index;
+    while(!run.failed and (index= takeTile(run, device)) != -1) {
+        const Tile& tile= run.tiles[index];
+
+        // Tile images, recycled by the image pool
+        Image* input= new Image(tile.outer.width(), tile.outer.height(), srcFormat, devId, false, false, true);
+        Image* output= new Image(tile.outer.width(), tile.outer.height(), dstFormat, devId, false, false, true);
+        bool ok= input->_devBuffer and output->_devBuffer;
+        cl_int err;
+
+        // Upload the tile and its halo from the source rows
+        if(ok) {
+            const size_t origin[3] { 0, 0, 0 };
+            const size_t region[3] { (size_t)tile.outer.width(), (size_t)tile.outer.height(), 1 };
+            const char* data= run.src->_hostBuffer + (size_t)tile.outer.y() * srcPitch
+                              + tile.outer.x() * srcPixelBytes;
+            const auto waitList= Event::waitList(QVector<Event>() << input->_devEvent, uploadQueue);
+            cl_event event;
+            err= clEnqueueWriteImage(uploadQueue, input->_devBuffer, CL_FALSE, origin, region, srcPitch, 0, data,
+                                     waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+            ok= !checkCLError(err, "clEnqueueWriteImage");
+            if(ok) {
+                input->_devWritten(Event(event));
+                profiler().record(Profiler::Category::Upload, devId, input->_devEvent,
+                                  (qint64)tile.outer.width() * tile.outer.height() * srcPixelBytes);
+            }
+        }
+
+        ok= ok and run.process(*input, *output);
+
+        // Download the inner part into the destination rows
+        Event done;
+        if(ok) {
+            const size_t origin[3] { (size_t)(tile.inner.x() - tile.outer.x()),
+                                     (size_t)(tile.inner.y() - tile.outer.y()), 0 };
+            const size_t region[3] { (size_t)tile.inner.width(), (size_t)tile.inner.height(), 1 };
+            char* data= run.dst->_hostBuffer + (size_t)tile.inner.y() * dstPitch + tile.inner.x() * dstPixelBytes;
+            const auto waitList= Event::waitList(QVector<Event>() << output->_devEvent, downloadQueue);
+            cl_event event;
+            err= clEnqueueReadImage(downloadQueue, output->_devBuffer, CL_FALSE, origin, region, dstPitch, 0, data,
+                                    waitList.count(), waitList.count() ? waitList.data() : nullptr, &event);
+            ok= !checkCLError(err, "clEnqueueReadImage");
+            if(ok) {
+                done= Event(event);
+                output->_devEvent= done;
+                profiler().record(Profiler::Category::Download, devId, done,
+                                  (qint64)tile.inner.width() * tile.inner.height() * dstPixelBytes);
+            }
+            // With dedicated queues the upload of the next tile overlaps this one
+            devMgr().flush(devId);
+        }
+        if(!ok) {
+            qDebug() << "TileScheduler: tile" << tile.inner << "failed on device" << devId;
+            run.failed= 1;
+        }
+
+        const InFlight tileInFlight { input, output, done };
+        inFlight.enqueue(tileInFlight);
+        while(inFlight.count() >= maxTilesInFlight) {
+            const InFlight oldest= inFlight.dequeue();
+            if(!oldest.done.wait())
+                run.failed= 1;
+            delete oldest.input;
+            delete oldest.output;
+        }
+    }
+
+    while(!inFlight.isEmpty()) {
+        const InFlight oldest= inFlight.dequeue();
+        if(!oldest.done.wait())
+            run.failed= 1;
+        delete oldest.input;
+        delete oldest.output;
+    }
+}
+
+} // namespace QCLI
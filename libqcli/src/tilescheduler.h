@@ -0,0 +1,118 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_TILESCHEDULER_H
+#define _QCLI_TILESCHEDULER_H
+
+#include <QtCore>
+#include <functional>
+
+namespace QCLI {
+
+class Image;
+
+/** \brief Spreads an image operation over all the selected devices
+ *
+ *  The destination image is split in tiles, and every tile is processed by one
+ *  of the devices: the source pixels of the tile, plus a halo of neighbours
+ *  for neighbourhood operations, are uploaded to a tile image of the device,
+ *  the operation runs on it, and the inner part of the result is downloaded
+ *  straight into the destination host buffer:
+ *
+ *      TileScheduler scheduler(QSize(512, 512), 3); // 7x7 filter
+ *      scheduler.run(src, dst, [&](Image& in, Image& out) { return blur(in, out); });
+ *
+ *  The tiles are dealt to the devices in contiguous runs. A device that runs out
+ *  of tiles steals the last tiles of the device with the most tiles left, so
+ *  faster devices end up processing more tiles.
+ *
+ *  Tiles at the image border get no halo on that side, so operations clamping
+ *  the coordinates to the edge see the same pixels as on the whole image.
+ *
+ *  All functions are thread-safe.
+ */
+
+class TileScheduler
+{
+public:
+    /// Operation on a tile, runs on the device of the tile images
+    /// @retval false on error
+    typedef std::function<bool(Image& input, Image& output)> Process;
+
+    /// Distribution of the tiles of the last run
+    struct Stats {
+        QVector<int> tiles;  // Tiles processed by each device
+        QVector<int> stolen; // Tiles stolen by each device from the others
+        qint64 msecs;        // Duration of the run
+    };
+
+    /// @param halo pixels read around each output pixel by the operation
+    TileScheduler(QSize tileSize= QSize(512, 512), int halo= 0);
+
+    /// Returns the size of the tiles, without the halo
+    QSize tileSize() const { QMutexLocker l(&_lock); return _tileSize; }
+    /// Sets the size of the tiles, without the halo
+    void setTileSize(QSize size) { QMutexLocker l(&_lock); _tileSize= size; }
+    /// Returns the halo of the tiles
+    int halo() const { return _halo; }
+    /// Sets the halo of the tiles
+    void setHalo(int halo) { _halo= halo; }
+    /// Returns the indexes of the devices used, all the selected devices if empty
+    QVector<int> devices() const { QMutexLocker l(&_lock); return _devIds; }
+    /// Sets the indexes of the devices used, all the selected devices if empty
+    void setDevices(QVector<int> devIds) { QMutexLocker l(&_lock); _devIds= devIds; }
+
+    /// Runs process over src writing dst, blocking until the result is in the dst host buffer
+    /// @param dst image of the same size as src, of any format
+    /// @retval false on error
+    bool run(Image& src, Image& dst, Process process);
+
+    /// Returns the distribution of the tiles of the last run
+    Stats stats() const { QMutexLocker l(&_lock); return _stats; }
+
+    /// Disable copying
+    TileScheduler(const TileScheduler& other) = delete;
+    /// Disable assignments
+    TileScheduler& operator=(const TileScheduler& other) = delete;
+
+private:
+    /// Piece of the destination image
+    struct Tile {
+        QRect inner; // Pixels written
+        QRect outer; // Pixels read, inner plus the halo
+    };
+    /// State of a run shared by the device workers
+    struct Run;
+    class Worker;
+
+    /// Takes the next tile of a device, stealing it if needed
+    /// @retval -1 if there are no tiles left
+    static int takeTile(Run& run, int device);
+    /// Processes the tiles of a device until there are none left
+    static void processTiles(Run& run, int device);
+
+    // State
+    mutable QMutex _lock; // Mutable so it can be used in const getters
+    QSize _tileSize;
+    QAtomicInt _halo;
+    QVector<int> _devIds;
+    Stats _stats;
+    // Threads of the device workers, apart from the global pool so a run called
+    // from a pool thread can not wait for workers that never start
+    QThreadPool _pool;
+};
+
+} // namespace QCLI
+
+#endif // _QCLI_TILESCHEDULER_H
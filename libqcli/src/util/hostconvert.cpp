@@ -0,0 +1,815 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#include "hostconvert.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include "util/utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QCLI_X86
+#include <cpuid.h>
+#include <immintrin.h>
+// The vectorized paths are compiled for their instruction set only, the rest of
+// the library does not depend on it
+#define QCLI_TARGET_SSE2 __attribute__((target("sse2")))
+#define QCLI_TARGET_AVX2 __attribute__((target("avx2,f16c")))
+#endif
+
+// a*b + c must not become a fused multiply-add in the scalar code (-march=native
+// enables FMA), the vectorized code does not fuse them
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace QCLI {
+
+namespace {
+
+// Rows are converted through normalized float channel planes. Luma rows only
+// use r, g and b alias it and a points to a row of ones.
+struct Planes {
+    float* r;
+    float* g;
+    float* b;
+    float* a;
+};
+
+inline Planes offset(const Planes& p, int i) { return Planes { p.r + i, p.g + i, p.b + i, p.a + i }; }
+
+/// Reads a row of pixels into the planes
+typedef void (*DecodeFn)(const uchar* src, int width, const Planes& p);
+/// Writes a row of pixels from the planes
+typedef void (*EncodeFn)(const Planes& p, int width, uchar* dst);
+/// Computes the luma of a row, luma may be p.r
+typedef void (*LumaFn)(const Planes& p, int width, float* luma);
+
+const float unorm8Scale= 1.0f / 255.0f;
+const float unorm16Scale= 1.0f / 65535.0f;
+// Weights of qGray(), like the device conversion kernel
+const float lumaR= 0.34375f;
+const float lumaG= 0.5f;
+const float lumaB= 0.15625f;
+
+//
+// Scalar reference implementation
+//
+
+// max(x, 0) and min(x, 1) with the NaN semantics of maxps/minps (NaN becomes 0)
+inline float clamp01(float x)
+{
+    x= x > 0.0f ? x : 0.0f;
+    return x < 1.0f ? x : 1.0f;
+}
+
+// lrintf rounds to nearest even, like cvtps2dq and the device
+inline uint8_t toUnorm8(float x) { return (uint8_t)lrintf(clamp01(x) * 255.0f); }
+inline uint16_t toUnorm16(float x) { return (uint16_t)lrintf(clamp01(x) * 65535.0f); }
+
+// Exact conversion, NaNs are quieted like vcvtph2ps
+inline float halfToFloat(uint16_t h)
+{
+    const uint32_t sign= (uint32_t)(h & 0x8000) << 16;
+    const uint32_t exponent= (h >> 10) & 0x1F;
+    const uint32_t mantissa= h & 0x3FF;
+    uint32_t bits;
+    if(!exponent) {
+        // Zero or subnormal, the product is exact
+        const float value= mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &value, sizeof(bits));
+        bits|= sign;
+    }
+    else if(exponent == 31)
+        bits= sign | 0x7F800000 | (mantissa << 13) | (mantissa ? 0x400000 : 0);
+    else
+        bits= sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float ret;
+    memcpy(&ret, &bits, sizeof(ret));
+    return ret;
+}
+
+// Round to nearest even, like vcvtps2ph with _MM_FROUND_TO_NEAREST_INT
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign= (bits >> 16) & 0x8000;
+    bits&= 0x7FFFFFFF;
+
+    if(bits >= 0x47800000) {
+        // Too big for a half (infinity) or NaN (quieted, top of the payload kept)
+        if(bits > 0x7F800000)
+            return sign | 0x7E00 | ((bits >> 13) & 0x3FF);
+        return sign | 0x7C00;
+    }
+    if(bits < 0x38800000) {
+        // Subnormal half or zero, the float addition rounds the mantissa
+        float shifted;
+        memcpy(&shifted, &bits, sizeof(shifted));
+        shifted+= 0.5f;
+        memcpy(&bits, &shifted, sizeof(bits));
+        return sign | (bits - 0x3F000000);
+    }
+    // Normal half, rebias the exponent and round the mantissa
+    const uint32_t odd= (bits >> 13) & 1;
+    bits+= 0xC8000FFF + odd; // ((15 - 127) << 23) + 0xFFF
+    return sign | (bits >> 13);
+}
+
+void decodeARGB(const uchar* src, int width, const Planes& p)
+{
+    // QImage::Format_ARGB32 words
+    const uint32_t* px= reinterpret_cast<const uint32_t*>(src);
+    for(int i=0; i<width; i++) {
+        p.b[i]= (px[i] & 0xFF) * unorm8Scale;
+        p.g[i]= ((px[i] >> 8) & 0xFF) * unorm8Scale;
+        p.r[i]= ((px[i] >> 16) & 0xFF) * unorm8Scale;
+        p.a[i]= (px[i] >> 24) * unorm8Scale;
+    }
+}
+
+void encodeARGB(const Planes& p, int width, uchar* dst)
+{
+    uint32_t* px= reinterpret_cast<uint32_t*>(dst);
+    for(int i=0; i<width; i++) {
+        px[i]= toUnorm8(p.b[i]) | (toUnorm8(p.g[i]) << 8) | (toUnorm8(p.r[i]) << 16)
+               | ((uint32_t)toUnorm8(p.a[i]) << 24);
+    }
+}
+
+void decodeARGB16(const uchar* src, int width, const Planes& p)
+{
+    const uint16_t* px= reinterpret_cast<const uint16_t*>(src);
+    for(int i=0; i<width; i++) {
+        p.r[i]= px[4*i] * unorm16Scale;
+        p.g[i]= px[4*i+1] * unorm16Scale;
+        p.b[i]= px[4*i+2] * unorm16Scale;
+        p.a[i]= px[4*i+3] * unorm16Scale;
+    }
+}
+
+void encodeARGB16(const Planes& p, int width, uchar* dst)
+{
+    uint16_t* px= reinterpret_cast<uint16_t*>(dst);
+    for(int i=0; i<width; i++) {
+        px[4*i]= toUnorm16(p.r[i]);
+        px[4*i+1]= toUnorm16(p.g[i]);
+        px[4*i+2]= toUnorm16(p.b[i]);
+        px[4*i+3]= toUnorm16(p.a[i]);
+    }
+}
+
+void decodeARGB16F(const uchar* src, int width, const Planes& p)
+{
+    const uint16_t* px= reinterpret_cast<const uint16_t*>(src);
+    for(int i=0; i<width; i++) {
+        p.r[i]= halfToFloat(px[4*i]);
+        p.g[i]= halfToFloat(px[4*i+1]);
+        p.b[i]= halfToFloat(px[4*i+2]);
+        p.a[i]= halfToFloat(px[4*i+3]);
+    }
+}
+
+void encodeARGB16F(const Planes& p, int width, uchar* dst)
+{
+    uint16_t* px= reinterpret_cast<uint16_t*>(dst);
+    for(int i=0; i<width; i++) {
+        px[4*i]= floatToHalf(p.r[i]);
+        px[4*i+1]= floatToHalf(p.g[i]);
+        px[4*i+2]= floatToHalf(p.b[i]);
+        px[4*i+3]= floatToHalf(p.a[i]);
+    }
+}
+
+void decodeARGB32F(const uchar* src, int width, const Planes& p)
+{
+    const float* px= reinterpret_cast<const float*>(src);
+    for(int i=0; i<width; i++) {
+        p.r[i]= px[4*i];
+        p.g[i]= px[4*i+1];
+        p.b[i]= px[4*i+2];
+        p.a[i]= px[4*i+3];
+    }
+}
+
+void encodeARGB32F(const Planes& p, int width, uchar* dst)
+{
+    float* px= reinterpret_cast<float*>(dst);
+    for(int i=0; i<width; i++) {
+        px[4*i]= p.r[i];
+        px[4*i+1]= p.g[i];
+        px[4*i+2]= p.b[i];
+        px[4*i+3]= p.a[i];
+    }
+}
+
+void decodeLUMA(const uchar* src, int width, const Planes& p)
+{
+    for(int i=0; i<width; i++)
+        p.r[i]= src[i] * unorm8Scale;
+}
+
+void encodeLUMA(const Planes& p, int width, uchar* dst)
+{
+    for(int i=0; i<width; i++)
+        dst[i]= toUnorm8(p.r[i]);
+}
+
+void decodeLUMA16(const uchar* src, int width, const Planes& p)
+{
+    const uint16_t* px= reinterpret_cast<const uint16_t*>(src);
+    for(int i=0; i<width; i++)
+        p.r[i]= px[i] * unorm16Scale;
+}
+
+void encodeLUMA16(const Planes& p, int width, uchar* dst)
+{
+    uint16_t* px= reinterpret_cast<uint16_t*>(dst);
+    for(int i=0; i<width; i++)
+        px[i]= toUnorm16(p.r[i]);
+}
+
+void decodeLUMA16F(const uchar* src, int width, const Planes& p)
+{
+    const uint16_t* px= reinterpret_cast<const uint16_t*>(src);
+    for(int i=0; i<width; i++)
+        p.r[i]= halfToFloat(px[i]);
+}
+
+void encodeLUMA16F(const Planes& p, int width, uchar* dst)
+{
+    uint16_t* px= reinterpret_cast<uint16_t*>(dst);
+    for(int i=0; i<width; i++)
+        px[i]= floatToHalf(p.r[i]);
+}
+
+// Float luma is copied at every level, there is nothing to vectorize
+void decodeLUMA32F(const uchar* src, int width, const Planes& p)
+{
+    memcpy(p.r, src, width * sizeof(float));
+}
+
+void encodeLUMA32F(const Planes& p, int width, uchar* dst)
+{
+    memcpy(dst, p.r, width * sizeof(float));
+}
+
+void luma(const Planes& p, int width, float* luma)
+{
+    for(int i=0; i<width; i++)
+        luma[i]= p.r[i] * lumaR + p.g[i] * lumaG + p.b[i] * lumaB;
+}
+
+#ifdef QCLI_X86
+
+//
+// SSE2, 4 pixels per iteration and the scalar code for the remaining ones
+//
+
+QCLI_TARGET_SSE2 inline __m128 clamp01(__m128 x)
+{
+    return _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+}
+
+QCLI_TARGET_SSE2 void decodeARGB_sse2(const uchar* src, int width, const Planes& p)
+{
+    const __m128i mask= _mm_set1_epi32(0xFF);
+    const __m128 scale= _mm_set1_ps(unorm8Scale);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        const __m128i px= _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4*i));
+        _mm_storeu_ps(p.b + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(px, mask)), scale));
+        _mm_storeu_ps(p.g + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask)), scale));
+        _mm_storeu_ps(p.r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask)), scale));
+        _mm_storeu_ps(p.a + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(px, 24)), scale));
+    }
+    decodeARGB(src + 4*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_SSE2 void encodeARGB_sse2(const Planes& p, int width, uchar* dst)
+{
+    const __m128 scale= _mm_set1_ps(255.0f);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        const __m128i b= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.b + i)), scale));
+        const __m128i g= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.g + i)), scale));
+        const __m128i r= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i)), scale));
+        const __m128i a= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.a + i)), scale));
+        const __m128i px= _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                                       _mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(a, 24)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4*i), px);
+    }
+    encodeARGB(offset(p, i), width - i, dst + 4*i);
+}
+
+QCLI_TARGET_SSE2 void decodeARGB16_sse2(const uchar* src, int width, const Planes& p)
+{
+    const __m128i mask= _mm_set1_epi32(0xFFFF);
+    const __m128 scale= _mm_set1_ps(unorm16Scale);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        // Gather the RG and BA halves of the 4 pixels
+        const __m128i px01= _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8*i)),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+        const __m128i px23= _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8*i + 16)),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+        const __m128i rg= _mm_unpacklo_epi64(px01, px23);
+        const __m128i ba= _mm_unpackhi_epi64(px01, px23);
+        _mm_storeu_ps(p.r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(rg, mask)), scale));
+        _mm_storeu_ps(p.g + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(rg, 16)), scale));
+        _mm_storeu_ps(p.b + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(ba, mask)), scale));
+        _mm_storeu_ps(p.a + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(ba, 16)), scale));
+    }
+    decodeARGB16(src + 8*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_SSE2 void encodeARGB16_sse2(const Planes& p, int width, uchar* dst)
+{
+    const __m128 scale= _mm_set1_ps(65535.0f);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        const __m128i r= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i)), scale));
+        const __m128i g= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.g + i)), scale));
+        const __m128i b= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.b + i)), scale));
+        const __m128i a= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.a + i)), scale));
+        const __m128i rg= _mm_or_si128(r, _mm_slli_epi32(g, 16));
+        const __m128i ba= _mm_or_si128(b, _mm_slli_epi32(a, 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8*i), _mm_unpacklo_epi32(rg, ba));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8*i + 16), _mm_unpackhi_epi32(rg, ba));
+    }
+    encodeARGB16(offset(p, i), width - i, dst + 8*i);
+}
+
+QCLI_TARGET_SSE2 void decodeARGB32F_sse2(const uchar* src, int width, const Planes& p)
+{
+    const float* px= reinterpret_cast<const float*>(src);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        __m128 r= _mm_loadu_ps(px + 4*i);
+        __m128 g= _mm_loadu_ps(px + 4*i + 4);
+        __m128 b= _mm_loadu_ps(px + 4*i + 8);
+        __m128 a= _mm_loadu_ps(px + 4*i + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_storeu_ps(p.r + i, r);
+        _mm_storeu_ps(p.g + i, g);
+        _mm_storeu_ps(p.b + i, b);
+        _mm_storeu_ps(p.a + i, a);
+    }
+    decodeARGB32F(src + 16*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_SSE2 void encodeARGB32F_sse2(const Planes& p, int width, uchar* dst)
+{
+    float* px= reinterpret_cast<float*>(dst);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        __m128 px0= _mm_loadu_ps(p.r + i);
+        __m128 px1= _mm_loadu_ps(p.g + i);
+        __m128 px2= _mm_loadu_ps(p.b + i);
+        __m128 px3= _mm_loadu_ps(p.a + i);
+        _MM_TRANSPOSE4_PS(px0, px1, px2, px3);
+        _mm_storeu_ps(px + 4*i, px0);
+        _mm_storeu_ps(px + 4*i + 4, px1);
+        _mm_storeu_ps(px + 4*i + 8, px2);
+        _mm_storeu_ps(px + 4*i + 12, px3);
+    }
+    encodeARGB32F(offset(p, i), width - i, dst + 16*i);
+}
+
+QCLI_TARGET_SSE2 void decodeLUMA_sse2(const uchar* src, int width, const Planes& p)
+{
+    const __m128i zero= _mm_setzero_si128();
+    const __m128 scale= _mm_set1_ps(unorm8Scale);
+    int i= 0;
+    for(; i+16<=width; i+=16) {
+        const __m128i px= _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i lo= _mm_unpacklo_epi8(px, zero);
+        const __m128i hi= _mm_unpackhi_epi8(px, zero);
+        _mm_storeu_ps(p.r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+        _mm_storeu_ps(p.r + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+        _mm_storeu_ps(p.r + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+        _mm_storeu_ps(p.r + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+    }
+    decodeLUMA(src + i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_SSE2 void encodeLUMA_sse2(const Planes& p, int width, uchar* dst)
+{
+    const __m128 scale= _mm_set1_ps(255.0f);
+    int i= 0;
+    for(; i+16<=width; i+=16) {
+        const __m128i l0= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i)), scale));
+        const __m128i l1= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i + 4)), scale));
+        const __m128i l2= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i + 8)), scale));
+        const __m128i l3= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i + 12)), scale));
+        const __m128i px= _mm_packus_epi16(_mm_packs_epi32(l0, l1), _mm_packs_epi32(l2, l3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), px);
+    }
+    encodeLUMA(offset(p, i), width - i, dst + i);
+}
+
+QCLI_TARGET_SSE2 void decodeLUMA16_sse2(const uchar* src, int width, const Planes& p)
+{
+    const __m128i zero= _mm_setzero_si128();
+    const __m128 scale= _mm_set1_ps(unorm16Scale);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m128i px= _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2*i));
+        _mm_storeu_ps(p.r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(px, zero)), scale));
+        _mm_storeu_ps(p.r + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(px, zero)), scale));
+    }
+    decodeLUMA16(src + 2*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_SSE2 void encodeLUMA16_sse2(const Planes& p, int width, uchar* dst)
+{
+    // SSE2 only has a signed 32 to 16-bit pack, shift the values to the signed range
+    const __m128 scale= _mm_set1_ps(65535.0f);
+    const __m128i bias= _mm_set1_epi32(0x8000);
+    const __m128i unbias= _mm_set1_epi16((short)0x8000);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m128i l0= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i)), scale));
+        const __m128i l1= _mm_cvtps_epi32(_mm_mul_ps(clamp01(_mm_loadu_ps(p.r + i + 4)), scale));
+        const __m128i px= _mm_packs_epi32(_mm_sub_epi32(l0, bias), _mm_sub_epi32(l1, bias));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2*i), _mm_xor_si128(px, unbias));
+    }
+    encodeLUMA16(offset(p, i), width - i, dst + 2*i);
+}
+
+QCLI_TARGET_SSE2 void luma_sse2(const Planes& p, int width, float* luma)
+{
+    const __m128 wr= _mm_set1_ps(lumaR);
+    const __m128 wg= _mm_set1_ps(lumaG);
+    const __m128 wb= _mm_set1_ps(lumaB);
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        const __m128 rg= _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p.r + i), wr), _mm_mul_ps(_mm_loadu_ps(p.g + i), wg));
+        _mm_storeu_ps(luma + i, _mm_add_ps(rg, _mm_mul_ps(_mm_loadu_ps(p.b + i), wb)));
+    }
+    QCLI::luma(offset(p, i), width - i, luma + i);
+}
+
+//
+// AVX2, 8 pixels per iteration. F16C converts the half floats.
+//
+
+QCLI_TARGET_AVX2 inline __m256 clamp01(__m256 x)
+{
+    return _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+}
+
+QCLI_TARGET_AVX2 void decodeARGB_avx2(const uchar* src, int width, const Planes& p)
+{
+    const __m256i mask= _mm256_set1_epi32(0xFF);
+    const __m256 scale= _mm256_set1_ps(unorm8Scale);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i px= _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4*i));
+        _mm256_storeu_ps(p.b + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(px, mask)), scale));
+        _mm256_storeu_ps(p.g + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), mask)),
+                                                scale));
+        _mm256_storeu_ps(p.r + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 16), mask)),
+                                                scale));
+        _mm256_storeu_ps(p.a + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(px, 24)), scale));
+    }
+    decodeARGB(src + 4*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_AVX2 void encodeARGB_avx2(const Planes& p, int width, uchar* dst)
+{
+    const __m256 scale= _mm256_set1_ps(255.0f);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i b= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.b + i)), scale));
+        const __m256i g= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.g + i)), scale));
+        const __m256i r= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.r + i)), scale));
+        const __m256i a= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.a + i)), scale));
+        const __m256i px= _mm256_or_si256(_mm256_or_si256(b, _mm256_slli_epi32(g, 8)),
+                                          _mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(a, 24)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4*i), px);
+    }
+    encodeARGB(offset(p, i), width - i, dst + 4*i);
+}
+
+QCLI_TARGET_AVX2 void decodeARGB16F_avx2(const uchar* src, int width, const Planes& p)
+{
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        // One pixel per register, then transposed to the planes
+        __m128 r= _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 8*i)));
+        __m128 g= _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 8*i + 8)));
+        __m128 b= _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 8*i + 16)));
+        __m128 a= _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 8*i + 24)));
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_storeu_ps(p.r + i, r);
+        _mm_storeu_ps(p.g + i, g);
+        _mm_storeu_ps(p.b + i, b);
+        _mm_storeu_ps(p.a + i, a);
+    }
+    decodeARGB16F(src + 8*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_AVX2 void encodeARGB16F_avx2(const Planes& p, int width, uchar* dst)
+{
+    int i= 0;
+    for(; i+4<=width; i+=4) {
+        __m128 px0= _mm_loadu_ps(p.r + i);
+        __m128 px1= _mm_loadu_ps(p.g + i);
+        __m128 px2= _mm_loadu_ps(p.b + i);
+        __m128 px3= _mm_loadu_ps(p.a + i);
+        _MM_TRANSPOSE4_PS(px0, px1, px2, px3);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 8*i), _mm_cvtps_ph(px0, _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 8*i + 8), _mm_cvtps_ph(px1, _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 8*i + 16), _mm_cvtps_ph(px2, _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 8*i + 24), _mm_cvtps_ph(px3, _MM_FROUND_TO_NEAREST_INT));
+    }
+    encodeARGB16F(offset(p, i), width - i, dst + 8*i);
+}
+
+QCLI_TARGET_AVX2 void decodeLUMA_avx2(const uchar* src, int width, const Planes& p)
+{
+    const __m256 scale= _mm256_set1_ps(unorm8Scale);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i px= _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(p.r + i, _mm256_mul_ps(_mm256_cvtepi32_ps(px), scale));
+    }
+    decodeLUMA(src + i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_AVX2 void encodeLUMA_avx2(const Planes& p, int width, uchar* dst)
+{
+    const __m256 scale= _mm256_set1_ps(255.0f);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i l= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.r + i)), scale));
+        // The 256-bit packs work per 128-bit lane, pack the lanes instead
+        const __m128i words= _mm_packs_epi32(_mm256_castsi256_si128(l), _mm256_extracti128_si256(l, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(words, words));
+    }
+    encodeLUMA(offset(p, i), width - i, dst + i);
+}
+
+QCLI_TARGET_AVX2 void decodeLUMA16_avx2(const uchar* src, int width, const Planes& p)
+{
+    const __m256 scale= _mm256_set1_ps(unorm16Scale);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i px= _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2*i)));
+        _mm256_storeu_ps(p.r + i, _mm256_mul_ps(_mm256_cvtepi32_ps(px), scale));
+    }
+    decodeLUMA16(src + 2*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_AVX2 void encodeLUMA16_avx2(const Planes& p, int width, uchar* dst)
+{
+    const __m256 scale= _mm256_set1_ps(65535.0f);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256i l= _mm256_cvtps_epi32(_mm256_mul_ps(clamp01(_mm256_loadu_ps(p.r + i)), scale));
+        const __m128i px= _mm_packus_epi32(_mm256_castsi256_si128(l), _mm256_extracti128_si256(l, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2*i), px);
+    }
+    encodeLUMA16(offset(p, i), width - i, dst + 2*i);
+}
+
+QCLI_TARGET_AVX2 void decodeLUMA16F_avx2(const uchar* src, int width, const Planes& p)
+{
+    int i= 0;
+    for(; i+8<=width; i+=8)
+        _mm256_storeu_ps(p.r + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2*i))));
+    decodeLUMA16F(src + 2*i, width - i, offset(p, i));
+}
+
+QCLI_TARGET_AVX2 void encodeLUMA16F_avx2(const Planes& p, int width, uchar* dst)
+{
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m128i px= _mm256_cvtps_ph(_mm256_loadu_ps(p.r + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2*i), px);
+    }
+    encodeLUMA16F(offset(p, i), width - i, dst + 2*i);
+}
+
+QCLI_TARGET_AVX2 void luma_avx2(const Planes& p, int width, float* luma)
+{
+    const __m256 wr= _mm256_set1_ps(lumaR);
+    const __m256 wg= _mm256_set1_ps(lumaG);
+    const __m256 wb= _mm256_set1_ps(lumaB);
+    int i= 0;
+    for(; i+8<=width; i+=8) {
+        const __m256 rg= _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p.r + i), wr),
+                                       _mm256_mul_ps(_mm256_loadu_ps(p.g + i), wg));
+        _mm256_storeu_ps(luma + i, _mm256_add_ps(rg, _mm256_mul_ps(_mm256_loadu_ps(p.b + i), wb)));
+    }
+    QCLI::luma(offset(p, i), width - i, luma + i);
+}
+
+#endif // QCLI_X86
+
+//
+// Dispatch
+//
+
+/// Row functions of a format at an instruction set level
+struct Codec {
+    DecodeFn decode;
+    EncodeFn encode;
+};
+
+// Indexed by SimdLevel and iFmtType(), formats without a vectorized version
+// use the best lower level
+#ifdef QCLI_X86
+const Codec codecs[3][8]= {
+    {   { decodeARGB, encodeARGB }, { decodeARGB16, encodeARGB16 },
+        { decodeARGB16F, encodeARGB16F }, { decodeARGB32F, encodeARGB32F },
+        { decodeLUMA, encodeLUMA }, { decodeLUMA16, encodeLUMA16 },
+        { decodeLUMA16F, encodeLUMA16F }, { decodeLUMA32F, encodeLUMA32F } },
+    {   { decodeARGB_sse2, encodeARGB_sse2 }, { decodeARGB16_sse2, encodeARGB16_sse2 },
+        { decodeARGB16F, encodeARGB16F }, { decodeARGB32F_sse2, encodeARGB32F_sse2 },
+        { decodeLUMA_sse2, encodeLUMA_sse2 }, { decodeLUMA16_sse2, encodeLUMA16_sse2 },
+        { decodeLUMA16F, encodeLUMA16F }, { decodeLUMA32F, encodeLUMA32F } },
+    {   { decodeARGB_avx2, encodeARGB_avx2 }, { decodeARGB16_sse2, encodeARGB16_sse2 },
+        { decodeARGB16F_avx2, encodeARGB16F_avx2 }, { decodeARGB32F_sse2, encodeARGB32F_sse2 },
+        { decodeLUMA_avx2, encodeLUMA_avx2 }, { decodeLUMA16_avx2, encodeLUMA16_avx2 },
+        { decodeLUMA16F_avx2, encodeLUMA16F_avx2 }, { decodeLUMA32F, encodeLUMA32F } }
+};
+const LumaFn lumaFns[3]= { luma, luma_sse2, luma_avx2 };
+#else
+const Codec codecs[1][8]= {
+    {   { decodeARGB, encodeARGB }, { decodeARGB16, encodeARGB16 },
+        { decodeARGB16F, encodeARGB16F }, { decodeARGB32F, encodeARGB32F },
+        { decodeLUMA, encodeLUMA }, { decodeLUMA16, encodeLUMA16 },
+        { decodeLUMA16F, encodeLUMA16F }, { decodeLUMA32F, encodeLUMA32F } }
+};
+const LumaFn lumaFns[1]= { luma };
+#endif
+
+SimdLevel detectSimdLevel()
+{
+#ifdef QCLI_X86
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) or !(edx & bit_SSE2))
+        return SimdLevel::Scalar;
+
+    // AVX needs the OS to save the YMM registers (OSXSAVE and XCR0 bits 1 and 2)
+    const bool f16c= ecx & bit_F16C;
+    bool ymmSaved= false;
+    if((ecx & bit_OSXSAVE) and (ecx & bit_AVX)) {
+        unsigned int xcr0, xcr0High;
+        __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+        ymmSaved= (xcr0 & 0x6) == 0x6;
+    }
+    if(ymmSaved and f16c and __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) and (ebx & bit_AVX2))
+        return SimdLevel::AVX2;
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+/// Conversion of a band of rows
+struct Job {
+    const uchar* src;
+    int srcStride;
+    uchar* dst;
+    int dstStride;
+    int width;
+    bool srcLuma;
+    bool dstLuma;
+    Codec srcCodec;
+    Codec dstCodec;
+    LumaFn luma;
+};
+
+// @retval false if the row buffers could not be allocated
+bool convertRows(const Job& job, int firstRow, int lastRow)
+{
+    // Channel planes and a row of ones for the alpha of luma sources
+    const int width= job.width;
+    const int planeSize= roundUp(width, 8);
+    float* const buffer= static_cast<float*>(alignedAlloc(5 * planeSize * sizeof(float), 32));
+    if(!buffer) {
+        qDebug() << "convertPixels: could not allocate the row buffers.";
+        return false;
+    }
+    float* const ones= buffer + 4 * planeSize;
+    for(int i=0; i<width; i++)
+        ones[i]= 1.0f;
+    Planes planes { buffer, buffer + planeSize, buffer + 2 * planeSize, buffer + 3 * planeSize };
+    if(job.srcLuma)
+        planes= Planes { buffer, buffer, buffer, ones };
+
+    for(int row=firstRow; row<lastRow; row++) {
+        job.srcCodec.decode(job.src + (size_t)row * job.srcStride, width, planes);
+        if(job.dstLuma and !job.srcLuma)
+            job.luma(planes, width, planes.r);
+        job.dstCodec.encode(planes, width, job.dst + (size_t)row * job.dstStride);
+    }
+    alignedFree(buffer);
+    return true;
+}
+
+/// Converts a band of rows in the thread pool
+class Band : public QRunnable
+{
+public:
+    Band(const Job& job, int firstRow, int lastRow, QAtomicInt* failed, QSemaphore* done)
+        : _job(job), _firstRow(firstRow), _lastRow(lastRow), _failed(failed), _done(done) { }
+    void run()
+    {
+        if(!convertRows(_job, _firstRow, _lastRow))
+            *_failed= 1;
+        _done->release();
+    }
+private:
+    const Job _job;
+    const int _firstRow;
+    const int _lastRow;
+    QAtomicInt* const _failed;
+    QSemaphore* const _done;
+};
+
+// Images smaller than this are converted in the calling thread
+const int minThreadedPixels= 256 * 256;
+
+// Threads of the bands, apart from the global pool so a conversion called from a
+// pool thread (e.g. by TileScheduler) can not wait for bands that never start
+QThreadPool& bandPool()
+{
+    static QThreadPool pool;
+    return pool;
+}
+
+} // namespace
+
+SimdLevel hostSimdLevel()
+{
+    static const SimdLevel level= detectSimdLevel();
+    return level;
+}
+
+bool convertPixels(const void* src, IFmt srcFormat, int srcStride, void* dst, IFmt dstFormat, int dstStride,
+                   int width, int height, SimdLevel level, int threadCount)
+{
+    if(!src or !dst or width <= 0 or height <= 0) {
+        qDebug() << "convertPixels: invalid image.";
+        return false;
+    }
+    const int srcRowBytes= width * iFmtBPP(srcFormat) / 8;
+    const int dstRowBytes= width * iFmtBPP(dstFormat) / 8;
+    if(!srcStride)
+        srcStride= srcRowBytes;
+    if(!dstStride)
+        dstStride= dstRowBytes;
+    if(srcStride < srcRowBytes or dstStride < dstRowBytes) {
+        qDebug() << "convertPixels: the strides are smaller than the rows.";
+        return false;
+    }
+
+    const uchar* const srcData= static_cast<const uchar*>(src);
+    uchar* const dstData= static_cast<uchar*>(dst);
+    if(srcFormat == dstFormat) {
+        for(int row=0; row<height; row++)
+            memcpy(dstData + (size_t)row * dstStride, srcData + (size_t)row * srcStride, srcRowBytes);
+        return true;
+    }
+
+    const int levelIndex= qMin(qMin((int)level, (int)hostSimdLevel()), (int)(sizeof(lumaFns) / sizeof(LumaFn)) - 1);
+    const Job job { srcData, srcStride, dstData, dstStride, width,
+                    iFmtChanCount(srcFormat) == 1, iFmtChanCount(dstFormat) == 1,
+                    codecs[levelIndex][iFmtType(srcFormat)], codecs[levelIndex][iFmtType(dstFormat)],
+                    lumaFns[levelIndex] };
+
+    // Split the rows in bands, the calling thread converts the first one
+    if(!threadCount)
+        threadCount= width * height < minThreadedPixels ? 1 : QThread::idealThreadCount();
+    threadCount= qBound(1, threadCount, height);
+    QAtomicInt failed;
+    QSemaphore done;
+    const int rowsPerBand= (height + threadCount - 1) / threadCount;
+    int bands= 0;
+    for(int firstRow=rowsPerBand; firstRow<height; firstRow+=rowsPerBand, bands++)
+        bandPool().start(new Band(job, firstRow, qMin(firstRow + rowsPerBand, height), &failed, &done));
+    const bool ok= convertRows(job, 0, qMin(rowsPerBand, height));
+    done.acquire(bands);
+    return ok and !failed;
+}
+
+} // namespace QCLI
@@ -0,0 +1,53 @@
+/*
+ *   Copyright (C) 2012 by the libQCLI authors (see AUTHORS)
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Library General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Library General Public License for more details.
+ */
+
+#ifndef _QCLI_HOSTCONVERT_H
+#define _QCLI_HOSTCONVERT_H
+
+#include <QtCore>
+
+#include "ifmt.h"
+
+namespace QCLI {
+
+/// \brief Pixel format conversions on the host
+///
+/// Conversions between every pair of IFmt values, for images that only live in
+/// the host or whose format is not supported by the device. They give the same
+/// results as Image::convertTo() (normalized channels, qGray() luma weights,
+/// round to nearest even), and the vectorized code paths give exactly the same
+/// bytes as the scalar one.
+
+/// Instruction sets used by the host conversions
+enum class SimdLevel
+{
+    Scalar, /// Portable C++, the reference implementation
+    SSE2,   /// 4 pixels per iteration
+    AVX2    /// 8 pixels per iteration, F16C for the half-float formats
+};
+
+/// Returns the best instruction set supported by the CPU and the OS (CPUID)
+SimdLevel hostSimdLevel();
+
+/// Converts the pixels of an image from srcFormat to dstFormat
+/// @param srcStride, dstStride bytes per row, 0 for tightly packed rows
+/// @param level best instruction set to use, lowered to hostSimdLevel()
+/// @param threadCount number of threads, 0 to split big images among QThread::idealThreadCount()
+/// @retval false on error
+bool convertPixels(const void* src, IFmt srcFormat, int srcStride, void* dst, IFmt dstFormat, int dstStride,
+                   int width, int height, SimdLevel level= SimdLevel::AVX2, int threadCount= 0);
+
+} // namespace QCLI
+
+#endif // _QCLI_HOSTCONVERT_H
@@ -13,7 +13,16 @@
  */
 
 #include "utils.h"
+#include <cstdlib>
 #include <iostream>
+#ifdef _WIN32
+#  include <malloc.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
 
 namespace QCLI {
 
@@ -93,4 +102,78 @@ QSharedPointer<char> clFillingBlack()
     return data;
 }
 
+void* alignedAlloc(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr= nullptr;
+    return posix_memalign(&ptr, alignment, size) ? nullptr : ptr;
+#endif
+}
+
+void alignedFree(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void* mapFile(const QString& fileName, size_t* size)
+{
+#ifdef _WIN32
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly) or !file.size())
+        return nullptr;
+    *size= file.size();
+    void* ptr= alignedAlloc(*size, 4096);
+    if(ptr and file.read(static_cast<char*>(ptr), *size) != (qint64)*size) {
+        alignedFree(ptr);
+        return nullptr;
+    }
+    return ptr;
+#else
+    const int fd= open(QFile::encodeName(fileName).constData(), O_RDONLY);
+    if(fd == -1)
+        return nullptr;
+    struct stat info;
+    void* ptr= nullptr;
+    if(!fstat(fd, &info) and info.st_size) {
+        *size= info.st_size;
+        ptr= mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED)
+            ptr= nullptr;
+    }
+    // The mapping keeps the file open
+    close(fd);
+    return ptr;
+#endif
+}
+
+void unmapFile(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    Q_UNUSED(size);
+    alignedFree(ptr);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+QString clDeviceString(cl_device_id device, cl_device_info param)
+{
+    size_t size;
+    cl_int err= clGetDeviceInfo(device, param, 0, nullptr, &size);
+    if(checkCLError(err, "clGetDeviceInfo") or !size)
+        return QString();
+    QByteArray value(size, '\0');
+    err= clGetDeviceInfo(device, param, size, value.data(), nullptr);
+    if(checkCLError(err, "clGetDeviceInfo"))
+        return QString();
+    // Remove the null terminator
+    return QString::fromLatin1(value.constData()).trimmed();
+}
+
 } // namespace QCLI
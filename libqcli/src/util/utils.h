@@ -36,6 +36,39 @@ bool checkCLError_func(cl_int error, string funcName, string message);
 /// Returns a black fill_color for clEnqueueFillImage
 QSharedPointer<char> clFillingBlack();
 
+/// Allocates memory aligned to alignment bytes (a power of two)
+/// @retval nullptr on error
+void* alignedAlloc(size_t size, size_t alignment);
+/// Frees memory allocated with alignedAlloc
+void alignedFree(void* ptr);
+
+/// Maps a whole file in memory copy-on-write, the pages can be written without
+/// changing the file (on Windows the file is read in aligned memory instead)
+/// @param size returns the size of the file
+/// @retval nullptr on error or if the file is empty
+void* mapFile(const QString& fileName, size_t* size);
+/// Unmaps a file mapped with mapFile
+void unmapFile(void* ptr, size_t size);
+
+/// Rounds value up to the next multiple of multiple
+inline size_t roundUp(size_t value, size_t multiple)
+    { return ((value + multiple - 1) / multiple) * multiple; }
+
+/// Returns a scalar property of a device (CL_DEVICE_MAX_COMPUTE_UNITS, etc.)
+/// @retval T() on error
+template<typename T>
+T clDeviceInfo(cl_device_id device, cl_device_info param)
+{
+    T value= T();
+    cl_int err= clGetDeviceInfo(device, param, sizeof(T), &value, nullptr);
+    checkCLError(err, "clGetDeviceInfo");
+    return value;
+}
+
+/// Returns a string property of a device (CL_DEVICE_NAME, CL_DRIVER_VERSION, etc.)
+/// @retval empty string on error
+QString clDeviceString(cl_device_id device, cl_device_info param);
+
 } // namespace QCLI
 
 #endif // CLUTILS_H